@@ -0,0 +1,320 @@
+#include "stdafx.h"
+#include "CommandQueue.h"
+
+#include <algorithm>
+
+BLECommandQueue::BLECommandQueue()
+	: _startedCount(0)
+	, _activeCount(0)
+	, _nextWorker(0)
+	, _readyCount(0)
+	, _stopRequested(false)
+	, _nextRequestId(1)
+	, _priority(THREAD_PRIORITY_NORMAL)
+	, _affinity(0)
+	, _workerCount(DefaultWorkerCount)
+{
+	_workers.reserve(MaxWorkerCount);
+	for (size_t i = 0; i < MaxWorkerCount; ++i)
+	{
+		_workers.emplace_back(new Worker());
+	}
+}
+
+BLECommandQueue::~BLECommandQueue()
+{
+	// What the commands would report to may be gone already
+	std::vector<PendingCommand> dropped;
+	StopWorkers(dropped);
+}
+
+int BLECommandQueue::NextRequestId()
+{
+	int requestId = _nextRequestId.fetch_add(1);
+	if (requestId <= 0)
+	{
+		// Wrapped around, 0 means the command ran synchronously
+		_nextRequestId.store(2);
+		requestId = 1;
+	}
+	return requestId;
+}
+
+int BLECommandQueue::Enqueue(const BLEUtils::Uuid& strandKey, Command command, Command cancel)
+{
+	int requestId = NextRequestId();
+
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	if (_startedCount.load() == 0)
+	{
+		StartWorkers();
+	}
+
+	auto& strand = _strands[strandKey];
+	if (!strand)
+	{
+		strand.reset(new Strand{ strandKey, {}, false, false });
+	}
+	strand->commands.push_back({ requestId, std::move(command), std::move(cancel) });
+	if (!strand->scheduled)
+	{
+		strand->scheduled = true;
+		Schedule(strand.get(), _nextWorker++ % _activeCount.load());
+	}
+	return requestId;
+}
+
+void BLECommandQueue::Post(Command command)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	if (_startedCount.load() == 0)
+	{
+		StartWorkers();
+	}
+
+	auto strand = new Strand{ BLEUtils::Uuid(), {}, true, true };
+	strand->commands.push_back({ 0, std::move(command), nullptr });
+	_postedStrands.emplace(strand, std::unique_ptr<Strand>(strand));
+	Schedule(strand, _nextWorker++ % _activeCount.load());
+}
+
+void BLECommandQueue::Stop()
+{
+	std::vector<PendingCommand> dropped;
+	StopWorkers(dropped);
+
+	// In request order, as far as the ids tell. The queue is usable again, they may enqueue more commands.
+	std::sort(dropped.begin(), dropped.end(), [](const PendingCommand& a, const PendingCommand& b) { return a.requestId < b.requestId; });
+	for (auto& command : dropped)
+	{
+		if (command.cancel)
+		{
+			command.cancel(command.requestId);
+		}
+	}
+}
+
+void BLECommandQueue::StopWorkers(std::vector<PendingCommand>& dropped)
+{
+	// Workers take _mutex once their command completes, so the threads are taken under it
+	// and joined without holding it
+	std::vector<std::thread> threads;
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		{
+			const std::lock_guard<std::mutex> sleepLock{ _sleepMutex };
+			_stopRequested.store(true);
+		}
+		for (size_t i = 0; i < _startedCount.load(); ++i)
+		{
+			threads.push_back(std::move(_workers[i]->thread));
+		}
+	}
+	_wakeUp.notify_all();
+	_resume.notify_all();
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	for (auto& worker : _workers)
+	{
+		const std::lock_guard<std::mutex> workerLock{ worker->mutex };
+		worker->ready.clear();
+	}
+	for (auto& strand : _strands)
+	{
+		for (auto& command : strand.second->commands)
+		{
+			dropped.push_back(std::move(command));
+		}
+	}
+	_strands.clear();
+	_postedStrands.clear();
+	_startedCount.store(0);
+	_activeCount.store(0);
+	_readyCount.store(0);
+	_stopRequested.store(false);
+}
+
+void BLECommandQueue::SetPriority(int priority)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_priority = priority;
+	ApplyThreadSettings();
+}
+
+void BLECommandQueue::SetAffinity(std::uint64_t mask)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_affinity = mask;
+	ApplyThreadSettings();
+}
+
+void BLECommandQueue::SetWorkerCount(size_t count)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_workerCount = std::max(std::min(count, (size_t)MaxWorkerCount), (size_t)1);
+	if (_startedCount.load() != 0)
+	{
+		StartWorkers();
+	}
+}
+
+size_t BLECommandQueue::PendingCount() const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	size_t count = 0;
+	for (const auto& strand : _strands)
+	{
+		count += strand.second->commands.size();
+	}
+	for (const auto& strand : _postedStrands)
+	{
+		count += strand.second->commands.size();
+	}
+	return count;
+}
+
+void BLECommandQueue::StartWorkers()
+{
+	// Threads started by a larger count are kept, they wait while surplus
+	size_t startedCount = _startedCount.load();
+	if (_workerCount > startedCount)
+	{
+		_startedCount.store(_workerCount);
+		for (size_t i = startedCount; i < _workerCount; ++i)
+		{
+			_workers[i]->thread = std::thread(&BLECommandQueue::Run, this, i);
+		}
+		ApplyThreadSettings();
+	}
+
+	// Under the sleep lock so that no worker misses the change between checking it and waiting.
+	// Idle surplus workers stop waiting for strands, resumed ones go back to work.
+	{
+		const std::lock_guard<std::mutex> lock{ _sleepMutex };
+		_activeCount.store(_workerCount);
+	}
+	_resume.notify_all();
+	_wakeUp.notify_all();
+}
+
+void BLECommandQueue::ApplyThreadSettings()
+{
+	DWORD_PTR affinity = (DWORD_PTR)_affinity;
+	DWORD_PTR systemAffinity;
+	bool setAffinity = affinity != 0 || GetProcessAffinityMask(GetCurrentProcess(), &affinity, &systemAffinity);
+
+	for (size_t i = 0; i < _startedCount.load(); ++i)
+	{
+		auto& worker = *_workers[i];
+		if (!worker.thread.joinable())
+		{
+			continue; // Being stopped
+		}
+		HANDLE thread = (HANDLE)worker.thread.native_handle();
+		SetThreadPriority(thread, _priority);
+		if (setAffinity)
+		{
+			SetThreadAffinityMask(thread, affinity);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+// Adds the strand to a worker's ready list and wakes up an idle worker
+// --------------------------------------------------------------------------
+void BLECommandQueue::Schedule(Strand* strand, size_t workerIndex)
+{
+	{
+		auto& worker = *_workers[workerIndex];
+		const std::lock_guard<std::mutex> lock{ worker.mutex };
+		worker.ready.push_back(strand);
+	}
+	_readyCount.fetch_add(1);
+
+	const std::lock_guard<std::mutex> lock{ _sleepMutex };
+	_wakeUp.notify_one();
+}
+
+// --------------------------------------------------------------------------
+// Takes the oldest strand of the worker's own list, or steals the newest one of another worker,
+// surplus workers included
+// --------------------------------------------------------------------------
+BLECommandQueue::Strand* BLECommandQueue::TakeReadyStrand(size_t workerIndex)
+{
+	size_t startedCount = _startedCount.load();
+	for (size_t i = 0; i < startedCount; ++i)
+	{
+		auto& worker = *_workers[(workerIndex + i) % startedCount];
+		const std::lock_guard<std::mutex> lock{ worker.mutex };
+		if (!worker.ready.empty())
+		{
+			Strand* strand;
+			if (i == 0)
+			{
+				strand = worker.ready.front();
+				worker.ready.pop_front();
+			}
+			else
+			{
+				strand = worker.ready.back();
+				worker.ready.pop_back();
+			}
+			_readyCount.fetch_sub(1);
+			return strand;
+		}
+	}
+	return nullptr;
+}
+
+// --------------------------------------------------------------------------
+// Worker loop, commands are run without holding any lock
+// --------------------------------------------------------------------------
+void BLECommandQueue::Run(size_t workerIndex)
+{
+	while (!_stopRequested.load())
+	{
+		if (workerIndex >= _activeCount.load())
+		{
+			std::unique_lock<std::mutex> lock{ _sleepMutex };
+			_resume.wait(lock, [this, workerIndex]() { return _stopRequested.load() || workerIndex < _activeCount.load(); });
+			continue;
+		}
+
+		Strand* strand = TakeReadyStrand(workerIndex);
+		if (strand == nullptr)
+		{
+			std::unique_lock<std::mutex> lock{ _sleepMutex };
+			_wakeUp.wait(lock, [this, workerIndex]() { return _stopRequested.load() || _readyCount.load() > 0 || workerIndex >= _activeCount.load(); });
+			continue;
+		}
+
+		PendingCommand command;
+		{
+			const std::lock_guard<std::mutex> lock{ _mutex };
+			command = std::move(strand->commands.front());
+			strand->commands.pop_front();
+		}
+
+		command.command(command.requestId);
+
+		// Back in line if there is more to do, the strand goes away otherwise
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		if (!strand->commands.empty())
+		{
+			Schedule(strand, workerIndex < _activeCount.load() ? workerIndex : _nextWorker++ % _activeCount.load());
+		}
+		else if (strand->posted)
+		{
+			_postedStrands.erase(strand);
+		}
+		else
+		{
+			_strands.erase(_strands.find(strand->key));
+		}
+	}
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Utils.h"
+
+// --------------------------------------------------------------------------
+// Runs commands on a small pool of worker threads so that blocking Bluetooth
+// I/O never happens on the caller's thread.
+//
+// Commands are queued on strands, one per device: the commands of a strand
+// run one after the other in order, while different strands run in parallel.
+// A strand with pending commands sits in one worker's ready list, idle workers
+// steal ready strands from the others. A strand runs one command per turn and
+// then goes to the back of the list, so a busy device doesn't starve others.
+//
+// The number of workers can be changed while they run: extra workers are
+// started right away, surplus ones stop taking strands and wait until they
+// are needed again, their ready lists are emptied by the other workers.
+//
+// Each command gets a request id, non zero, which is passed to it when it
+// runs so that it can report its outcome. Posted commands are helper work of
+// another command instead: each one runs on its own, alongside any other, and
+// gets 0 as its request id. A command dropped by Stop() before
+// it ran gets its cancel function called instead, if it has one, except when
+// the queue is destroyed.
+// Stop() is meant to be called from the thread that enqueues commands,
+// commands themselves may enqueue more commands.
+// --------------------------------------------------------------------------
+class BLECommandQueue
+{
+public:
+	typedef std::function<void(int requestId)> Command;
+
+	static const size_t DefaultWorkerCount = 4;
+	static const size_t MaxWorkerCount = 64;
+
+	BLECommandQueue();
+	~BLECommandQueue();
+
+	BLECommandQueue(const BLECommandQueue&) = delete;
+	BLECommandQueue& operator=(const BLECommandQueue&) = delete;
+
+	// Queues the command on the strand of the given device, starting the workers if needed,
+	// and returns its request id
+	int Enqueue(const BLEUtils::Uuid& strand, Command command, Command cancel = nullptr);
+
+	// Queues the command outside of the strands, the next idle worker runs it. Dropped without
+	// notice by Stop(), the poster must not rely on it running.
+	void Post(Command command);
+
+	// Drops the commands that haven't started and waits for the running ones to complete,
+	// then calls the cancel function of the dropped commands on the calling thread
+	void Stop();
+
+	// Applied to the workers right away if they are running, or when they start.
+	// Priority is one of the THREAD_PRIORITY_* values, an affinity of 0 lets the threads run on any core.
+	void SetPriority(int priority);
+	void SetAffinity(std::uint64_t mask);
+
+	// Applied right away if the workers are running, or when they start, clamped to [1, MaxWorkerCount]
+	void SetWorkerCount(size_t count);
+
+	size_t PendingCount() const;
+
+private:
+	struct PendingCommand
+	{
+		int requestId;
+		Command command;
+		Command cancel;
+	};
+
+	struct Strand
+	{
+		BLEUtils::Uuid key;
+		std::deque<PendingCommand> commands;
+		bool scheduled; // In a ready list or running
+		bool posted; // Holds a single posted command, not in _strands
+	};
+
+	struct Worker
+	{
+		std::thread thread;
+		std::mutex mutex;
+		std::deque<Strand*> ready;
+	};
+
+	int NextRequestId();
+	void StopWorkers(std::vector<PendingCommand>& dropped); // Joins the workers, returns the commands that didn't run
+	void StartWorkers();		// Must be called with _mutex held, starts the missing workers
+	void ApplyThreadSettings();	// Must be called with _mutex held
+	void Schedule(Strand* strand, size_t workerIndex);
+	Strand* TakeReadyStrand(size_t workerIndex);
+	void Run(size_t workerIndex);
+
+	// Strands and their commands, and the workers lifetime.
+	// The workers are allocated up front so that the list never moves while they scan it,
+	// those below _startedCount have a thread and those below _activeCount take strands.
+	mutable std::mutex _mutex;
+	std::unordered_map<BLEUtils::Uuid, std::unique_ptr<Strand>> _strands;
+	std::unordered_map<Strand*, std::unique_ptr<Strand>> _postedStrands;
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::atomic<size_t> _startedCount;
+	std::atomic<size_t> _activeCount;
+	size_t _nextWorker;
+
+	// Idle workers wait for ready strands, surplus ones until they are active again
+	std::mutex _sleepMutex;
+	std::condition_variable _wakeUp;
+	std::condition_variable _resume;
+	std::atomic<int> _readyCount;
+	std::atomic<bool> _stopRequested;
+
+	std::atomic<int> _nextRequestId;
+	int _priority;
+	std::uint64_t _affinity;
+	size_t _workerCount;
+};
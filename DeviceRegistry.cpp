@@ -0,0 +1,424 @@
+#include "stdafx.h"
+#include "DeviceRegistry.h"
+
+#include <algorithm>	// std::remove
+
+namespace
+{
+	// Heap memory of the containers. Node based containers are counted as the bucket
+	// array plus a node per element, which is how the standard library lays them out.
+	size_t HeapBytes(const std::string& s)
+	{
+		// Short strings are stored inside the object
+		auto data = (const char*)s.data();
+		bool isInline = data >= (const char*)&s && data < (const char*)(&s + 1);
+		return isInline ? 0 : s.capacity() + 1;
+	}
+
+	template <typename T>
+	size_t HeapBytes(const std::vector<T>& v)
+	{
+		return v.capacity() * sizeof(T);
+	}
+
+	template <typename K, typename V, typename H>
+	size_t HeapBytes(const std::unordered_map<K, V, H>& m)
+	{
+		return m.bucket_count() * sizeof(void*) + m.size() * (sizeof(std::pair<const K, V>) + 2 * sizeof(void*));
+	}
+
+	size_t OwnedBytes(BLEConnectedServiceInfo* cservice)
+	{
+		size_t bytes = HeapBytes(cservice->characteristics) + HeapBytes(cservice->characteristicIndices)
+			+ HeapBytes(cservice->valueBuffers)
+			+ cservice->characteristics.size() * (sizeof(std::atomic<bool>) + sizeof(std::atomic<ULONG>));
+
+		const std::lock_guard<std::mutex> lock{ cservice->subscriptionMutex };
+		bytes += HeapBytes(cservice->subscriptions) + HeapBytes(cservice->descriptors);
+		for (const auto& descriptors : cservice->descriptors)
+		{
+			bytes += HeapBytes(descriptors);
+		}
+		return bytes;
+	}
+}
+
+// --------------------------------------------------------------------------
+// BLEConnectedServiceInfo
+// --------------------------------------------------------------------------
+PBTH_LE_GATT_CHARACTERISTIC BLEConnectedServiceInfo::FindCharacteristic(const BLEUtils::Uuid& characteristic)
+{
+	auto it = characteristicIndices.find(characteristic);
+	return it != characteristicIndices.end() ? &characteristics[it->second] : nullptr;
+}
+
+void BLEConnectedServiceInfo::SetCharacteristics(std::vector<BTH_LE_GATT_CHARACTERISTIC>&& gattCharacteristics)
+{
+	characteristics = std::move(gattCharacteristics);
+	characteristicIndices.clear();
+	for (size_t i = 0; i < characteristics.size(); ++i)
+	{
+		characteristicIndices.emplace(BLEUtils::ToUuid(characteristics[i].CharacteristicUuid), i);
+	}
+
+	descriptors.assign(characteristics.size(), {});
+
+	valueBuffers.assign(characteristics.size() * ValueBufferStride, 0);
+	valueBuffersInUse.reset(new std::atomic<bool>[characteristics.size()]);
+	valueSizes.reset(new std::atomic<ULONG>[characteristics.size()]);
+	for (size_t i = 0; i < characteristics.size(); ++i)
+	{
+		valueBuffersInUse[i].store(false);
+		valueSizes[i].store(0);
+	}
+}
+
+PBTH_LE_GATT_CHARACTERISTIC_VALUE BLEConnectedServiceInfo::AcquireValueBuffer(const BTH_LE_GATT_CHARACTERISTIC* characteristic, size_t length)
+{
+	size_t index = characteristic - characteristics.data();
+	if (index >= characteristics.size() || length > MaxValueSize)
+	{
+		return nullptr;
+	}
+
+	if (valueBuffersInUse[index].exchange(true, std::memory_order_acquire))
+	{
+		return nullptr;
+	}
+	auto value = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)(valueBuffers.data() + index * ValueBufferStride);
+	value->DataSize = (ULONG)length;
+	return value;
+}
+
+void BLEConnectedServiceInfo::ReleaseValueBuffer(PBTH_LE_GATT_CHARACTERISTIC_VALUE value)
+{
+	size_t index = ((unsigned char*)value - valueBuffers.data()) / ValueBufferStride;
+	valueBuffersInUse[index].store(false, std::memory_order_release);
+}
+
+ULONG BLEConnectedServiceInfo::LastValueSize(const BTH_LE_GATT_CHARACTERISTIC* characteristic) const
+{
+	size_t index = characteristic - characteristics.data();
+	return index < characteristics.size() ? valueSizes[index].load(std::memory_order_relaxed) : 0;
+}
+
+void BLEConnectedServiceInfo::SetLastValueSize(const BTH_LE_GATT_CHARACTERISTIC* characteristic, ULONG size)
+{
+	size_t index = characteristic - characteristics.data();
+	if (index < characteristics.size())
+	{
+		valueSizes[index].store(size, std::memory_order_relaxed);
+	}
+}
+
+// --------------------------------------------------------------------------
+// BLERegistrySnapshot
+// --------------------------------------------------------------------------
+const BLEDeviceInfo* BLERegistrySnapshot::FindDevice(const BLEUtils::Uuid& containerId) const
+{
+	auto it = devicesById.find(containerId);
+	return it != devicesById.end() ? it->second : nullptr;
+}
+
+const BLEServiceInfo* BLERegistrySnapshot::FindService(const BLEUtils::Uuid& containerId, const BLEUtils::Uuid& serviceId) const
+{
+	auto it = servicesByKey.find({ containerId, serviceId });
+	return it != servicesByKey.end() ? it->second : nullptr;
+}
+
+BLEConnectedServiceInfo* BLERegistrySnapshot::FindConnectedService(const BLEUtils::Uuid& containerId, const BLEUtils::Uuid& serviceId) const
+{
+	auto it = connectedServicesByKey.find({ containerId, serviceId });
+	return it != connectedServicesByKey.end() ? it->second : nullptr;
+}
+
+bool BLERegistrySnapshot::IsServiceConnected(const BLEServiceInfo* service) const
+{
+	size_t word = service->index / 64;
+	return word < connectedServicesBitmap.size() && (connectedServicesBitmap[word] >> (service->index % 64)) & 1;
+}
+
+void BLERegistrySnapshot::AddDevice(const BLEDeviceInfo* device)
+{
+	devices.push_back(device);
+	devicesById[device->containerId] = device;
+}
+
+void BLERegistrySnapshot::RemoveDevice(const BLEDeviceInfo* device)
+{
+	devices.erase(std::remove(devices.begin(), devices.end(), device), devices.end());
+	auto it = devicesById.find(device->containerId);
+	if (it != devicesById.end() && it->second == device)
+	{
+		devicesById.erase(it);
+	}
+}
+
+void BLERegistrySnapshot::AddService(BLEServiceInfo* service)
+{
+	if (!freeServiceIndices.empty())
+	{
+		service->index = freeServiceIndices.back();
+		freeServiceIndices.pop_back();
+		services[service->index] = service;
+	}
+	else
+	{
+		service->index = services.size();
+		services.push_back(service);
+	}
+	servicesByKey[{ service->containerId, service->id }] = service;
+	servicesByUuid[service->id].push_back(service);
+}
+
+void BLERegistrySnapshot::RemoveService(const BLEServiceInfo* service)
+{
+	if (service->index >= services.size() || services[service->index] != service)
+	{
+		return;
+	}
+
+	SetServiceConnected(service, false);
+	services[service->index] = nullptr;
+	freeServiceIndices.push_back(service->index);
+
+	auto keyIt = servicesByKey.find({ service->containerId, service->id });
+	if (keyIt != servicesByKey.end() && keyIt->second == service)
+	{
+		servicesByKey.erase(keyIt);
+	}
+
+	auto uuidIt = servicesByUuid.find(service->id);
+	if (uuidIt != servicesByUuid.end())
+	{
+		auto& uuidServices = uuidIt->second;
+		uuidServices.erase(std::remove(uuidServices.begin(), uuidServices.end(), service), uuidServices.end());
+		if (uuidServices.empty())
+		{
+			servicesByUuid.erase(uuidIt);
+		}
+	}
+}
+
+void BLERegistrySnapshot::AddConnectedService(BLEConnectedServiceInfo* cservice)
+{
+	const auto& device = cservice->service->containerId;
+	connectedServicesByDevice[device].push_back(cservice);
+	connectedServicesByKey[{ device, cservice->service->id }] = cservice;
+	SetServiceConnected(cservice->service, true);
+}
+
+void BLERegistrySnapshot::RemoveConnectedService(BLEConnectedServiceInfo* cservice)
+{
+	const auto& device = cservice->service->containerId;
+	auto devIt = connectedServicesByDevice.find(device);
+	if (devIt != connectedServicesByDevice.end())
+	{
+		auto& deviceServices = devIt->second;
+		deviceServices.erase(std::remove(deviceServices.begin(), deviceServices.end(), cservice), deviceServices.end());
+		if (deviceServices.empty())
+		{
+			connectedServicesByDevice.erase(devIt);
+		}
+	}
+
+	auto keyIt = connectedServicesByKey.find({ device, cservice->service->id });
+	if (keyIt != connectedServicesByKey.end() && keyIt->second == cservice)
+	{
+		connectedServicesByKey.erase(keyIt);
+	}
+	SetServiceConnected(cservice->service, false);
+}
+
+void BLERegistrySnapshot::SetServiceConnected(const BLEServiceInfo* service, bool connected)
+{
+	size_t word = service->index / 64;
+	if (word >= connectedServicesBitmap.size())
+	{
+		connectedServicesBitmap.resize(word + 1, 0);
+	}
+	std::uint64_t bit = std::uint64_t(1) << (service->index % 64);
+	connectedServicesBitmap[word] = connected ? (connectedServicesBitmap[word] | bit) : (connectedServicesBitmap[word] & ~bit);
+}
+
+// --------------------------------------------------------------------------
+// BLEDeviceRegistry
+// --------------------------------------------------------------------------
+BLEDeviceRegistry::BLEDeviceRegistry()
+	: _current{ new BLERegistrySnapshot() }
+{
+}
+
+BLEDeviceRegistry::~BLEDeviceRegistry()
+{
+	Reset();
+	delete _current.load();
+}
+
+BLEDeviceRegistry::Reader BLEDeviceRegistry::Read()
+{
+	auto guard = _epochs.Enter();
+	return Reader(std::move(guard), _current.load());
+}
+
+BLEDeviceRegistry::Writer BLEDeviceRegistry::Write()
+{
+	return Writer(this);
+}
+
+void BLEDeviceRegistry::Delete(const BLEDeviceInfo* device)
+{
+	_devicePool.Delete(const_cast<BLEDeviceInfo*>(device));
+}
+
+void BLEDeviceRegistry::Delete(const BLEServiceInfo* service)
+{
+	_servicePool.Delete(const_cast<BLEServiceInfo*>(service));
+}
+
+void BLEDeviceRegistry::Delete(const BLEConnectedServiceInfo* cservice)
+{
+	if (cservice != nullptr)
+	{
+		for (const auto& subscription : cservice->subscriptions)
+		{
+			Delete(subscription.second);
+		}
+		_connectedServicePool.Delete(const_cast<BLEConnectedServiceInfo*>(cservice));
+	}
+}
+
+void BLEDeviceRegistry::Delete(const BLERegisteredCharacteristicInfo* subscription)
+{
+	_subscriptionPool.Delete(const_cast<BLERegisteredCharacteristicInfo*>(subscription));
+}
+
+void BLEDeviceRegistry::Reset()
+{
+	Write().Clear();
+
+	const std::lock_guard<std::mutex> lock{ _writeMutex };
+	_epochs.WaitForReadersAndCollect();
+	_devicePool.Reset();
+	_servicePool.Reset();
+	_connectedServicePool.Reset();
+	_subscriptionPool.Reset();
+}
+
+size_t BLEDeviceRegistry::BytesInUse()
+{
+	size_t bytes = _devicePool.BytesInUse() + _servicePool.BytesInUse()
+		+ _connectedServicePool.BytesInUse() + _subscriptionPool.BytesInUse();
+
+	// What the entries and the current snapshot own
+	auto snapshot = Read();
+	bytes += sizeof(BLERegistrySnapshot) + HeapBytes(snapshot->devices) + HeapBytes(snapshot->devicesById)
+		+ HeapBytes(snapshot->services) + HeapBytes(snapshot->freeServiceIndices) + HeapBytes(snapshot->servicesByKey)
+		+ HeapBytes(snapshot->servicesByUuid) + HeapBytes(snapshot->connectedServicesBitmap)
+		+ HeapBytes(snapshot->connectedServicesByDevice) + HeapBytes(snapshot->connectedServicesByKey);
+	for (auto device : snapshot->devices)
+	{
+		bytes += HeapBytes(device->deviceName);
+	}
+	for (auto service : snapshot->services)
+	{
+		if (service != nullptr)
+		{
+			bytes += HeapBytes(service->name) + HeapBytes(service->path);
+		}
+	}
+	for (const auto& services : snapshot->servicesByUuid)
+	{
+		bytes += HeapBytes(services.second);
+	}
+	for (const auto& cservices : snapshot->connectedServicesByDevice)
+	{
+		bytes += HeapBytes(cservices.second);
+		for (auto cservice : cservices.second)
+		{
+			bytes += OwnedBytes(cservice);
+		}
+	}
+	return bytes;
+}
+
+size_t BLEDeviceRegistry::BytesReserved() const
+{
+	return _devicePool.BytesReserved() + _servicePool.BytesReserved()
+		+ _connectedServicePool.BytesReserved() + _subscriptionPool.BytesReserved();
+}
+
+BLEDeviceRegistry::Writer::Writer(BLEDeviceRegistry* registry)
+	: _registry(registry)
+	, _lock(registry->_writeMutex)
+	, _next(nullptr)
+{
+}
+
+BLEDeviceRegistry::Writer::Writer(Writer&& other)
+	: _registry(other._registry)
+	, _lock(std::move(other._lock))
+	, _next(other._next)
+	, _retired(std::move(other._retired))
+{
+	other._registry = nullptr;
+	other._next = nullptr;
+}
+
+BLEDeviceRegistry::Writer::~Writer()
+{
+	if (_registry == nullptr)
+	{
+		return;
+	}
+
+	if (_next != nullptr)
+	{
+		// Publish, then retire the previous version
+		const BLERegistrySnapshot* previous = _registry->_current.exchange(_next);
+		_registry->_epochs.Retire([previous]() { delete previous; });
+	}
+
+	// Entries removed by this writer were reachable from the previous version,
+	// so they can only be retired once the new one is published
+	for (auto& deleter : _retired)
+	{
+		_registry->_epochs.Retire(std::move(deleter));
+	}
+	_registry->_epochs.Collect();
+}
+
+const BLERegistrySnapshot& BLEDeviceRegistry::Writer::Current() const
+{
+	return _next != nullptr ? *_next : *_registry->_current.load();
+}
+
+BLERegistrySnapshot& BLEDeviceRegistry::Writer::Edit()
+{
+	if (_next == nullptr)
+	{
+		_next = new BLERegistrySnapshot(*_registry->_current.load());
+	}
+	return *_next;
+}
+
+void BLEDeviceRegistry::Writer::Clear()
+{
+	auto& snapshot = Edit();
+	for (const auto& device : snapshot.connectedServicesByDevice)
+	{
+		for (auto cservice : device.second)
+		{
+			Retire(cservice);
+		}
+	}
+	for (auto service : snapshot.services)
+	{
+		Retire(service);
+	}
+	for (auto device : snapshot.devices)
+	{
+		Retire(device);
+	}
+	snapshot = BLERegistrySnapshot();
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <windows.h>
+#include <bthdef.h>
+#include <bluetoothleapis.h>
+
+#include <atomic>
+#include <cstddef>		// offsetof
+#include <cstdint>
+#include <memory>		// std::unique_ptr
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Utils.h"
+#include "EpochManager.h"
+#include "ObjectPool.h"
+
+struct BLEDeviceInfo
+{
+	BLEUtils::Uuid containerId;
+	std::string deviceName;
+};
+
+struct BLEServiceInfo
+{
+	BLEUtils::Uuid containerId; // Used to match service and devices...
+	BLEUtils::Uuid id;
+	std::string name;
+	std::string path;
+	size_t index; // Position in services, used by the connected services bitmap, stable until removed
+};
+
+struct BLERegisteredCharacteristicInfo;
+
+struct BLEConnectedServiceInfo
+{
+	HANDLE deviceHandle;
+	BTH_LE_GATT_SERVICE gattService;
+	const BLEServiceInfo* service;
+	std::vector<BTH_LE_GATT_CHARACTERISTIC> characteristics;
+	std::unordered_map<BLEUtils::Uuid, size_t> characteristicIndices; // Characteristic UUID to index in characteristics
+
+	// Guards subscriptions, descriptors and disconnected. Subscribing does its GATT I/O under
+	// this lock rather than the registry writer, so it only holds up this service.
+	// Taken after the registry writer when both are needed.
+	std::mutex subscriptionMutex;
+
+	// By characteristic UUID, unlike the rest of the registry this isn't part of the snapshots
+	std::unordered_map<BLEUtils::Uuid, BLERegisteredCharacteristicInfo*> subscriptions;
+
+	// Descriptors of each characteristic, empty until looked up
+	std::vector<std::vector<BTH_LE_GATT_DESCRIPTOR>> descriptors;
+
+	// Set once removed from the registry, no subscription may be added anymore
+	bool disconnected;
+
+	// Fingerprint of the device's services, under which the GATT cache stores this service
+	std::uint64_t gattFingerprint;
+
+	// One value buffer per characteristic, allocated along with the characteristics so that
+	// writing a value doesn't allocate. Windows doesn't tell the negotiated MTU, so they are
+	// sized for the largest attribute value the protocol allows.
+	static const size_t MaxValueSize = 512;
+	static const size_t ValueBufferStride = (offsetof(BTH_LE_GATT_CHARACTERISTIC_VALUE, Data) + MaxValueSize + 7) & ~(size_t)7;
+	std::vector<unsigned char> valueBuffers;
+	std::unique_ptr<std::atomic<bool>[]> valueBuffersInUse;
+
+	// Size of the last value read from each characteristic, 0 until read
+	std::unique_ptr<std::atomic<ULONG>[]> valueSizes;
+
+	PBTH_LE_GATT_CHARACTERISTIC FindCharacteristic(const BLEUtils::Uuid& characteristic);
+	void SetCharacteristics(std::vector<BTH_LE_GATT_CHARACTERISTIC>&& gattCharacteristics);
+
+	// Returns the characteristic's buffer with its data size set, or null if it's
+	// being used by another write or if length is too large
+	PBTH_LE_GATT_CHARACTERISTIC_VALUE AcquireValueBuffer(const BTH_LE_GATT_CHARACTERISTIC* characteristic, size_t length);
+	void ReleaseValueBuffer(PBTH_LE_GATT_CHARACTERISTIC_VALUE value);
+
+	ULONG LastValueSize(const BTH_LE_GATT_CHARACTERISTIC* characteristic) const;
+	void SetLastValueSize(const BTH_LE_GATT_CHARACTERISTIC* characteristic, ULONG size);
+};
+
+struct BLERegisteredCharacteristicInfo
+{
+	BLEConnectedServiceInfo* service;
+	BTH_LE_GATT_CHARACTERISTIC characteristic;
+	BLUETOOTH_GATT_EVENT_HANDLE characteristicHandle; // Shared by the subscriptions registered together, as is the context
+	BTH_LE_GATT_DESCRIPTOR clientConfig; // Kept to resume the subscription without looking it up again
+	void* context; // Our entry in the subscription table, passed to the notification callback
+};
+
+// Key of a service, i.e. the device container id and the service UUID
+struct BLEServiceKey
+{
+	BLEUtils::Uuid device;
+	BLEUtils::Uuid service;
+
+	bool operator==(const BLEServiceKey& other) const { return device == other.device && service == other.service; }
+};
+
+struct BLEServiceKeyHash
+{
+	size_t operator()(const BLEServiceKey& key) const
+	{
+		size_t h = key.device.Hash();
+		return h ^ (key.service.Hash() + 0x9E3779B9 + (h << 6) + (h >> 2));
+	}
+};
+
+// --------------------------------------------------------------------------
+// One version of the registry, never modified once published.
+// Services are indexed by service UUID, and there is one bit per entry of
+// services that is set while it is connected. Removed services leave a null
+// entry in services, which the next added service reuses. Connected services are indexed
+// by device, for teardown, and by device + service UUID for GATT operations.
+// --------------------------------------------------------------------------
+struct BLERegistrySnapshot
+{
+	std::vector<const BLEDeviceInfo*> devices;
+	std::unordered_map<BLEUtils::Uuid, const BLEDeviceInfo*> devicesById;
+	std::vector<const BLEServiceInfo*> services; // May contain null entries
+	std::vector<size_t> freeServiceIndices;
+	std::unordered_map<BLEServiceKey, const BLEServiceInfo*, BLEServiceKeyHash> servicesByKey;
+	std::unordered_map<BLEUtils::Uuid, std::vector<const BLEServiceInfo*>> servicesByUuid;
+	std::vector<std::uint64_t> connectedServicesBitmap;
+	std::unordered_map<BLEUtils::Uuid, std::vector<BLEConnectedServiceInfo*>> connectedServicesByDevice;
+	std::unordered_map<BLEServiceKey, BLEConnectedServiceInfo*, BLEServiceKeyHash> connectedServicesByKey;
+
+	const BLEDeviceInfo* FindDevice(const BLEUtils::Uuid& containerId) const;
+	const BLEServiceInfo* FindService(const BLEUtils::Uuid& containerId, const BLEUtils::Uuid& serviceId) const;
+	BLEConnectedServiceInfo* FindConnectedService(const BLEUtils::Uuid& containerId, const BLEUtils::Uuid& serviceId) const;
+	bool IsServiceConnected(const BLEServiceInfo* service) const;
+
+	// Only used by writers on the copy they are editing
+	void AddDevice(const BLEDeviceInfo* device);
+	void RemoveDevice(const BLEDeviceInfo* device);
+	void AddService(BLEServiceInfo* service);
+	void RemoveService(const BLEServiceInfo* service);
+	void AddConnectedService(BLEConnectedServiceInfo* cservice);
+	void RemoveConnectedService(BLEConnectedServiceInfo* cservice);
+	void SetServiceConnected(const BLEServiceInfo* service, bool connected);
+};
+
+// --------------------------------------------------------------------------
+// The registry of devices, services and connections, readable from any thread.
+//
+// Readers get the current snapshot without taking any lock. Writers are
+// serialized, edit a copy of the current snapshot and publish it atomically
+// when done. Replaced snapshots, and the entries writers removed, are freed
+// once no reader can still be using them.
+//
+// Entries are allocated from the registry pools, New* entries must either be
+// added to a snapshot or given back with Delete().
+// --------------------------------------------------------------------------
+class BLEDeviceRegistry
+{
+public:
+	class Reader
+	{
+	public:
+		const BLERegistrySnapshot* operator->() const { return _snapshot; }
+		const BLERegistrySnapshot& operator*() const { return *_snapshot; }
+
+	private:
+		friend class BLEDeviceRegistry;
+		Reader(BLEEpochManager::Guard&& guard, const BLERegistrySnapshot* snapshot)
+			: _guard(std::move(guard)), _snapshot(snapshot) {}
+
+		BLEEpochManager::Guard _guard;
+		const BLERegistrySnapshot* _snapshot;
+	};
+
+	class Writer
+	{
+	public:
+		Writer(Writer&& other);
+		~Writer(); // Publishes the edited snapshot, if any
+
+		Writer(const Writer&) = delete;
+		Writer& operator=(const Writer&) = delete;
+
+		// The snapshot being edited if Edit() was called, otherwise the current one
+		const BLERegistrySnapshot& Current() const;
+
+		// Copies the current snapshot on first call
+		BLERegistrySnapshot& Edit();
+
+		// Frees an entry once no reader can see it anymore, the deleter may also release OS resources
+		template <typename T>
+		void Retire(T* entry)
+		{
+			auto registry = _registry;
+			_retired.push_back([registry, entry]() { registry->Delete(entry); });
+		}
+		void Retire(std::function<void()> deleter) { _retired.push_back(std::move(deleter)); }
+
+		// Removes and retires every entry
+		void Clear();
+
+	private:
+		friend class BLEDeviceRegistry;
+		explicit Writer(BLEDeviceRegistry* registry);
+
+		BLEDeviceRegistry* _registry;
+		std::unique_lock<std::mutex> _lock;
+		BLERegistrySnapshot* _next;
+		std::vector<std::function<void()>> _retired; // Handed to the epoch manager once _next is published
+	};
+
+	BLEDeviceRegistry();
+	~BLEDeviceRegistry();
+
+	Reader Read();
+	Writer Write();
+
+	BLEDeviceInfo* NewDevice() { return _devicePool.New(); }
+	BLEServiceInfo* NewService() { return _servicePool.New(); }
+	BLEConnectedServiceInfo* NewConnectedService() { return _connectedServicePool.New(); }
+	BLERegisteredCharacteristicInfo* NewSubscription() { return _subscriptionPool.New(); }
+
+	// Entries must not be reachable from any snapshot anymore, see Writer::Retire()
+	void Delete(const BLEDeviceInfo* device);
+	void Delete(const BLEServiceInfo* service);
+	void Delete(const BLEConnectedServiceInfo* cservice); // Along with its remaining subscriptions
+	void Delete(const BLERegisteredCharacteristicInfo* subscription);
+
+	// Removes every entry, waits for the readers to be done and gives the pools memory back
+	void Reset();
+
+	// Memory taken by the entries along with what they own, e.g. names, characteristics
+	// and value buffers, and by the current snapshot. Entries that were removed but
+	// not freed yet only count their slot.
+	size_t BytesInUse();
+
+	// Memory held by the pools, including free slots
+	size_t BytesReserved() const;
+
+private:
+	std::mutex _writeMutex;
+	std::atomic<const BLERegistrySnapshot*> _current;
+	BLEEpochManager _epochs;
+
+	BLEObjectPool<BLEDeviceInfo> _devicePool;
+	BLEObjectPool<BLEServiceInfo> _servicePool;
+	BLEObjectPool<BLEConnectedServiceInfo> _connectedServicePool;
+	BLEObjectPool<BLERegisteredCharacteristicInfo> _subscriptionPool;
+};
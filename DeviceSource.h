@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+struct BLERegistrySnapshot;
+
+// --------------------------------------------------------------------------
+// What a device source found during one enumeration
+// --------------------------------------------------------------------------
+struct BLEScanResult
+{
+	struct Device
+	{
+		BLEUtils::Uuid containerId;
+		std::string name;
+	};
+
+	struct Service
+	{
+		BLEUtils::Uuid containerId;
+		BLEUtils::Uuid id;
+		bool hasDetails; // False when name and path were skipped because the service is already known
+		std::string name;
+		std::string path;
+	};
+
+	std::vector<Device> devices;
+	std::vector<Service> services;
+	std::vector<std::string> errors; // Non fatal problems met along the way
+};
+
+// --------------------------------------------------------------------------
+// Told about each entry as soon as the source finds it, so results can be
+// used before the whole enumeration is done
+// --------------------------------------------------------------------------
+class BLEScanObserver
+{
+public:
+	virtual ~BLEScanObserver() {}
+
+	virtual void DeviceFound(const BLEScanResult::Device& device) = 0;
+	virtual void ServiceFound(const BLEScanResult::Service& service) = 0;
+};
+
+// --------------------------------------------------------------------------
+// Lists the Bluetooth LE devices and services present on the system, the
+// scanner doesn't care where they come from
+// --------------------------------------------------------------------------
+class BLEDeviceSource
+{
+public:
+	virtual ~BLEDeviceSource() {}
+
+	// Fills result with what is currently present, details of the services that are
+	// already in known may be left out. Returns false if the enumeration failed.
+	// The observer, if any, is called from the same thread as each entry is added.
+	virtual bool Enumerate(const BLERegistrySnapshot& known, BLEScanResult& result, BLEScanObserver* observer) = 0;
+};
@@ -2,6 +2,15 @@
 #include "stdafx.h"
 #include "DiceBLEWin.h"
 #include "Utils.h"
+#include "ServiceFilter.h"
+#include "SubscriptionTable.h"
+#include "DeviceRegistry.h"
+#include "SetupDiDeviceSource.h"
+#include "ScanScheduler.h"
+#include "CommandQueue.h"
+#include "GattCache.h"
+#include "ReadCoalescer.h"
+#include "PollScheduler.h"
 
 #pragma warning (disable: 4068)
 
@@ -20,10 +29,14 @@
 #include <string>
 #include <locale>
 #include <array>
+#include <memory>		// std::unique_ptr
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>	// std::find_if
-#include <regex>
+#include <atomic>
 #include <mutex>		// std::mutex, std::unique_lock, std::defer_lock
+#include <condition_variable>
 #include <thread>		// std::this_thread::get_id
 #include <ctime>		// std::gmtime
 #include <chrono>		// std::system_clock
@@ -60,40 +73,95 @@ static DebugCallback debugWarningCallback = nullptr;
 static DebugCallback debugErrorCallback = nullptr;
 static SendBluetoothMessageCallback sendMessageCallback = nullptr;
 
-struct BLEDeviceInfo
-{
-	GUID containerId;
-	std::string deviceName;
-};
+// Devices, services and connections, see BLEDeviceRegistry
+BLEDeviceRegistry registry;
+
+// Subscriptions as seen by the notification callback, see HandleBLENotification()
+BLESubscriptionTable subscriptionTable;
+
+// GATT tables of the devices we connected to, kept on disk when a path is set, see connectToPeripheral()
+BLEGattCache gattCache;
 
-struct BLEServiceInfo
+// What each device was subscribed to when it was last disconnected, see resumePeripheral()
+struct DeviceSession
 {
-	GUID containerId; // Used to match service and devices...
-	BTH_LE_UUID id;
-	std::string name;
-	std::string path;
-	BLEDeviceInfo* device;
+	struct Subscription
+	{
+		BLEUtils::Uuid service;
+		BLEUtils::Uuid characteristic;
+		BTH_LE_GATT_DESCRIPTOR clientConfig;
+	};
+	std::vector<Subscription> subscriptions;
 };
-
-struct BLEConnectedServiceInfo
+std::mutex sessionMutex;
+std::unordered_map<BLEUtils::Uuid, DeviceSession> deviceSessions;
+
+// Where scans get the devices from, and the background thread running them while scanning
+std::unique_ptr<BLEDeviceSource> deviceSource{ new BLESetupDiDeviceSource() };
+BLEScanScheduler scanScheduler;
+
+// Devices reported since scanning started and the name they were reported with,
+// so each scan only sends what changed, see notifyScanChanges(), and the errors
+// sent since then, see reportScanErrors().
+// Along with the filter of the current scan, shared with the scan thread.
+std::mutex scanMutex;
+std::unordered_map<BLEUtils::Uuid, std::string> scannedDevices;
+std::unordered_set<std::string> reportedScanErrors;
+BLEServiceFilter scanFilter;
+bool scanAllDevices = true;
+
+// Service filters registered by the mono side, and the ones parsed from the string based API
+// (the same filter string is typically passed on every scan, so we only parse it once)
+std::unordered_map<int, BLEServiceFilter> registeredServiceFilters;
+int nextServiceFilterId = 1;
+std::unordered_map<std::string, BLEServiceFilter> parsedServiceFilters;
+const size_t maxParsedServiceFilters = 16;
+
+// Bulk writes, see writeCharacteristicBulk(). Without the negotiated MTU, chunks default to
+// what fits in the smallest one.
+const int defaultBulkChunkSize = 20;
+const int defaultBulkAckInterval = 16;
+const std::chrono::milliseconds bulkProgressInterval{ 100 };
+const std::chrono::milliseconds bulkUnacknowledgedPause{ 15 }; // A couple of connection intervals
+
+// When enabled, GATT operations are queued and run on the command threads instead of the caller's thread,
+// in order for a given device and in parallel across devices
+std::atomic<bool> asyncCommands{ false };
+BLECommandQueue commandQueue;
+
+// Outcome of the command running on the current thread, errors sent while it runs mark it as failed
+struct CommandStatus
 {
-	HANDLE deviceHandle;
-	BTH_LE_GATT_SERVICE gattService;
-	BLEServiceInfo* service;
-	std::vector<BTH_LE_GATT_CHARACTERISTIC> characteristics;
+	bool failed;
+	std::string error;
 };
+thread_local CommandStatus* currentCommand = nullptr;
 
-struct BLERegisteredCharacteristicInfo
+// Reads of a characteristic requested while another one is in flight share its result
+BLEReadCoalescer readCoalescer;
+
+// Characteristics read periodically by the poll scheduler, by poll id. The reads run
+// on the device strands whether or not commands are async.
+struct PollTarget
 {
-	BLEConnectedServiceInfo* service;
-	BTH_LE_GATT_CHARACTERISTIC characteristic;
-	BLUETOOTH_GATT_EVENT_HANDLE characteristicHandle;
+	std::string address;
+	std::string characteristic; // As given, for the messages
+	BLEReadKey key;
+	bool inFlight; // Polls are skipped until the previous read has run
+	bool hasValue;
+	std::vector<unsigned char> lastValue;
+	BLEReadCoalescer::Result result; // Kept to reuse its memory
 };
+BLEPollScheduler pollScheduler;
+std::mutex pollMutex;
+std::unordered_map<int, std::shared_ptr<PollTarget>> pollTargets;
+
+// How many devices _winBluetoothLEConnectToPeripherals() opens at the same time,
+// the command workers are the actual bound
+std::atomic<int> connectConcurrency{ 8 };
 
-std::vector<BLEDeviceInfo*> devices;
-std::vector<BLEServiceInfo*> services;
-std::vector<BLEConnectedServiceInfo*> connectedServices;
-std::vector<BLERegisteredCharacteristicInfo*> registeredCharacteristics;
+// How many services of a device are opened at the same time, including by the connecting thread
+const size_t serviceDiscoveryConcurrency = 4;
 
 enum class QueuedMessageType
 {
@@ -105,9 +173,9 @@ enum class QueuedMessageType
 
 struct QueuedMessage
 {
-	QueuedMessage(const QueuedMessageType& messageType, const std::string& message)
+	QueuedMessage(const QueuedMessageType& messageType, std::string message)
 		: _messageType{ messageType }
-		, _message{ message }
+		, _message{ std::move(message) }
 		, _threadId{ GetCurrentThreadId() }
 		, _timestamp{ std::chrono::duration_cast<std::chrono::microseconds>(
 			std::chrono::system_clock::now().time_since_epoch()
@@ -132,10 +200,22 @@ std::mutex messageMutex;           // mutex for critical section
 // --------------------------------------------------------------------------
 // Talks back to the mono side of things!
 // --------------------------------------------------------------------------
-inline void SendBluetoothMessage(const std::string& message)
+inline void SendBluetoothMessage(std::string message)
 {
 	const std::lock_guard<std::mutex> lock{ messageMutex };
-	messages.push_back({ QueuedMessageType::Message, message });
+	messages.push_back({ QueuedMessageType::Message, std::move(message) });
+}
+
+// --------------------------------------------------------------------------
+// Sends several messages back to back, no other message gets in between
+// --------------------------------------------------------------------------
+inline void SendBluetoothMessages(const std::vector<std::string>& newMessages)
+{
+	const std::lock_guard<std::mutex> lock{ messageMutex };
+	for (const auto& message : newMessages)
+	{
+		messages.push_back({ QueuedMessageType::Message, message });
+	}
 }
 
 // --------------------------------------------------------------------------
@@ -170,6 +250,12 @@ inline void DebugError(const std::string& message)
 // --------------------------------------------------------------------------
 void SendError(const char* message)
 {
+	if (currentCommand != nullptr && !currentCommand->failed)
+	{
+		currentCommand->failed = true;
+		currentCommand->error = message;
+	}
+
 	std::string errorMessage = "Error~";
 	errorMessage.append(message);
 	SendBluetoothMessage(errorMessage);
@@ -188,6 +274,21 @@ void SendOutOfMemoryError(int size)
 	SendError(std::string("Failed to allocate ").append(std::to_string(size)).append(" bytes of memory."));
 }
 
+// Defined with the GATT operations below
+void disconnectAll();
+
+// --------------------------------------------------------------------------
+// Writes the GATT tables learnt since the last flush, done when disconnecting
+// rather than after each connection so that connecting never waits on the file
+// --------------------------------------------------------------------------
+void flushGattCache()
+{
+	if (!gattCache.Flush())
+	{
+		DebugWarning("Could not write the GATT cache file");
+	}
+}
+
 // --------------------------------------------------------------------------
 // Called by mono side to hook up message handlers!
 // --------------------------------------------------------------------------
@@ -208,78 +309,6 @@ void _winBluetoothLEDisconnectCallbacks()
 	debugErrorCallback = nullptr;
 }
 
-// --------------------------------------------------------------------------
-// Reads a device Property, used to retrieve device name, address, etc...
-// --------------------------------------------------------------------------
-std::string ReadProperty(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDeviceInfoData, DWORD property)
-{
-	//DebugLog(std::string("ReadProperty: ").append(BLEUtils::GUIDToString(pDeviceInfoData->ClassGuid)).append(", ").append(std::to_string(property)));
-
-	DWORD regDataType;
-	LPTSTR buffer = nullptr;
-	DWORD buffersSize = 0;
-	while (!SetupDiGetDeviceRegistryProperty(hDevInfo, pDeviceInfoData, property, &regDataType, (PBYTE)buffer, buffersSize, &buffersSize))
-	{
-		if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
-		{
-			// Change the buffer size.
-			delete[] buffer;
-			// Double the size to avoid problems on
-			// W2k MBCS systems per KB 888609.
-			buffer = new wchar_t[buffersSize * 2];
-		}
-		else
-		{
-			wchar_t buf[256];
-			FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
-			SendError(std::string("Could not read device property: ").append(BLEUtils::ToNarrow(buf)));
-			break;
-		}
-	}
-
-	std::string prop = "";
-	if (buffer != nullptr)
-	{
-		prop = BLEUtils::ToNarrow(buffer);
-		delete[] buffer;
-	}
-	return prop;
-}
-
-// --------------------------------------------------------------------------
-// Reads a device's instance Id, used to generate the device path and later open handle to it
-// --------------------------------------------------------------------------
-std::string ReadDeviceInstanceId(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDeviceInfoData)
-{
-	//DebugLog(std::string("ReadDeviceInstanceId: ").append(BLEUtils::GUIDToString(pDeviceInfoData->ClassGuid)));
-
-	LPTSTR deviceIdBuffer = nullptr;
-	DWORD deviceIdBufferSize = 0;
-
-	while (!SetupDiGetDeviceInstanceId(hDevInfo, pDeviceInfoData, deviceIdBuffer, deviceIdBufferSize, &deviceIdBufferSize))
-	{
-		if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
-		{
-			delete[] deviceIdBuffer;
-			deviceIdBuffer = new wchar_t[deviceIdBufferSize * 2];
-		}
-		else
-		{
-			wchar_t buf[256];
-			FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
-			SendError(std::string("Could not read device instance Id: ").append(BLEUtils::ToNarrow(buf)));
-			break;
-		}
-	}
-	std::string id = "<no_id>";
-	if (deviceIdBuffer != nullptr)
-	{
-		id = BLEUtils::ToNarrow(deviceIdBuffer);
-		delete[] deviceIdBuffer;
-	}
-	return id;
-}
-
 // --------------------------------------------------------------------------
 // Reads a device's interface details, we use this to get service GUIDs
 // --------------------------------------------------------------------------
@@ -329,184 +358,408 @@ std::string ReadDeviceInterfaceDetails(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDevi
 }
 
 // --------------------------------------------------------------------------
-// Finds all the bluetooth devices
+// Sends a message for a discovered peripheral, unless it was already reported
+// with the same name. Must be called with scanMutex held.
 // --------------------------------------------------------------------------
-bool ScanBLEInterfaces()
+void reportDevice(const BLEDeviceInfo* device)
 {
-	DebugLog("ScanBLEInterfaces");
+	auto reportedIt = scannedDevices.find(device->containerId);
+	if (reportedIt == scannedDevices.end() || reportedIt->second != device->deviceName)
+	{
+		// Sadly we don't have access to advertisement data, it is managed by Windows!
+		std::string deviceDiscoveredMessage = "DiscoveredPeripheral~";
+		deviceDiscoveredMessage.append(BLEUtils::UuidToString(device->containerId));
+		deviceDiscoveredMessage.append("~");
+		deviceDiscoveredMessage.append(device->deviceName);
+		SendBluetoothMessage(deviceDiscoveredMessage);
 
-	HDEVINFO hDevInfo;
-	SP_DEVINFO_DATA DeviceInfoData;
-	DWORD i;
-	// Create a HDEVINFO with all present devices.
-	hDevInfo = SetupDiGetClassDevs(&GUID_DEVCLASS_BLUETOOTH, 0, 0, DIGCF_PRESENT);
+		scannedDevices[device->containerId] = device->deviceName;
+	}
+}
 
-	if (hDevInfo == INVALID_HANDLE_VALUE)
+// --------------------------------------------------------------------------
+// Whether the device has a service that matches the filter and that we are not connected to
+// --------------------------------------------------------------------------
+bool deviceMatches(const BLERegistrySnapshot& snapshot, const BLEUtils::Uuid& containerId, const BLEServiceFilter& filter)
+{
+	for (const auto& uuid : filter.Uuids())
 	{
-		wchar_t buf[256];
-		FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
-		SendError(std::string("Could not request bluetooth device list: ").append(BLEUtils::ToNarrow(buf)));
-		return false;
+		auto service = snapshot.FindService(containerId, uuid);
+		if (service != nullptr && !snapshot.IsServiceConnected(service))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+// Sends the differences between the devices matching the current scan and
+// the ones reported so far: new devices, renamed devices (reported again
+// with their new name) and devices that are gone or don't match anymore.
+// Connected devices aren't reported but aren't lost either, they are still there.
+// --------------------------------------------------------------------------
+void notifyScanChanges(const std::unordered_map<BLEUtils::Uuid, const BLEDeviceInfo*>& matchingDevices, const std::unordered_set<BLEUtils::Uuid>& connectedDevices)
+{
+	for (const auto& device : matchingDevices)
+	{
+		reportDevice(device.second);
 	}
 
-	// Enumerate through all devices in Set.
-	DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
-	for (i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &DeviceInfoData); i++)
+	for (auto reportedIt = scannedDevices.begin(); reportedIt != scannedDevices.end();)
 	{
-		// Check the hardware Id
-		std::string hardwareId = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_HARDWAREID);
+		if (matchingDevices.find(reportedIt->first) == matchingDevices.end() && connectedDevices.find(reportedIt->first) == connectedDevices.end())
+		{
+			std::string deviceLostMessage = "LostPeripheral~";
+			deviceLostMessage.append(BLEUtils::UuidToString(reportedIt->first));
+			SendBluetoothMessage(deviceLostMessage);
 
-		// We're only interested in entries that start with either 'BTHLE\' or 'BTHLEDEVICE\'
-		bool isDevice = hardwareId.find("BTHLE\\") == 0;
-		bool isService = hardwareId.find("BTHLEDevice\\") == 0;
-		if (!isDevice && !isService)
+			reportedIt = scannedDevices.erase(reportedIt);
+		}
+		else
 		{
-			continue;
+			++reportedIt;
 		}
+	}
+}
+
+// --------------------------------------------------------------------------
+// Iterates over all devices and sends notifications back for the changes among the ones that match the UUIDs passed in
+// --------------------------------------------------------------------------
+void notifyDevicesWithServices(const BLEServiceFilter& filter)
+{
+	auto snapshot = registry.Read();
 
-		// Then grab the container GUID, this is what we use to match devices and services to the same physical device
-		GUID containerGUID = BLEUtils::StringToGUID(ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_BASE_CONTAINERID));
+	// Find any device that has a service whose UUID matches one of the UUIDs passed in!
+	std::unordered_map<BLEUtils::Uuid, const BLEDeviceInfo*> matchingDevices;
+	std::unordered_set<BLEUtils::Uuid> connectedDevices;
+	for (const auto& uuid : filter.Uuids())
+	{
+		auto indexIt = snapshot->servicesByUuid.find(uuid);
+		if (indexIt == snapshot->servicesByUuid.end())
+		{
+			continue;
+		}
 
-		if (isDevice)
+		for (auto service : indexIt->second)
 		{
-			// Only add new devices
-			auto prev = std::find_if(devices.begin(), devices.end(), [&containerGUID](const BLEDeviceInfo* x) { return x->containerId == containerGUID; });
-			if (prev == devices.end())
+			// Skip services we are already connected to
+			auto device = snapshot->FindDevice(service->containerId);
+			if (device == nullptr)
 			{
-				// Fetch the name!
-				auto info = new BLEDeviceInfo();
-				info->deviceName = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_FRIENDLYNAME);
-				info->containerId = containerGUID;
-				devices.push_back(info);
+				continue;
+			}
+			if (snapshot->IsServiceConnected(service))
+			{
+				connectedDevices.insert(device->containerId);
+			}
+			else
+			{
+				matchingDevices.emplace(device->containerId, device);
 			}
 		}
+	}
+
+	notifyScanChanges(matchingDevices, connectedDevices);
+}
 
-		if (isService)
+// --------------------------------------------------------------------------
+// Iterates over all devices and sends notifications back for the changes
+// --------------------------------------------------------------------------
+void notifyAllDevices()
+{
+	auto snapshot = registry.Read();
+
+	std::unordered_map<BLEUtils::Uuid, const BLEDeviceInfo*> matchingDevices;
+	for (auto device : snapshot->devices)
+	{
+		matchingDevices.emplace(device->containerId, device);
+	}
+
+	notifyScanChanges(matchingDevices, {});
+}
+
+// --------------------------------------------------------------------------
+// Reports each matching device as soon as the scan finds it rather than at the
+// end of the scan. The new devices and services are only added to the registry
+// once the enumeration is done, in a single edit, so that a scan finding many
+// devices doesn't copy the registry for each of them.
+// --------------------------------------------------------------------------
+class ScanPipeline : public BLEScanObserver
+{
+public:
+	explicit ScanPipeline(std::uint64_t scanGeneration) : _scanGeneration(scanGeneration) {}
+
+	~ScanPipeline()
+	{
+		// Entries that weren't published
+		for (const auto& device : _newDevices)
 		{
-			// Fetch the GUID!
-			std::regex guidRegex("\\{.*\\}");
-			std::smatch match;
-			if (std::regex_search(hardwareId, match, guidRegex))
-			{
-				std::string guidString = match.str();
-				auto serviceId = BLEUtils::StringToBTHLEUUID(guidString);
+			registry.Delete(device.second);
+		}
+		for (const auto& service : _newServices)
+		{
+			registry.Delete(service.second);
+		}
+	}
 
-				auto prev = std::find_if(services.begin(), services.end(),
-					[&containerGUID, &serviceId](const BLEServiceInfo* x)
-					{
-						return x->containerId == containerGUID && x->id == serviceId;
-					});
+	void DeviceFound(const BLEScanResult::Device& device) override
+	{
+		{
+			// New devices, and the ones that were renamed
+			auto snapshot = registry.Read();
+			auto prev = snapshot->FindDevice(device.containerId);
+			if ((prev == nullptr || prev->deviceName != device.name) && _newDevices.find(device.containerId) == _newDevices.end())
+			{
+				auto info = registry.NewDevice();
+				info->deviceName = device.name;
+				info->containerId = device.containerId;
+				_newDevices.emplace(device.containerId, info);
+			}
+		}
 
-				if (prev == services.end())
-				{
-					auto service = new BLEServiceInfo();
-					service->name = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_DEVICEDESC);
+		// Also for known devices, they may not have been reported since scanning started
+		reportIfMatching(device.containerId);
+	}
 
-					service->containerId = containerGUID;
-					service->id = serviceId;
+	void ServiceFound(const BLEScanResult::Service& scanned) override
+	{
+		// Services known at enumeration time come without details, they are already in the registry
+		if (!scanned.hasDetails)
+		{
+			return;
+		}
 
-					// Parse the device instance id to get the device path!
-					std::string deviceId = ReadDeviceInstanceId(hDevInfo, &DeviceInfoData);
+		{
+			BLEServiceKey key{ scanned.containerId, scanned.id };
+			auto snapshot = registry.Read();
+			if (snapshot->FindService(scanned.containerId, scanned.id) != nullptr || _newServices.find(key) != _newServices.end())
+			{
+				return;
+			}
 
-					// Create the device path
-					std::string path = "\\\\?\\";
-					std::replace(deviceId.begin(), deviceId.end(), '\\', '#');
-					path.append(deviceId);
-					path.append("#");
-					path.append(guidString);
-					service->path = path;
+			auto service = registry.NewService();
+			service->containerId = scanned.containerId;
+			service->id = scanned.id;
+			service->name = scanned.name;
+			service->path = scanned.path;
+			_newServices.emplace(key, service);
+		}
+		reportIfMatching(scanned.containerId);
+	}
 
-					services.push_back(service);
-				}
+	// Adds what was found to the registry, renamed devices replace the previous entries
+	void Publish(BLEDeviceRegistry::Writer& writer)
+	{
+		for (const auto& device : _newDevices)
+		{
+			auto prev = writer.Current().FindDevice(device.first);
+			if (prev != nullptr)
+			{
+				writer.Edit().RemoveDevice(prev);
+				writer.Retire(prev);
+			}
+			writer.Edit().AddDevice(device.second);
+		}
+		for (const auto& service : _newServices)
+		{
+			if (writer.Current().FindService(service.first.device, service.first.service) != nullptr)
+			{
+				registry.Delete(service.second);
 			}
 			else
 			{
-				SendError(std::string("Could not extract service GUID from the hardware ID \'").append(hardwareId).append("\'"));
+				writer.Edit().AddService(service.second);
 			}
 		}
+		_newDevices.clear();
+		_newServices.clear();
 	}
 
-	// Set device pointers
-	for (auto service : services)
+private:
+	void reportIfMatching(const BLEUtils::Uuid& containerId)
 	{
-		auto devIt = std::find_if(devices.begin(), devices.end(), [service](BLEDeviceInfo* d) { return d->containerId == service->containerId; });
-		if (devIt != devices.end())
+		auto snapshot = registry.Read();
+		auto newDeviceIt = _newDevices.find(containerId);
+		auto device = newDeviceIt != _newDevices.end() ? newDeviceIt->second : snapshot->FindDevice(containerId);
+		if (device == nullptr)
 		{
-			service->device = *devIt;
+			// Its services were found first, it will be reported along with the device
+			return;
 		}
-		else
+
+		// Nothing is reported once the scan was stopped or restarted
+		const std::lock_guard<std::mutex> lock{ scanMutex };
+		if (scanScheduler.IsCurrent(_scanGeneration) && (scanAllDevices || deviceMatches(*snapshot, containerId, scanFilter) || hasNewMatchingService(containerId)))
+		{
+			reportDevice(device);
+		}
+	}
+
+	// Must be called with scanMutex held
+	bool hasNewMatchingService(const BLEUtils::Uuid& containerId) const
+	{
+		for (const auto& uuid : scanFilter.Uuids())
 		{
-			SendError(std::string("Could not find the device that service ").append(BLEUtils::BTHLEGUIDToString(service->id)).append(" belongs to"));
+			if (_newServices.find({ containerId, uuid }) != _newServices.end())
+			{
+				return true;
+			}
 		}
+		return false;
 	}
 
-	SetupDiDestroyDeviceInfoList(hDevInfo);
+	std::uint64_t _scanGeneration;
 
-	return 0;
-}
+	// Found during this scan and not in the registry yet
+	std::unordered_map<BLEUtils::Uuid, BLEDeviceInfo*> _newDevices;
+	std::unordered_map<BLEServiceKey, BLEServiceInfo*, BLEServiceKeyHash> _newServices;
+};
 
 // --------------------------------------------------------------------------
-// Iterates over all devices and sends notifications back for each one that matches the UUIDs passed in
+// Sends the errors met by a scan, those already sent since scanning started are
+// skipped as every scan would send them again. Nothing is sent if the scan was
+// stopped or restarted.
 // --------------------------------------------------------------------------
-void notifyDevicesWithServices(const std::vector<BTH_LE_UUID>& uuids)
+void reportScanErrors(std::uint64_t scanGeneration, const std::vector<std::string>& errors)
 {
-	std::vector<GUID> returnedDevices;
-	// Find any device that has a service whose UUID matches one of the UUIDs passed in!
-	for (auto service : services)
+	const std::lock_guard<std::mutex> lock{ scanMutex };
+	if (!scanScheduler.IsCurrent(scanGeneration))
+	{
+		return;
+	}
+	for (const auto& error : errors)
 	{
-		auto prev = std::find_if(connectedServices.begin(), connectedServices.end(), [service](const BLEConnectedServiceInfo* x) { return x->service == service; });
-		if (prev == connectedServices.end())
+		if (reportedScanErrors.insert(error).second)
 		{
-			// Not already connected, good!
-			if (std::find(uuids.begin(), uuids.end(), service->id) != uuids.end())
-			// Does this service match the UUID?
-			{
-				// Yes, send a message for each discovered peripheral
-				// Sadly we don't have access to advertisement data, it is managed by Windows!
-				std::string deviceDiscoveredMessage = "DiscoveredPeripheral~";
-				deviceDiscoveredMessage.append(BLEUtils::GUIDToString(service->device->containerId));
-				deviceDiscoveredMessage.append("~");
-				deviceDiscoveredMessage.append(service->device->deviceName);
-				SendBluetoothMessage(deviceDiscoveredMessage);
-			}
+			SendError(error);
 		}
 	}
 }
 
 // --------------------------------------------------------------------------
-// Iterates over all devices and sends notifications back for each one
+// Finds all the bluetooth devices, matching devices are reported as soon as
+// they are found, lost ones once the enumeration is complete
 // --------------------------------------------------------------------------
-void notifyAllDevices()
+bool ScanBLEInterfaces(std::uint64_t scanGeneration)
 {
-	// Find any device that has a service whose UUID matches one of the UUIDs passed in!
-	for (auto device : devices)
+	DebugLog("ScanBLEInterfaces");
+
+	// Enumerate without holding the registry, entries are added as they are found
+	ScanPipeline pipeline(scanGeneration);
+	BLEScanResult result;
+	bool enumerated;
 	{
-		// Send a message for each discovered peripheral
-		// Sadly we don't have access to advertisement data...
-		std::string deviceDiscoveredMessage = "DiscoveredPeripheral~";
-		deviceDiscoveredMessage.append(BLEUtils::GUIDToString(device->containerId));
-		deviceDiscoveredMessage.append("~");
-		deviceDiscoveredMessage.append(device->deviceName);
-		SendBluetoothMessage(deviceDiscoveredMessage);
+		auto snapshot = registry.Read();
+		enumerated = deviceSource->Enumerate(*snapshot, result, &pipeline);
+	}
+
+	reportScanErrors(scanGeneration, result.errors);
+	if (!enumerated)
+	{
+		// Keep what was found before the enumeration failed
+		auto writer = registry.Write();
+		pipeline.Publish(writer);
+		return false;
+	}
+
+	// What is still present, the rest is removed
+	std::unordered_set<BLEUtils::Uuid> presentDevices;
+	for (const auto& device : result.devices)
+	{
+		presentDevices.insert(device.containerId);
+	}
+	std::unordered_set<BLEServiceKey, BLEServiceKeyHash> presentServices;
+	for (const auto& service : result.services)
+	{
+		presentServices.insert({ service.containerId, service.id });
 	}
+
+	auto writer = registry.Write();
+	pipeline.Publish(writer);
+
+	// Remove what went away, unless we are still connected to it
+	std::vector<const BLEServiceInfo*> lostServices;
+	for (auto service : writer.Current().services)
+	{
+		if (service != nullptr
+			&& presentServices.find({ service->containerId, service->id }) == presentServices.end()
+			&& !writer.Current().IsServiceConnected(service))
+		{
+			lostServices.push_back(service);
+		}
+	}
+	for (auto service : lostServices)
+	{
+		writer.Edit().RemoveService(service);
+		writer.Retire(service);
+	}
+
+	std::vector<const BLEDeviceInfo*> lostDevices;
+	for (auto device : writer.Current().devices)
+	{
+		if (presentDevices.find(device->containerId) == presentDevices.end()
+			&& writer.Current().connectedServicesByDevice.find(device->containerId) == writer.Current().connectedServicesByDevice.end())
+		{
+			lostDevices.push_back(device);
+		}
+	}
+	for (auto device : lostDevices)
+	{
+		writer.Edit().RemoveDevice(device);
+		writer.Retire(device);
+	}
+
+	// Check that services belong to a known device
+	std::vector<std::string> orphanErrors;
+	const auto& snapshot = writer.Current();
+	for (auto service : snapshot.services)
+	{
+		if (service != nullptr && snapshot.FindDevice(service->containerId) == nullptr)
+		{
+			orphanErrors.push_back(std::string("Could not find the device that service ").append(BLEUtils::UuidToBTHLEString(service->id)).append(" belongs to"));
+		}
+	}
+	reportScanErrors(scanGeneration, orphanErrors);
+
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Sends the message for a connected device, the device entry may be gone if devices were cleared
+// --------------------------------------------------------------------------
+void notifyConnectedDevice(const BLERegistrySnapshot& snapshot, const BLEUtils::Uuid& containerId)
+{
+	auto device = snapshot.FindDevice(containerId);
+	std::string connectedDeviceRetrievedMessage = "RetrievedConnectedPeripheral~";
+	connectedDeviceRetrievedMessage.append(BLEUtils::UuidToString(containerId));
+	connectedDeviceRetrievedMessage.append("~");
+	connectedDeviceRetrievedMessage.append(device != nullptr ? device->deviceName : std::string());
+	SendBluetoothMessage(connectedDeviceRetrievedMessage);
 }
 
 // --------------------------------------------------------------------------
 // Iterates over all connected devices and sends notifications back for each one that matches the UUIDs passed in
 // --------------------------------------------------------------------------
-void notifyConnectedServices(const std::vector<BTH_LE_UUID>& uuids)
+void notifyConnectedServices(const BLEServiceFilter& filter)
 {
-	// Send messages for all the ones
-	for (auto service : connectedServices)
+	auto snapshot = registry.Read();
+
+	// Send messages for the connected services whose UUID matches one of the UUIDs passed in!
+	for (const auto& uuid : filter.Uuids())
 	{
-		// Find any service that has a service whose UUID matches one of the UUIDs passed in!
-		if (std::find_if(uuids.begin(), uuids.end(), [&service](const BTH_LE_UUID& uuid) { return service->service->id == uuid; }) != uuids.end())
+		auto indexIt = snapshot->servicesByUuid.find(uuid);
+		if (indexIt == snapshot->servicesByUuid.end())
+		{
+			continue;
+		}
+
+		for (auto service : indexIt->second)
 		{
-			std::string deviceDiscoveredMessage = "RetrievedConnectedPeripheral~";
-			deviceDiscoveredMessage.append(BLEUtils::GUIDToString(service->service->device->containerId));
-			deviceDiscoveredMessage.append("~");
-			deviceDiscoveredMessage.append(service->service->device->deviceName);
-			SendBluetoothMessage(deviceDiscoveredMessage);
+			if (snapshot->IsServiceConnected(service))
+			{
+				notifyConnectedDevice(*snapshot, service->containerId);
+			}
 		}
 	}
 }
@@ -516,16 +769,33 @@ void notifyConnectedServices(const std::vector<BTH_LE_UUID>& uuids)
 // --------------------------------------------------------------------------
 void notifyAllConnected()
 {
-	// Send messages for all the ones
-	for (auto service : connectedServices)
+	auto snapshot = registry.Read();
+
+	// Send a message for each connected service
+	for (const auto& device : snapshot->connectedServicesByDevice)
+	{
+		for (size_t i = 0; i < device.second.size(); ++i)
+		{
+			notifyConnectedDevice(*snapshot, device.first);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+// Returns the filter for a string of '|' separated UUIDs, parsing it only the first time
+// --------------------------------------------------------------------------
+const BLEServiceFilter& GetServiceFilter(const char* serviceUUIDsString)
+{
+	auto it = parsedServiceFilters.find(serviceUUIDsString);
+	if (it == parsedServiceFilters.end())
 	{
-		// Send a message for each discovered service
-		std::string connectedDeviceRetrievedMessage = "RetrievedConnectedPeripheral~";
-		connectedDeviceRetrievedMessage.append(BLEUtils::GUIDToString(service->service->device->containerId));
-		connectedDeviceRetrievedMessage.append("~");
-		connectedDeviceRetrievedMessage.append(service->service->device->deviceName);
-		SendBluetoothMessage(connectedDeviceRetrievedMessage);
+		if (parsedServiceFilters.size() >= maxParsedServiceFilters)
+		{
+			parsedServiceFilters.clear();
+		}
+		it = parsedServiceFilters.emplace(serviceUUIDsString, BLEServiceFilter::Parse(serviceUUIDsString)).first;
 	}
+	return it->second;
 }
 
 // --------------------------------------------------------------------------
@@ -597,121 +867,182 @@ std::vector<BTH_LE_GATT_CHARACTERISTIC> GetGATTCharacteristics(HANDLE serviceHan
 }
 
 // --------------------------------------------------------------------------
-// Retrieves a characteristic's value, allocates memory because the data has variable size!
+// Gives back a value returned by ReadCharacteristicValue()
+// --------------------------------------------------------------------------
+void ReleaseCharacteristicValue(BLEConnectedServiceInfo* cservice, PBTH_LE_GATT_CHARACTERISTIC_VALUE value, bool heapBuffer)
+{
+	if (heapBuffer)
+	{
+		free(value);
+	}
+	else if (value != nullptr)
+	{
+		cservice->ReleaseValueBuffer(value);
+	}
+}
+
+// --------------------------------------------------------------------------
+// Retrieves a characteristic's value, normally with a single call into the
+// characteristic's value buffer. If another operation is using that buffer,
+// the value is read into memory allocated for the size last read instead.
+// Returns null on error, otherwise the value must be given back with
+// ReleaseCharacteristicValue(), heapBuffer tells which memory it is in.
 // --------------------------------------------------------------------------
-PBTH_LE_GATT_CHARACTERISTIC_VALUE AllocAndReadCharacteristic(HANDLE serviceHandle, BTH_LE_GATT_CHARACTERISTIC* currGattChar)
+PBTH_LE_GATT_CHARACTERISTIC_VALUE ReadCharacteristicValue(BLEConnectedServiceInfo* cservice, BTH_LE_GATT_CHARACTERISTIC* currGattChar, ULONG flags, bool& heapBuffer)
 {
-	DebugLog(std::string("AllocAndReadCharacteristic: ").append(BLEUtils::BTHLEGUIDToString(currGattChar->CharacteristicUuid)));
+	if (!currGattChar->IsReadable)
+	{
+		SendError(std::string("Characteristic ").append(BLEUtils::BTHLEGUIDToString(currGattChar->CharacteristicUuid)).append(" is not readable."));
+		return nullptr;
+	}
 
-	PBTH_LE_GATT_CHARACTERISTIC_VALUE pCharValueBuffer = nullptr;
-	
-	if (currGattChar->IsReadable)
+	const ULONG headerSize = (ULONG)offsetof(BTH_LE_GATT_CHARACTERISTIC_VALUE, Data);
+	ULONG charValueBufferSize = headerSize + (ULONG)BLEConnectedServiceInfo::MaxValueSize;
+	PBTH_LE_GATT_CHARACTERISTIC_VALUE pCharValueBuffer = cservice->AcquireValueBuffer(currGattChar, BLEConnectedServiceInfo::MaxValueSize);
+	heapBuffer = pCharValueBuffer == nullptr;
+	if (heapBuffer)
 	{
-		// Determine Characteristic Value Buffer Size
-		USHORT charValueDataSize = 0;
-		HRESULT hr = S_OK;
-		while ((hr = BluetoothGATTGetCharacteristicValue(serviceHandle, currGattChar, (ULONG)charValueDataSize, pCharValueBuffer, &charValueDataSize, BLUETOOTH_GATT_FLAG_NONE)) != S_OK)
+		ULONG lastSize = cservice->LastValueSize(currGattChar);
+		charValueBufferSize = lastSize > 0 ? headerSize + lastSize : 0;
+		if (charValueBufferSize > 0)
 		{
-			if (hr == HRESULT_FROM_WIN32(ERROR_MORE_DATA))
+			pCharValueBuffer = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)malloc(charValueBufferSize);
+			if (pCharValueBuffer == nullptr)
 			{
-				free(pCharValueBuffer);
-				pCharValueBuffer = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)malloc(charValueDataSize);
-				if (pCharValueBuffer != nullptr)
-				{
-					RtlZeroMemory(pCharValueBuffer, charValueDataSize);
-					pCharValueBuffer->DataSize = charValueDataSize;
-				}
-				else
-				{
-					SendOutOfMemoryError(charValueDataSize);
-					break;
-				}
+				SendOutOfMemoryError(charValueBufferSize);
+				return nullptr;
 			}
-			else
-			{
-				free(pCharValueBuffer);
-				pCharValueBuffer = nullptr;
+		}
+	}
 
-				_com_error err(hr);
-				SendError(std::string("Could not get characteristic ").append(BLEUtils::BTHLEGUIDToString(currGattChar->CharacteristicUuid)).append(" value: ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
-			}
+	// Only loops if the value grew since the last read, or never was read
+	USHORT charValueSizeRequired = 0;
+	HRESULT hr = S_OK;
+	while ((hr = BluetoothGATTGetCharacteristicValue(cservice->deviceHandle, currGattChar, charValueBufferSize, pCharValueBuffer, &charValueSizeRequired, flags)) == HRESULT_FROM_WIN32(ERROR_MORE_DATA)
+		&& charValueSizeRequired > charValueBufferSize)
+	{
+		ReleaseCharacteristicValue(cservice, pCharValueBuffer, heapBuffer);
+		heapBuffer = true;
+		charValueBufferSize = charValueSizeRequired;
+		pCharValueBuffer = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)malloc(charValueBufferSize);
+		if (pCharValueBuffer == nullptr)
+		{
+			SendOutOfMemoryError(charValueBufferSize);
+			return nullptr;
 		}
 	}
-	else
+
+	if (hr != S_OK)
 	{
-		SendError(std::string("Characteristic ").append(BLEUtils::BTHLEGUIDToString(currGattChar->CharacteristicUuid)).append(" is not readable."));
+		ReleaseCharacteristicValue(cservice, pCharValueBuffer, heapBuffer);
+
+		_com_error err(hr);
+		SendError(std::string("Could not get characteristic ").append(BLEUtils::BTHLEGUIDToString(currGattChar->CharacteristicUuid)).append(" value: ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+		return nullptr;
 	}
 
+	cservice->SetLastValueSize(currGattChar, pCharValueBuffer->DataSize);
 	return pCharValueBuffer;
 }
 
 // --------------------------------------------------------------------------
 // Disconnects ALL connected services associated with a device!
 // --------------------------------------------------------------------------
-bool DisconnectServicesForDevice(GUID addressGUID)
+bool DisconnectServicesForDevice(const BLEUtils::Uuid& addressGUID)
 {
-	DebugLog(std::string("DisconnectServicesForDevice: ").append(BLEUtils::GUIDToString(addressGUID)));
+	DebugLog(std::string("DisconnectServicesForDevice: ").append(BLEUtils::UuidToString(addressGUID)));
+
+	readCoalescer.Forget(addressGUID);
+
+	auto writer = registry.Write();
+	auto devIt = writer.Current().connectedServicesByDevice.find(addressGUID);
+	if (devIt == writer.Current().connectedServicesByDevice.end())
+	{
+		return false;
+	}
 
+	// Copy the list as we are editing the registry while going through it
 	bool disconnectedService = false;
-	for (auto servIt = connectedServices.begin(); servIt != connectedServices.end();)
+	auto deviceServices = devIt->second;
+
+	// Remember the subscriptions so they can be resumed, no more can be added from now on
+	DeviceSession session;
+	for (auto cservice : deviceServices)
+	{
+		const std::lock_guard<std::mutex> lock{ cservice->subscriptionMutex };
+		cservice->disconnected = true;
+		for (const auto& subscription : cservice->subscriptions)
+		{
+			session.subscriptions.push_back({ cservice->service->id, subscription.first, subscription.second->clientConfig });
+		}
+	}
+	{
+		const std::lock_guard<std::mutex> lock{ sessionMutex };
+		deviceSessions[addressGUID] = std::move(session);
+	}
+
+	for (auto cservice : deviceServices)
 	{
-		auto cservice = *servIt;
-		if (cservice->service->device->containerId == addressGUID)
+		// Do we have any registered characteristics? Those registered together share an event,
+		// which is only unregistered once
+		std::unique_lock<std::mutex> subscriptionLock{ cservice->subscriptionMutex };
+		std::vector<std::pair<BLUETOOTH_GATT_EVENT_HANDLE, HRESULT>> unregisteredEvents;
+		for (auto charIt = cservice->subscriptions.begin(); charIt != cservice->subscriptions.end();)
 		{
-			// Do we have any registered characteristics?
-			for (auto charIt = registeredCharacteristics.begin(); charIt != registeredCharacteristics.end();)
+			auto charInfo = charIt->second;
+
+			// We should unregister!
+			auto eventIt = std::find_if(unregisteredEvents.begin(), unregisteredEvents.end(),
+				[charInfo](const std::pair<BLUETOOTH_GATT_EVENT_HANDLE, HRESULT>& e) { return e.first == charInfo->characteristicHandle; });
+			if (eventIt == unregisteredEvents.end())
 			{
-				auto charInfo = *charIt;
-				if (charInfo->service->service->device->containerId == addressGUID)
-				{
-					// We should unregister!
-					HRESULT hr = BluetoothGATTUnregisterEvent(charInfo->characteristicHandle, BLUETOOTH_GATT_FLAG_NONE);
-					if (hr == S_OK)
-					{
-						// Send message
-						std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
-						registerCharacteristicMessage.append(BLEUtils::GUIDToString(addressGUID));
-						registerCharacteristicMessage.append("~");
-						registerCharacteristicMessage.append(BLEUtils::BTHLEGUIDToString(cservice->service->id));
-						registerCharacteristicMessage.append("~");
-						registerCharacteristicMessage.append(BLEUtils::BTHLEGUIDToString(charInfo->characteristic.CharacteristicUuid));
-						SendBluetoothMessage(registerCharacteristicMessage);
-
-						// Clean up
-						delete charInfo;
-						charIt = registeredCharacteristics.erase(charIt);
-					}
-					else
-					{
-						_com_error err(hr);
-						SendError(std::string("Could not unregister from characteristic ").append(BLEUtils::GUIDToString(addressGUID)).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
-						// Next element!
-						++charIt;
-					}
-				}
-				else
-				{
-					// Next element!
-					++charIt;
-				}
+				unregisteredEvents.emplace_back(charInfo->characteristicHandle, BluetoothGATTUnregisterEvent(charInfo->characteristicHandle, BLUETOOTH_GATT_FLAG_NONE));
+				eventIt = unregisteredEvents.end() - 1;
 			}
-
-			if (CloseHandle(cservice->deviceHandle))
+			HRESULT hr = eventIt->second;
+			if (hr == S_OK)
 			{
-				servIt = connectedServices.erase(servIt);
-				delete cservice;
-				disconnectedService = true;
+				// Send message
+				std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
+				registerCharacteristicMessage.append(BLEUtils::UuidToString(addressGUID));
+				registerCharacteristicMessage.append("~");
+				registerCharacteristicMessage.append(BLEUtils::UuidToBTHLEString(cservice->service->id));
+				registerCharacteristicMessage.append("~");
+				registerCharacteristicMessage.append(BLEUtils::BTHLEGUIDToString(charInfo->characteristic.CharacteristicUuid));
+				SendBluetoothMessage(registerCharacteristicMessage);
+
+				// Clean up
+				subscriptionTable.Release(charInfo->context);
+				registry.Delete(charInfo);
+				charIt = cservice->subscriptions.erase(charIt);
 			}
 			else
 			{
-				SendError(std::string("Could not close handle to device ").append(BLEUtils::GUIDToString(addressGUID)));
-
+				_com_error err(hr);
+				SendError(std::string("Could not unregister from characteristic ").append(BLEUtils::UuidToString(addressGUID)).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+				// Next element!
+				++charIt;
 			}
 		}
-		else
-		{
-			++servIt;
-		}
+		subscriptionLock.unlock();
+
+		// The handle is closed once no reader can be doing I/O on it anymore
+		writer.Edit().RemoveConnectedService(cservice);
+		writer.Retire([cservice, addressGUID]()
+			{
+				if (!CloseHandle(cservice->deviceHandle))
+				{
+					SendError(std::string("Could not close handle to device ").append(BLEUtils::UuidToString(addressGUID)));
+				}
+
+				// Subscriptions we failed to unregister are gone with the handle
+				for (const auto& subscription : cservice->subscriptions)
+				{
+					subscriptionTable.Release(subscription.second->context);
+				}
+				registry.Delete(cservice);
+			});
+		disconnectedService = true;
 	}
 
 	return disconnectedService;
@@ -806,22 +1137,39 @@ void _winBluetoothLEInitialize(bool asCentral, bool asPeripheral)
 }
 
 // --------------------------------------------------------------------------
-// Clean up!
+// Clean up! Waits for the library's threads, so it must be called before the
+// DLL is unloaded rather than from DllMain
 // --------------------------------------------------------------------------
 void _winBluetoothLEDeInitialize()
 {
 	LogToFile("DeInitialized");
 
-	_winBluetoothLEDisconnectAll();
+	_winBluetoothLEStopScan();
+	scanScheduler.Shutdown();
+	pollScheduler.Stop();
+	pollScheduler.Clear();
+	{
+		const std::lock_guard<std::mutex> lock{ pollMutex };
+		pollTargets.clear();
+	}
+	commandQueue.Stop();
+	disconnectAll();
+
+	// The commands that were dropped are reported as failed before the end
+	_winBluetoothLEUpdate();
 	if (sendMessageCallback != NULL)
 	{
 		sendMessageCallback("DeInitialized");
 	}
 
-	devices.clear();
-	services.clear();
-	connectedServices.clear();
-	registeredCharacteristics.clear();
+	registry.Reset();
+	registeredServiceFilters.clear();
+	{
+		const std::lock_guard<std::mutex> lock{ sessionMutex };
+		deviceSessions.clear();
+	}
+	parsedServiceFilters.clear();
+	readCoalescer.Clear();
 
 	const std::lock_guard<std::mutex> lock{ messageMutex };
 	messages.clear();
@@ -836,30 +1184,57 @@ void _winBluetoothLEPauseMessages(bool isPaused)
 }
 
 // --------------------------------------------------------------------------
-// Scans all the bluetooth devices and notifies the mono side
+// Scans all the bluetooth devices and notifies the mono side, runs on the scan thread.
+// The results are dropped if the scan was stopped or restarted in the meantime.
 // --------------------------------------------------------------------------
-void _winBluetoothLEScanForPeripheralsWithServices(const char* serviceUUIDsString)
+void scanForPeripherals(std::uint64_t scanGeneration)
 {
-	// Devices are managed by windows, so we don't need to 'remember' old devices
-	//devices.clear();
-	//services.clear();
-	//connectedServices.clear();
-	//registeredCharacteristics.clear();
-
-	// Scan for devices
-	ScanBLEInterfaces();
+	// Devices are managed by windows, the scan updates the registry and we only send what changed since the previous scan
+	ScanBLEInterfaces(scanGeneration);
 
 	// Retrieve the devices with proper service UUID
+	const std::lock_guard<std::mutex> lock{ scanMutex };
+	if (!scanScheduler.IsCurrent(scanGeneration))
+	{
+		return;
+	}
+	if (scanAllDevices)
+	{
+		notifyAllDevices();
+	}
+	else
+	{
+		notifyDevicesWithServices(scanFilter);
+	}
+}
+
+// --------------------------------------------------------------------------
+// Starts scanning in the background, or changes the filter of the current scan,
+// a null filter reports all the devices. Doesn't wait for the scan in progress,
+// whose results are dropped.
+// --------------------------------------------------------------------------
+void startScan(const BLEServiceFilter* filter)
+{
+	const std::lock_guard<std::mutex> lock{ scanMutex };
+	scanAllDevices = filter == nullptr;
+	scanFilter = filter != nullptr ? *filter : BLEServiceFilter();
+	scanScheduler.Start(scanForPeripherals);
+}
+
+// --------------------------------------------------------------------------
+// Starts scanning for the bluetooth devices, returns immediately
+// --------------------------------------------------------------------------
+void _winBluetoothLEScanForPeripheralsWithServices(const char* serviceUUIDsString)
+{
 	if (serviceUUIDsString != nullptr)
 	{
 		DebugLog(std::string("_winBluetoothLEScanForPeripheralsWithServices: ").append(serviceUUIDsString));
 
-		auto uuids = BLEUtils::GenerateGUIDList(serviceUUIDsString);
-		notifyDevicesWithServices(uuids);
+		startScan(&GetServiceFilter(serviceUUIDsString));
 	}
 	else
 	{
-		notifyAllDevices();
+		startScan(nullptr);
 	}
 }
 
@@ -872,8 +1247,7 @@ void _winBluetoothLERetrieveListOfPeripheralsWithServices(const char* serviceUUI
 	{
 		DebugLog(std::string("_winBluetoothLERetrieveListOfPeripheralsWithServices: ").append(serviceUUIDsString));
 
-		auto uuids = BLEUtils::GenerateGUIDList(serviceUUIDsString);
-		notifyConnectedServices(uuids);
+		notifyConnectedServices(GetServiceFilter(serviceUUIDsString));
 	}
 	else
 	{
@@ -882,442 +1256,550 @@ void _winBluetoothLERetrieveListOfPeripheralsWithServices(const char* serviceUUI
 }
 
 // --------------------------------------------------------------------------
-// Stops scanning for bluetooth devices
-// --------------------------------------------------------------------------
-void _winBluetoothLEStopScan()
-{
-	// Nothing to do for now, scanning is handled by windows
-}
-
-// --------------------------------------------------------------------------
-// Connects to a given device and list services/characteristics
+// Parses a list of service UUIDs once, the returned id can then be passed to
+// the scan and retrieve functions. Returns 0 if no UUID could be parsed.
 // --------------------------------------------------------------------------
-void _winBluetoothLEConnectToPeripheral(const char* address)
+int _winBluetoothLERegisterServiceFilter(const char* serviceUUIDsString)
 {
-	if (address != nullptr)
+	if (serviceUUIDsString == nullptr)
 	{
-		DebugLog(std::string("_winBluetoothLEConnectToPeripheral: ").append(address));
-
-		// Iterate all the services for the given device
-		bool firstService = true;
-		GUID addressGUID = BLEUtils::StringToGUID(address);
-		for (auto servIt = services.begin(); servIt != services.end(); ++servIt)
-		{
-			auto service = *servIt;
-			if (service->containerId == addressGUID)
-			{
-				// Open a handle to the peripheral, and scan the services and characteristics
-				HANDLE serviceHandle = CreateFile(BLEUtils::ToWide(service->path.data()).data(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-				if (serviceHandle != INVALID_HANDLE_VALUE)
-				{
-					// Remember we connected to the device, so we can clean up later!
-					auto connInfo = new BLEConnectedServiceInfo();
-					connInfo->service = service;
-					connInfo->deviceHandle = serviceHandle;
-					connectedServices.push_back(connInfo);
-
-					// Notify that we connected to a service!
-					if (firstService)
-					{
-						firstService = false;
-						std::string connectedMessage = "ConnectedPeripheral~";
-						connectedMessage.append(address);
-						SendBluetoothMessage(connectedMessage);
-					}
-
-					// Get GATT service ids and characteristics
-					if (GetGATTService(serviceHandle, connInfo->gattService))
-					{
-						// Check that the GATT service ID matches the service ID
-						auto gattServiceUuidString = BLEUtils::BTHLEGUIDToString(connInfo->gattService.ServiceUuid);
-						if (connInfo->gattService.ServiceUuid == service->id)
-						{
-							// Notify that we indeed got the GATT service info!
-							std::string discoveredServiceMessage = "DiscoveredService~";
-							discoveredServiceMessage.append(address);
-							discoveredServiceMessage.append("~");
-							discoveredServiceMessage.append(gattServiceUuidString);
-							SendBluetoothMessage(discoveredServiceMessage);
-
-							// Scan characteristics now!
-							connInfo->characteristics = GetGATTCharacteristics(serviceHandle, connInfo->gattService);
-							if (connInfo->characteristics.size() > 0)
-							{
-								for (auto& characteristic : connInfo->characteristics)
-								{
-									auto gattCharacteristicUuidString = BLEUtils::BTHLEGUIDToString(characteristic.CharacteristicUuid);
-
-									// Notify that we got characteristic info
-									std::string discoveredCharacteristicMessage = "DiscoveredCharacteristic~";
-									discoveredCharacteristicMessage.append(address);
-									discoveredCharacteristicMessage.append("~");
-									discoveredCharacteristicMessage.append(gattServiceUuidString);
-									discoveredCharacteristicMessage.append("~");
-									discoveredCharacteristicMessage.append(gattCharacteristicUuidString);
-									SendBluetoothMessage(discoveredCharacteristicMessage);
-								}
-							}
-							else
-							{
-								SendError(std::string("Device ").append(address).append(" reported 0 characteristics."));
-							}
-						}
-						else
-						{
-							SendError(std::string("GATT service id ").append(gattServiceUuidString).append(" does not match service id ").append(BLEUtils::BTHLEGUIDToString(service->id)));
-						}
-					}
+		SendError("Null service filter");
+		return 0;
+	}
 
-					// No matter what we're done looking through the services
-					return;
-				}
-			}
-		}
+	DebugLog(std::string("_winBluetoothLERegisterServiceFilter: ").append(serviceUUIDsString));
 
-		if (firstService)
-		{
-			SendError(std::string("Did not find any service for device ").append(address));
-		}
-	}
-	else
+	auto filter = BLEServiceFilter::Parse(serviceUUIDsString);
+	if (filter.IsEmpty())
 	{
-		SendError(std::string("Can't connect to Null device address"));
+		SendError(std::string("Service filter ").append(serviceUUIDsString).append(" does not contain any UUID"));
+		return 0;
 	}
+
+	int filterId = nextServiceFilterId++;
+	registeredServiceFilters.emplace(filterId, std::move(filter));
+	return filterId;
 }
 
 // --------------------------------------------------------------------------
-// Disconnects from a given device
+// Forgets about a filter returned by _winBluetoothLERegisterServiceFilter
 // --------------------------------------------------------------------------
-void _winBluetoothLEDisconnectPeripheral(const char* address)
+void _winBluetoothLEUnregisterServiceFilter(int filterId)
 {
-	if (address != nullptr)
+	registeredServiceFilters.erase(filterId);
+}
+
+// --------------------------------------------------------------------------
+// Same as _winBluetoothLEScanForPeripheralsWithServices but with a registered filter,
+// a filter id of 0 notifies all the devices
+// --------------------------------------------------------------------------
+void _winBluetoothLEScanForPeripheralsWithFilter(int filterId)
+{
+	if (filterId == 0)
 	{
-		DebugLog(std::string("_winBluetoothLEDisconnectPeripheral: ").append(address));
+		startScan(nullptr);
+		return;
+	}
 
-		// Disconnect all services associated with this device
-		GUID addressGUID = BLEUtils::StringToGUID(address);
-		if (DisconnectServicesForDevice(addressGUID))
-		{
-			// Notify that we disconnected to a service!
-			std::string connectedMessage = "DisconnectedPeripheral~";
-			connectedMessage.append(BLEUtils::GUIDToString(addressGUID));
-			SendBluetoothMessage(connectedMessage);
-		}
+	auto it = registeredServiceFilters.find(filterId);
+	if (it != registeredServiceFilters.end())
+	{
+		startScan(&it->second);
 	}
 	else
 	{
-		SendError(std::string("Can't connect to Null device address"));
+		SendError(std::string("Unknown service filter ").append(std::to_string(filterId)));
 	}
 }
 
 // --------------------------------------------------------------------------
-// Reads a characteristic from a device/service
+// Same as _winBluetoothLERetrieveListOfPeripheralsWithServices but with a registered filter,
+// a filter id of 0 notifies all the connected devices
 // --------------------------------------------------------------------------
-void _winBluetoothLEReadCharacteristic(const char* address, const char* service, const char* characteristic)
+void _winBluetoothLERetrieveListOfPeripheralsWithFilter(int filterId)
 {
-	if (address == nullptr)
+	if (filterId == 0)
 	{
-		SendError("Null address");
+		notifyAllConnected();
 		return;
 	}
 
-	if (service == nullptr)
+	auto it = registeredServiceFilters.find(filterId);
+	if (it != registeredServiceFilters.end())
 	{
-		SendError("Null service");
-		return;
+		notifyConnectedServices(it->second);
 	}
-
-	if (characteristic == nullptr)
+	else
 	{
-		SendError("Null characteristic");
-		return;
+		SendError(std::string("Unknown service filter ").append(std::to_string(filterId)));
 	}
+}
 
-	DebugLog(std::string("_winBluetoothLEReadCharacteristic: ").append(address).append(", ").append(service).append(", ").append(characteristic));
+// --------------------------------------------------------------------------
+// Stops scanning for bluetooth devices
+// --------------------------------------------------------------------------
+void _winBluetoothLEStopScan()
+{
+	// The scan in progress, if any, isn't waited for and reports nothing more
+	const std::lock_guard<std::mutex> lock{ scanMutex };
+	scanScheduler.Stop();
 
-	// Find connected service handle
-	GUID addressGUID = BLEUtils::StringToGUID(address);
-	BTH_LE_UUID serviceGUID = BLEUtils::StringToBTHLEUUID(service);
-	auto servIt = std::find_if(connectedServices.begin(), connectedServices.end(), [addressGUID, serviceGUID](BLEConnectedServiceInfo* s) { return s->service->device->containerId == addressGUID && s->service->id == serviceGUID; });
-	if (servIt != connectedServices.end())
-	{
-		// Find characteristic!
-		BTH_LE_UUID characteristicGUID = BLEUtils::StringToBTHLEUUID(characteristic);
-		auto cservice = *servIt;
-		auto charIt = std::find_if(cservice->characteristics.begin(), cservice->characteristics.end(), [characteristicGUID](const BTH_LE_GATT_CHARACTERISTIC& c) { return c.CharacteristicUuid == characteristicGUID; });
-		if (charIt != cservice->characteristics.end())
-		{
-			auto charVal = AllocAndReadCharacteristic(cservice->deviceHandle, &(*charIt));
-			if (charVal != nullptr)
-			{
-				// Notify that we got characteristic info
-				std::string readCharacteristicMessage = "DidUpdateValueForCharacteristic~";
-				readCharacteristicMessage.append(address);
-				readCharacteristicMessage.append("~");
-				readCharacteristicMessage.append(characteristic);
-				readCharacteristicMessage.append("~");
-				readCharacteristicMessage.append(BLEUtils::Base64Encode(charVal->Data,charVal->DataSize));
-				SendBluetoothMessage(readCharacteristicMessage);
+	// The next scan reports all the devices and errors again
+	scannedDevices.clear();
+	reportedScanErrors.clear();
+}
 
-				// Clean up!
-				free(charVal);
-			}
-		}
-		else
-		{
-			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to read."));
-		}
-	}
-	else
-	{
-		SendError(std::string("Could not find device ").append(address).append(" to read from."));
-	}
+// --------------------------------------------------------------------------
+// Sets the time between two scans while scanning
+// --------------------------------------------------------------------------
+void _winBluetoothLESetScanInterval(int milliseconds)
+{
+	scanScheduler.SetInterval(std::chrono::milliseconds(std::max(milliseconds, 0)));
 }
 
 // --------------------------------------------------------------------------
-// Writes a characteristic to a device/service
+// Runs work on the calling thread and on command workers, threadCount of them
+// in total, and returns once they are all done. work must take its items from
+// a shared counter: the caller doesn't wait for workers that haven't started,
+// it does their share instead, so a busy pool never blocks it.
 // --------------------------------------------------------------------------
-void _winBluetoothLEWriteCharacteristic(const char* address, const char* service, const char* characteristic, const unsigned char* data, int length, bool withResponse)
+void runWithHelpers(size_t threadCount, const std::function<void()>& work)
 {
-	if (address == nullptr)
+	struct Helpers
 	{
-		SendError("Null address");
-	}
-
-	if (service == nullptr)
+		std::mutex mutex;
+		std::condition_variable idle;
+		size_t running;
+		bool done; // Helpers starting from now on return right away
+	};
+	auto helpers = std::make_shared<Helpers>();
+	helpers->running = 0;
+	helpers->done = false;
+
+	auto workPtr = &work;
+	for (size_t i = 1; i < threadCount; ++i)
 	{
-		SendError("Null service");
+		commandQueue.Post([helpers, workPtr](int)
+			{
+				{
+					const std::lock_guard<std::mutex> lock{ helpers->mutex };
+					if (helpers->done)
+					{
+						return;
+					}
+					++helpers->running;
+				}
+				(*workPtr)();
+				const std::lock_guard<std::mutex> lock{ helpers->mutex };
+				if (--helpers->running == 0)
+				{
+					helpers->idle.notify_all();
+				}
+			});
 	}
 
-	if (characteristic == nullptr)
-	{
-		SendError("Null characteristic");
-	}
+	work();
+	std::unique_lock<std::mutex> lock{ helpers->mutex };
+	helpers->done = true;
+	helpers->idle.wait(lock, [&helpers]() { return helpers->running == 0; });
+}
 
-	if (data == nullptr)
-	{
-		SendError("Null data");
-	}
+// --------------------------------------------------------------------------
+// Opens a service of the device being connected and reads its GATT info,
+// runs on the connecting thread or a command worker alongside the device's other services
+// --------------------------------------------------------------------------
+struct ServiceDiscovery
+{
+	const BLEServiceInfo* service;
+	std::uint64_t fingerprint; // Of the device's services, for the GATT cache
+	BLEConnectedServiceInfo* connInfo; // Null if the service couldn't be opened
+	bool matches; // Whether the GATT service matches the service id
+	bool fromCache; // Whether the GATT info came from the cache, it is checked later in that case
+	CommandStatus status;
+};
 
-	std::string msg{ "_winBluetoothLEWriteCharacteristic: " };
-	msg.append(address).append(", ").append(service).append(", ").append(characteristic);
-	if (length > 0) msg.append(", data[0]=").append(std::to_string((int)data[0]));
-		DebugLog(msg.append(", length=").append(std::to_string(length)));
+void discoverService(ServiceDiscovery& discovery)
+{
+	currentCommand = &discovery.status;
 
-	// Find connected service handle
-	GUID addressGUID = BLEUtils::StringToGUID(address);
-	BTH_LE_UUID serviceGUID = BLEUtils::StringToBTHLEUUID(service);
-	auto servIt = std::find_if(connectedServices.begin(), connectedServices.end(), [addressGUID, serviceGUID](BLEConnectedServiceInfo* s) { return s->service->device->containerId == addressGUID && s->service->id == serviceGUID; });
-	if (servIt != connectedServices.end())
+	const BLEServiceInfo* service = discovery.service;
+	HANDLE serviceHandle = CreateFile(BLEUtils::ToWide(service->path.data()).data(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (serviceHandle != INVALID_HANDLE_VALUE)
 	{
-		// Find characteristic!
-		BTH_LE_UUID characteristicGUID = BLEUtils::StringToBTHLEUUID(characteristic);
-		auto cservice = *servIt;
-
-		// Find characteristic!
-		auto charIt = std::find_if(cservice->characteristics.begin(), cservice->characteristics.end(), [characteristicGUID](const BTH_LE_GATT_CHARACTERISTIC& c) { return c.CharacteristicUuid == characteristicGUID; });
-		if (charIt != cservice->characteristics.end())
+		// Filled in before being published to the registry, readers only see it complete
+		auto connInfo = registry.NewConnectedService();
+		connInfo->service = service;
+		connInfo->deviceHandle = serviceHandle;
+		connInfo->gattFingerprint = discovery.fingerprint;
+		discovery.connInfo = connInfo;
+
+		// Skip the discovery if we already know the service
+		BLEGattCache::Service cached;
+		if (gattCache.Find(service->containerId, discovery.fingerprint, service->id, cached))
 		{
-			ULONG charValueSize = length + sizeof(ULONG);
-			PBTH_LE_GATT_CHARACTERISTIC_VALUE newCharVal = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)malloc(charValueSize);
-			if (newCharVal != nullptr)
+			connInfo->gattService = cached.gattService;
+			connInfo->SetCharacteristics(std::move(cached.characteristics));
+			if (cached.descriptors.size() == connInfo->characteristics.size())
 			{
-				RtlZeroMemory(newCharVal, charValueSize);
-				newCharVal->DataSize = length;
-				memcpy(newCharVal->Data, data, length);
+				connInfo->descriptors = std::move(cached.descriptors);
+			}
+			discovery.matches = true;
+			discovery.fromCache = true;
+		}
 
-				ULONG flags = withResponse ? BLUETOOTH_GATT_FLAG_NONE : BLUETOOTH_GATT_FLAG_WRITE_WITHOUT_RESPONSE;
-				HRESULT hr = BluetoothGATTSetCharacteristicValue(cservice->deviceHandle, &(*charIt), newCharVal, NULL, withResponse);
-				if (hr == S_OK)
-				{
-					// Notify that the write was successful
-					std::string writeCharacteristicMessage = "DidWriteCharacteristic~";
-					writeCharacteristicMessage.append(characteristic);
-					SendBluetoothMessage(writeCharacteristicMessage);
-				}
-				else
+		// Get GATT service ids and characteristics
+		else if (GetGATTService(serviceHandle, connInfo->gattService))
+		{
+			// Check that the GATT service ID matches the service ID
+			discovery.matches = BLEUtils::ToUuid(connInfo->gattService.ServiceUuid) == service->id;
+			if (discovery.matches)
+			{
+				connInfo->SetCharacteristics(GetGATTCharacteristics(serviceHandle, connInfo->gattService));
+				if (gattCache.IsOpen())
 				{
-					_com_error err(hr);
-					SendError(std::string("Could not write characteristic value for ").append(characteristic).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+					gattCache.Store(service->containerId, discovery.fingerprint, { connInfo->gattService, connInfo->characteristics, {} });
 				}
-
-				// Clean up!
-				free(newCharVal);
 			}
 			else
 			{
-				SendOutOfMemoryError(charValueSize);
+				SendError(std::string("GATT service id ").append(BLEUtils::BTHLEGUIDToString(connInfo->gattService.ServiceUuid)).append(" does not match service id ").append(BLEUtils::UuidToBTHLEString(service->id)));
 			}
 		}
-		else
-		{
-			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to write."));
-		}
 	}
 	else
 	{
-		SendError(std::string("Could not find device ").append(address).append(" to write to."));
+		DebugWarning(std::string("Could not open service ").append(BLEUtils::UuidToBTHLEString(service->id)));
 	}
+
+	currentCommand = nullptr;
 }
 
+// Defined below, a device whose cached GATT table was wrong is reconnected
+bool connectToPeripheral(const char* address, bool reportConnection = true);
+void disconnectPeripheral(const char* address);
+
 // --------------------------------------------------------------------------
-// Called when a characteristic value changes!
+// Runs on the device strand after connecting with cached GATT info, once the
+// connection was reported. If the device's GATT table changed since it was
+// stored, the cache is updated and the device reconnected, so that its
+// connection uses the actual handles. Its subscriptions must be made again.
 // --------------------------------------------------------------------------
-void CALLBACK HandleBLENotification(BTH_LE_GATT_EVENT_TYPE EventType, PVOID EventOutParameter, PVOID Context)
+void revalidateCachedServices(const BLEUtils::Uuid& containerId, const std::vector<BLEUtils::Uuid>& serviceIds, std::uint64_t fingerprint)
 {
-	PBLUETOOTH_GATT_VALUE_CHANGED_EVENT ValueChangedEventParameters = (PBLUETOOTH_GATT_VALUE_CHANGED_EVENT)EventOutParameter;
-
-	//// Notify that we got characteristic info
-	//std::string wroteCharacteristicMessage = "DidWriteCharacteristic~";
-	//wroteCharacteristicMessage.append(characteristic);
-	//SendBluetoothMessage(wroteCharacteristicMessage);
-
-	// Find the characteristic
-	auto charInfo = (BLERegisteredCharacteristicInfo*)Context;
-	auto charIt = std::find(registeredCharacteristics.begin(), registeredCharacteristics.end(), charInfo);
-	if (charIt != registeredCharacteristics.end())
+	bool changed = false;
 	{
-		// Notify that we got characteristic info
-		std::string readCharacteristicMessage = "DidUpdateValueForCharacteristic~";
-		readCharacteristicMessage.append(BLEUtils::GUIDToString(charInfo->service->service->device->containerId));
-		readCharacteristicMessage.append("~");
-		readCharacteristicMessage.append(BLEUtils::BTHLEGUIDToString(charInfo->characteristic.CharacteristicUuid));
-		readCharacteristicMessage.append("~");
-		readCharacteristicMessage.append(BLEUtils::Base64Encode(ValueChangedEventParameters->CharacteristicValue->Data, (unsigned int)ValueChangedEventParameters->CharacteristicValueDataSize));
-		SendBluetoothMessage(readCharacteristicMessage);
+		// Holding the snapshot keeps the handles open even if the device gets disconnected meanwhile
+		auto snapshot = registry.Read();
+		for (const auto& serviceId : serviceIds)
+		{
+			// Skipped if disconnected or reconnected since
+			auto connInfo = snapshot->FindConnectedService(containerId, serviceId);
+			if (connInfo == nullptr || connInfo->gattFingerprint != fingerprint)
+			{
+				continue;
+			}
+
+			BLEGattCache::Service current{ connInfo->gattService, connInfo->characteristics, {} };
+			BLEGattCache::Service actual;
+			if (GetGATTService(connInfo->deviceHandle, actual.gattService) && BLEUtils::ToUuid(actual.gattService.ServiceUuid) == serviceId)
+			{
+				actual.characteristics = GetGATTCharacteristics(connInfo->deviceHandle, actual.gattService);
+				if (!BLEGattCache::SameLayout(current, actual))
+				{
+					gattCache.Store(containerId, fingerprint, actual);
+					changed = true;
+				}
+			}
+		}
 	}
-	else
+
+	if (changed)
 	{
-		SendError(std::string("Received BLE notification for characteristic ").append(BLEUtils::BTHLEGUIDToString(charInfo->characteristic.CharacteristicUuid)).append(" which we did not register with."));
+		auto address = BLEUtils::UuidToString(containerId);
+		DebugWarning(std::string("GATT table of device ").append(address).append(" changed since it was cached, reconnecting"));
+		disconnectPeripheral(address.c_str());
+		connectToPeripheral(address.c_str());
 	}
 }
 
-
 // --------------------------------------------------------------------------
-// Subscribe to a characteristic changing values!
+// Connects to a given device and list services/characteristics.
+// All the services of the device are opened and discovered in parallel, then the
+// connection and the whole GATT table are reported at once, unless the caller
+// reports the connection itself. Returns whether the device is connected.
 // --------------------------------------------------------------------------
-void _winBluetoothLESubscribeCharacteristic(const char* address, const char* service, const char* characteristic)
+bool connectToPeripheral(const char* address, bool reportConnection)
 {
-	if (address == nullptr)
+	if (address != nullptr)
 	{
-		SendError("Null address");
-		return;
-	}
+		DebugLog(std::string("_winBluetoothLEConnectToPeripheral: ").append(address));
 
-	if (service == nullptr)
-	{
-		SendError("Null service");
-		return;
-	}
-
-	if (characteristic == nullptr)
-	{
-		SendError("Null characteristic");
-		return;
-	}
-
-	DebugLog(std::string("_winBluetoothLESubscribeCharacteristic: ").append(address).append(", ").append(service).append(", ").append(characteristic));
-
-	// Find connected service handle
-	GUID addressGUID = BLEUtils::StringToGUID(address);
-	BTH_LE_UUID serviceGUID = BLEUtils::StringToBTHLEUUID(service);
-	auto servIt = std::find_if(connectedServices.begin(), connectedServices.end(), [addressGUID, serviceGUID](BLEConnectedServiceInfo* s) { return s->service->device->containerId == addressGUID && s->service->id == serviceGUID; });
-	if (servIt != connectedServices.end())
-	{
-		// Find characteristic!
-		BTH_LE_UUID characteristicGUID = BLEUtils::StringToBTHLEUUID(characteristic);
-		auto cservice = *servIt;
-		auto charIt = std::find_if(cservice->characteristics.begin(), cservice->characteristics.end(), [characteristicGUID](const BTH_LE_GATT_CHARACTERISTIC& c) { return c.CharacteristicUuid == characteristicGUID; });
-		if (charIt != cservice->characteristics.end())
+		// Gather the services of the device that aren't connected yet
+		std::vector<ServiceDiscovery> discoveries;
+		std::vector<BLEUtils::Uuid> serviceIds;
+		bool alreadyConnected = false;
+		auto addressGUID = BLEUtils::StringToUuid(address);
 		{
-			if (charIt->IsNotifiable)
+			auto snapshot = registry.Read();
+			for (auto service : snapshot->services)
 			{
-				// Set up the Client Characteristic Configuration Descriptor, so that we are 'allowed' to receive notifications!
-
-				// Retrieve all descriptors for this characteristic
-				auto descs = GetGATTDescriptors(cservice->deviceHandle, &(*charIt));
-
-				// And find the client one
-				auto descIt = std::find_if(descs.begin(), descs.end(), [](const BTH_LE_GATT_DESCRIPTOR& d) { return d.DescriptorType == ClientCharacteristicConfiguration; });
-				if (descIt != descs.end())
+				if (service != nullptr && service->containerId == addressGUID)
 				{
-					// Got it, write to it now to indicate we want to be notified!
-					BTH_LE_GATT_DESCRIPTOR_VALUE newValue;
-					RtlZeroMemory(&newValue, sizeof(newValue));
-					newValue.DescriptorType = ClientCharacteristicConfiguration;
-					newValue.ClientCharacteristicConfiguration.IsSubscribeToNotification = TRUE;
-
-					// Subscribe to an event.
-					HRESULT hr = BluetoothGATTSetDescriptorValue(cservice->deviceHandle, &(*descIt), &newValue, BLUETOOTH_GATT_FLAG_NONE);
-					if (hr == S_OK)
+					serviceIds.push_back(service->id);
+					if (snapshot->IsServiceConnected(service))
 					{
-						// set the appropriate callback function when the descriptor change value
-						auto charInfo = new BLERegisteredCharacteristicInfo();
-						charInfo->service = cservice;
-						charInfo->characteristic = *charIt;
-
-						BLUETOOTH_GATT_VALUE_CHANGED_EVENT_REGISTRATION EventParameterIn;
-						EventParameterIn.Characteristics[0] = *charIt;
-						EventParameterIn.NumCharacteristics = 1;
-
-						hr = BluetoothGATTRegisterEvent( 
-							cservice->deviceHandle,
-							CharacteristicValueChangedEvent,
-							(PVOID)&EventParameterIn,
-							(PFNBLUETOOTH_GATT_EVENT_CALLBACK)HandleBLENotification,
-							charInfo,
-							&charInfo->characteristicHandle,
-							BLUETOOTH_GATT_FLAG_NONE);
-						if (hr == S_OK)
-						{
-							// Remember we registered with the characteristic
-							registeredCharacteristics.push_back(charInfo);
-
-							// Send message
-							std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
-							registerCharacteristicMessage.append(address);
-							registerCharacteristicMessage.append("~");
-							registerCharacteristicMessage.append(characteristic);
-							SendBluetoothMessage(registerCharacteristicMessage);
-						}
-						else
-						{
-							delete charInfo;
-							_com_error err(hr);
-							SendError(std::string("Could not register with characteristic ").append(address).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
-						}
+						alreadyConnected = true;
 					}
 					else
 					{
-						_com_error err(hr);
-						SendError(std::string("Could not set Client Config descriptor value for characteristic ").append(address).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+						discoveries.push_back({ service, 0, nullptr, false, false, { false, std::string() } });
 					}
 				}
-				else
+			}
+		}
+
+		// The cached GATT tables are only valid for the same set of services
+		std::uint64_t fingerprint = BLEGattCache::Fingerprint(serviceIds);
+		for (auto& discovery : discoveries)
+		{
+			discovery.fingerprint = fingerprint;
+		}
+
+		// Services are picked in order by the calling thread and a few command workers
+		std::atomic<size_t> nextDiscovery{ 0 };
+		CommandStatus* callerCommand = currentCommand;
+		runWithHelpers(std::min(serviceDiscoveryConcurrency, discoveries.size()), [&discoveries, &nextDiscovery]()
+			{
+				for (size_t i = nextDiscovery.fetch_add(1); i < discoveries.size(); i = nextDiscovery.fetch_add(1))
+				{
+					discoverService(discoveries[i]);
+				}
+			});
+		currentCommand = callerCommand;
+
+		// Remember we connected to the services, so we can clean up later!
+		{
+			auto writer = registry.Write();
+			for (auto& discovery : discoveries)
+			{
+				if (discovery.connInfo != nullptr)
+				{
+					writer.Edit().AddConnectedService(discovery.connInfo);
+				}
+			}
+		}
+
+		std::vector<std::string> gattMessages;
+		std::vector<BLEUtils::Uuid> cachedServiceIds;
+		for (auto& discovery : discoveries)
+		{
+			// Errors were sent from the discovery threads, the command fails with the first one
+			if (discovery.status.failed && currentCommand != nullptr && !currentCommand->failed)
+			{
+				*currentCommand = discovery.status;
+			}
+			if (discovery.connInfo == nullptr || !discovery.matches)
+			{
+				continue;
+			}
+
+			// Cached info is checked against the device once we are done here
+			auto connInfo = discovery.connInfo;
+			if (discovery.fromCache)
+			{
+				cachedServiceIds.push_back(discovery.service->id);
+			}
+
+			// Notify that we indeed got the GATT service info!
+			auto gattServiceUuidString = BLEUtils::BTHLEGUIDToString(connInfo->gattService.ServiceUuid);
+			gattMessages.push_back(std::string("DiscoveredService~").append(address).append("~").append(gattServiceUuidString));
+
+			if (connInfo->characteristics.size() > 0)
+			{
+				for (auto& characteristic : connInfo->characteristics)
 				{
-					SendError(std::string("Could not find Client Config descriptor for characteristic ").append(characteristic));
+					// Notify that we got characteristic info
+					gattMessages.push_back(std::string("DiscoveredCharacteristic~").append(address).append("~").append(gattServiceUuidString)
+						.append("~").append(BLEUtils::BTHLEGUIDToString(characteristic.CharacteristicUuid)));
 				}
 			}
 			else
 			{
-				SendError(std::string("Characteristic ").append(characteristic).append(" is not Notifiable."));
+				SendError(std::string("Device ").append(address).append(" reported 0 characteristics for service ").append(gattServiceUuidString));
+			}
+		}
+
+		bool connected = std::any_of(discoveries.begin(), discoveries.end(), [](const ServiceDiscovery& d) { return d.connInfo != nullptr; });
+		if (connected || alreadyConnected)
+		{
+			// Notify that we connected, along with the GATT table, in one go
+			if (reportConnection)
+			{
+				gattMessages.insert(gattMessages.begin(), std::string("ConnectedPeripheral~").append(address));
+				SendBluetoothMessages(gattMessages);
+			}
+
+			// The check is queued behind the device's other commands, even when commands
+			// run on the caller's thread, which doesn't wait for the device again
+			if (!cachedServiceIds.empty())
+			{
+				commandQueue.Enqueue(addressGUID, [addressGUID, cachedServiceIds, fingerprint](int) { revalidateCachedServices(addressGUID, cachedServiceIds, fingerprint); });
 			}
+			return true;
 		}
 		else
 		{
-			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to subscribe to."));
+			SendError(std::string("Did not find any service for device ").append(address));
 		}
 	}
 	else
 	{
-		SendError(std::string("Could not find device ").append(address).append(" to subscribe to."));
+		SendError(std::string("Can't connect to Null device address"));
 	}
+	return false;
 }
 
 // --------------------------------------------------------------------------
-// Unsubscribe! ;)
+// Connects to a device and sends ConnectSucceeded~<address> or ConnectFailed~<address>~<error>,
+// returns whether it connected
+// --------------------------------------------------------------------------
+bool connectAndReport(const std::string& address)
+{
+	CommandStatus status{ false, std::string() };
+	CommandStatus* callerCommand = currentCommand;
+	currentCommand = &status;
+	connectToPeripheral(address.c_str());
+	currentCommand = callerCommand;
+	if (status.failed && currentCommand != nullptr && !currentCommand->failed)
+	{
+		*currentCommand = status;
+	}
+
+	std::string message = status.failed ? "ConnectFailed~" : "ConnectSucceeded~";
+	message.append(address);
+	if (status.failed)
+	{
+		message.append("~");
+		message.append(status.error);
+	}
+	SendBluetoothMessage(message);
+	return !status.failed;
+}
+
+void reportConnectFailures(size_t failedCount, size_t deviceCount)
+{
+	if (failedCount > 0)
+	{
+		SendError(std::string("Could not connect to ").append(std::to_string(failedCount)).append(" of ").append(std::to_string(deviceCount)).append(" devices"));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Connects to several devices, up to connectConcurrency at a time on the caller's
+// thread and command workers, each device sends its message as soon as it's done.
+// Used when commands run on the caller's thread, returns once all are done.
+// --------------------------------------------------------------------------
+void connectToPeripherals(const std::vector<std::string>& addresses)
+{
+	DebugLog(std::string("_winBluetoothLEConnectToPeripherals: ").append(std::to_string(addresses.size())).append(" devices"));
+
+	std::atomic<size_t> nextAddress{ 0 };
+	std::atomic<size_t> failedCount{ 0 };
+	runWithHelpers(std::min((size_t)connectConcurrency.load(), addresses.size()), [&addresses, &nextAddress, &failedCount]()
+		{
+			for (size_t i = nextAddress.fetch_add(1); i < addresses.size(); i = nextAddress.fetch_add(1))
+			{
+				if (!connectAndReport(addresses[i]))
+				{
+					failedCount.fetch_add(1);
+				}
+			}
+		});
+	reportConnectFailures(failedCount.load(), addresses.size());
+}
+
+// --------------------------------------------------------------------------
+// Disconnects from a given device
+// --------------------------------------------------------------------------
+void disconnectPeripheral(const char* address)
+{
+	if (address != nullptr)
+	{
+		DebugLog(std::string("_winBluetoothLEDisconnectPeripheral: ").append(address));
+
+		// Disconnect all services associated with this device
+		auto addressGUID = BLEUtils::StringToUuid(address);
+		if (DisconnectServicesForDevice(addressGUID))
+		{
+			// Notify that we disconnected to a service!
+			std::string connectedMessage = "DisconnectedPeripheral~";
+			connectedMessage.append(BLEUtils::UuidToString(addressGUID));
+			SendBluetoothMessage(connectedMessage);
+		}
+		flushGattCache();
+	}
+	else
+	{
+		SendError(std::string("Can't connect to Null device address"));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Reads a characteristic's value into result. Unless reading from Windows'
+// cache, the read shares the result of any read of the same characteristic
+// that completes after this one started, see BLEReadCoalescer.
+// Returns false if the read failed, the error has been sent.
+// --------------------------------------------------------------------------
+bool readSharedValue(BLEConnectedServiceInfo* cservice, BTH_LE_GATT_CHARACTERISTIC* gattCharacteristic, const BLEReadKey& key, ULONG flags, BLEReadCoalescer::Result& result)
+{
+	bool coalesce = (flags & BLUETOOTH_GATT_FLAG_FORCE_READ_FROM_CACHE) == 0;
+	if (coalesce)
+	{
+		if (readCoalescer.Join(key, result))
+		{
+			// Answered by another read
+			if (!result.succeeded)
+			{
+				SendError(result.error);
+			}
+			return result.succeeded;
+		}
+	}
+
+	// Keep the error to pass it on to the reads waiting for this one
+	CommandStatus readStatus{ false, std::string() };
+	CommandStatus* callerCommand = currentCommand;
+	currentCommand = &readStatus;
+	bool heapBuffer = false;
+	auto charVal = ReadCharacteristicValue(cservice, gattCharacteristic, flags, heapBuffer);
+	currentCommand = callerCommand;
+	if (readStatus.failed && currentCommand != nullptr && !currentCommand->failed)
+	{
+		*currentCommand = readStatus;
+	}
+
+	result.succeeded = charVal != nullptr;
+	if (charVal != nullptr)
+	{
+		result.value.assign(charVal->Data, charVal->Data + charVal->DataSize);
+		ReleaseCharacteristicValue(cservice, charVal, heapBuffer);
+	}
+	else
+	{
+		result.error = readStatus.error;
+	}
+
+	if (coalesce)
+	{
+		readCoalescer.Complete(key, result);
+	}
+	return result.succeeded;
+}
+
+// --------------------------------------------------------------------------
+// Reads a characteristic from a device/service
 // --------------------------------------------------------------------------
-void _winBluetoothLEUnSubscribeCharacteristic(const char* address, const char* service, const char* characteristic)
+void readCharacteristic(const char* address, const char* service, const char* characteristic, int mode = BLEReadDefault)
 {
 	if (address == nullptr)
 	{
@@ -1337,72 +1819,1616 @@ void _winBluetoothLEUnSubscribeCharacteristic(const char* address, const char* s
 		return;
 	}
 
-	DebugLog(std::string("_winBluetoothLEUnSubscribeCharacteristic: ").append(address).append(", ").append(service).append(", ").append(characteristic));
+	ULONG flags = BLUETOOTH_GATT_FLAG_NONE;
+	switch (mode)
+	{
+	case BLEReadDefault:
+		break;
+	case BLEReadFromDevice:
+		flags = BLUETOOTH_GATT_FLAG_FORCE_READ_FROM_DEVICE;
+		break;
+	case BLEReadFromCache:
+		flags = BLUETOOTH_GATT_FLAG_FORCE_READ_FROM_CACHE;
+		break;
+	default:
+		SendError(std::string("Invalid read mode ").append(std::to_string(mode)));
+		return;
+	}
 
-	// Find registered characteristic!
-	GUID addressGUID = BLEUtils::StringToGUID(address);
-	BTH_LE_UUID serviceGUID = BLEUtils::StringToBTHLEUUID(service);
-	BTH_LE_UUID characteristicGUID = BLEUtils::StringToBTHLEUUID(characteristic);
-	auto charIt = std::find_if(
-		registeredCharacteristics.begin(),
-		registeredCharacteristics.end(),
-		[addressGUID, serviceGUID, characteristicGUID] (BLERegisteredCharacteristicInfo* c)
-		{
-		// Check device!
-		return	c->service->service->device->containerId == addressGUID &&
-				c->service->service->id == serviceGUID &&
-				c->characteristic.CharacteristicUuid == characteristicGUID;
-		});
+	// No per read log, reads may be polled
 
-	if (charIt != registeredCharacteristics.end())
+	// Find connected service handle
+	BLEReadKey key{ BLEUtils::Uuid::Parse(address), BLEUtils::Uuid::Parse(service), BLEUtils::Uuid::Parse(characteristic), mode };
+	auto snapshot = registry.Read();
+	auto cservice = snapshot->FindConnectedService(key.device, key.service);
+	if (cservice != nullptr)
 	{
-		// Unregister
-		auto charInfo = *charIt;
-		HRESULT hr = BluetoothGATTUnregisterEvent(charInfo->characteristicHandle, BLUETOOTH_GATT_FLAG_NONE);
-		if (hr == S_OK)
+		// Find characteristic!
+		auto gattCharacteristic = cservice->FindCharacteristic(key.characteristic);
+		if (gattCharacteristic != nullptr)
 		{
-			// Clean up
-			delete charInfo;
-			registeredCharacteristics.erase(charIt);
-
-			// Send message
-			std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
-			registerCharacteristicMessage.append(address);
-			registerCharacteristicMessage.append("~");
-			registerCharacteristicMessage.append(characteristic);
-			SendBluetoothMessage(registerCharacteristicMessage);
+			BLEReadCoalescer::Result result;
+			if (readSharedValue(cservice, gattCharacteristic, key, flags, result))
+			{
+				// Notify that we got characteristic info
+				std::string readCharacteristicMessage = "DidUpdateValueForCharacteristic~";
+				readCharacteristicMessage.append(address);
+				readCharacteristicMessage.append("~");
+				readCharacteristicMessage.append(characteristic);
+				readCharacteristicMessage.append("~");
+				readCharacteristicMessage.append(BLEUtils::Base64Encode(result.value.data(), (unsigned int)result.value.size()));
+				SendBluetoothMessage(readCharacteristicMessage);
+			}
 		}
 		else
 		{
-			_com_error err(hr);
-			SendError(std::string("Could not unregister from characteristic event").append(address).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to read."));
 		}
 	}
 	else
 	{
-		SendError(std::string("Could not find notification registration data for characteristic ").append(characteristic));
+		SendError(std::string("Could not find device ").append(address).append(" to read from."));
 	}
 }
 
 // --------------------------------------------------------------------------
-// Clean up
+// Reads a polled characteristic, the value is only sent when it changed.
+// The first value read after connecting is always sent.
 // --------------------------------------------------------------------------
-void _winBluetoothLEDisconnectAll()
+void readPolledCharacteristic(PollTarget& target)
 {
-	DebugLog("_winBluetoothLEDisconnectAll");
+	auto snapshot = registry.Read();
+	auto cservice = snapshot->FindConnectedService(target.key.device, target.key.service);
+	auto gattCharacteristic = cservice != nullptr ? cservice->FindCharacteristic(target.key.characteristic) : nullptr;
+	if (gattCharacteristic == nullptr)
+	{
+		// Not connected, polls continue once it is
+		target.hasValue = false;
+	}
+	else if (readSharedValue(cservice, gattCharacteristic, target.key, BLUETOOTH_GATT_FLAG_FORCE_READ_FROM_DEVICE, target.result)
+		&& (!target.hasValue || target.result.value != target.lastValue))
+	{
+		target.lastValue.swap(target.result.value);
+		target.hasValue = true;
+
+		// Same message as a notification
+		std::string pollMessage = "DidUpdateValueForCharacteristic~";
+		pollMessage.append(target.address);
+		pollMessage.append("~");
+		pollMessage.append(target.characteristic);
+		pollMessage.append("~");
+		pollMessage.append(BLEUtils::Base64Encode(target.lastValue.data(), (unsigned int)target.lastValue.size()));
+		SendBluetoothMessage(pollMessage);
+	}
 
-	// Disconnect from devices if needed!
-	for (auto device : devices)
+	const std::lock_guard<std::mutex> lock{ pollMutex };
+	target.inFlight = false;
+}
+
+// --------------------------------------------------------------------------
+// Called by the poll scheduler. In async mode the read is queued on the device
+// strand, so that it's ordered with the device's other commands. Otherwise it
+// runs on the scheduler's thread, and the polls due after it wait for it.
+// --------------------------------------------------------------------------
+void pollCharacteristic(int pollId)
+{
+	std::shared_ptr<PollTarget> target;
 	{
-		if (DisconnectServicesForDevice(device->containerId))
+		const std::lock_guard<std::mutex> lock{ pollMutex };
+		auto it = pollTargets.find(pollId);
+		if (it == pollTargets.end() || it->second->inFlight)
 		{
-			// Notify that we disconnected to a service!
-			std::string connectedMessage = "DisconnectedPeripheral~";
-			connectedMessage.append(BLEUtils::GUIDToString(device->containerId));
-			SendBluetoothMessage(connectedMessage);
+			return;
 		}
+		target = it->second;
+		target->inFlight = true;
+	}
+
+	if (asyncCommands.load())
+	{
+		commandQueue.Enqueue(target->key.device, [target](int) { readPolledCharacteristic(*target); });
+	}
+	else
+	{
+		readPolledCharacteristic(*target);
+	}
+}
+
+// --------------------------------------------------------------------------
+// Writes a characteristic to a device/service
+// --------------------------------------------------------------------------
+void writeCharacteristic(const char* address, const char* service, const char* characteristic, const unsigned char* data, int length, bool withResponse)
+{
+	if (address == nullptr)
+	{
+		SendError("Null address");
+		return;
+	}
+
+	if (service == nullptr)
+	{
+		SendError("Null service");
+		return;
+	}
+
+	if (characteristic == nullptr)
+	{
+		SendError("Null characteristic");
+		return;
+	}
+
+	if (data == nullptr && length > 0)
+	{
+		SendError("Null data");
+		return;
+	}
+
+	if (length < 0 || length > (int)BLEConnectedServiceInfo::MaxValueSize)
+	{
+		SendError(std::string("Invalid characteristic value length ").append(std::to_string(length)));
+		return;
 	}
-	devices.clear();
+
+	// No per write log, writes come in bursts: the reply message is the only allocation of this path
+
+	// Find connected service handle, the parsed ids are also those of the reads to invalidate
+	const BLEReadKey key{ BLEUtils::Uuid::Parse(address), BLEUtils::Uuid::Parse(service), BLEUtils::Uuid::Parse(characteristic), BLEReadDefault };
+	auto snapshot = registry.Read();
+	auto cservice = snapshot->FindConnectedService(key.device, key.service);
+	if (cservice != nullptr)
+	{
+		// Find characteristic!
+		auto gattCharacteristic = cservice->FindCharacteristic(key.characteristic);
+		if (gattCharacteristic != nullptr)
+		{
+			// The characteristic's own buffer, unless another write is using it
+			auto newCharVal = cservice->AcquireValueBuffer(gattCharacteristic, length);
+			bool heapBuffer = newCharVal == nullptr;
+			ULONG charValueSize = length + sizeof(ULONG);
+			if (heapBuffer)
+			{
+				newCharVal = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)malloc(charValueSize);
+				if (newCharVal == nullptr)
+				{
+					SendOutOfMemoryError(charValueSize);
+					return;
+				}
+				newCharVal->DataSize = length;
+			}
+			if (length > 0)
+			{
+				memcpy(newCharVal->Data, data, length);
+			}
+
+			// Reads requested from now on must not be answered with the value being overwritten
+			readCoalescer.Invalidate(key);
+
+			ULONG flags = withResponse ? BLUETOOTH_GATT_FLAG_NONE : BLUETOOTH_GATT_FLAG_WRITE_WITHOUT_RESPONSE;
+			HRESULT hr = BluetoothGATTSetCharacteristicValue(cservice->deviceHandle, gattCharacteristic, newCharVal, 0, flags);
+
+			// Clean up!
+			if (heapBuffer)
+			{
+				free(newCharVal);
+			}
+			else
+			{
+				cservice->ReleaseValueBuffer(newCharVal);
+			}
+
+			if (hr == S_OK)
+			{
+				// Notify that the write was successful, in a single allocation
+				static const char messagePrefix[] = "DidWriteCharacteristic~";
+				std::string writeCharacteristicMessage;
+				writeCharacteristicMessage.reserve(sizeof(messagePrefix) - 1 + strlen(characteristic));
+				writeCharacteristicMessage.append(messagePrefix);
+				writeCharacteristicMessage.append(characteristic);
+				SendBluetoothMessage(std::move(writeCharacteristicMessage));
+			}
+			else
+			{
+				_com_error err(hr);
+				SendError(std::string("Could not write characteristic value for ").append(characteristic).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+			}
+		}
+		else
+		{
+			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to write."));
+		}
+	}
+	else
+	{
+		SendError(std::string("Could not find device ").append(address).append(" to write to."));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Writes a burst of values, e.g. LED frames, with as little overhead per write as possible:
+// each distinct target is resolved once, values go through the characteristics' own buffers
+// and the outcome of each write is stored in statuses (S_OK or the error HRESULT) instead of
+// being sent as a message. Errors are summed up in a single error message. Nothing is
+// allocated unless there are errors.
+// --------------------------------------------------------------------------
+void writeCharacteristics(const BLEWriteRequest* requests, int count, int* statuses)
+{
+	// Targets resolved so far, bursts usually go to one or two characteristics.
+	// Past the capacity, targets are resolved for each write.
+	struct Target
+	{
+		const BLEWriteRequest* request; // First request with this target
+		BLEReadKey key; // Its parsed ids, also those of the reads its writes invalidate
+		BLEConnectedServiceInfo* cservice;
+		PBTH_LE_GATT_CHARACTERISTIC characteristic;
+	};
+	std::array<Target, 8> targets;
+	size_t targetCount = 0;
+
+	auto snapshot = registry.Read();
+	auto findTarget = [&targets, &targetCount, &snapshot](const BLEWriteRequest& request) -> Target
+	{
+		for (size_t i = 0; i < targetCount; ++i)
+		{
+			const auto& target = targets[i];
+			if (strcmp(target.request->characteristic, request.characteristic) == 0
+				&& strcmp(target.request->service, request.service) == 0
+				&& strcmp(target.request->address, request.address) == 0)
+			{
+				return target;
+			}
+		}
+		const BLEReadKey key{ BLEUtils::Uuid::Parse(request.address), BLEUtils::Uuid::Parse(request.service), BLEUtils::Uuid::Parse(request.characteristic), BLEReadDefault };
+		auto cservice = snapshot->FindConnectedService(key.device, key.service);
+		auto characteristic = cservice != nullptr ? cservice->FindCharacteristic(key.characteristic) : nullptr;
+		Target target{ &request, key, cservice, characteristic };
+		if (targetCount < targets.size())
+		{
+			targets[targetCount++] = target;
+		}
+		return target;
+	};
+
+	int failedCount = 0;
+	HRESULT firstError = S_OK;
+	for (int i = 0; i < count; ++i)
+	{
+		const auto& request = requests[i];
+		HRESULT hr = S_OK;
+		if (request.address == nullptr || request.service == nullptr || request.characteristic == nullptr
+			|| (request.data == nullptr && request.length > 0) || request.length < 0 || request.length > (int)BLEConnectedServiceInfo::MaxValueSize)
+		{
+			hr = E_INVALIDARG;
+		}
+		else
+		{
+			auto target = findTarget(request);
+			if (target.characteristic == nullptr)
+			{
+				hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+			}
+			else
+			{
+				// Same as writeCharacteristic(), a buffer is only allocated if the characteristic's one can't be used
+				auto value = target.cservice->AcquireValueBuffer(target.characteristic, request.length);
+				bool heapBuffer = value == nullptr;
+				if (heapBuffer)
+				{
+					value = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)malloc(request.length + sizeof(ULONG));
+					if (value != nullptr)
+					{
+						value->DataSize = request.length;
+					}
+				}
+				if (value == nullptr)
+				{
+					hr = E_OUTOFMEMORY;
+				}
+				else
+				{
+					if (request.length > 0)
+					{
+						memcpy(value->Data, request.data, request.length);
+					}
+					readCoalescer.Invalidate(target.key);
+					ULONG flags = request.withResponse ? BLUETOOTH_GATT_FLAG_NONE : BLUETOOTH_GATT_FLAG_WRITE_WITHOUT_RESPONSE;
+					hr = BluetoothGATTSetCharacteristicValue(target.cservice->deviceHandle, target.characteristic, value, 0, flags);
+					if (heapBuffer)
+					{
+						free(value);
+					}
+					else
+					{
+						target.cservice->ReleaseValueBuffer(value);
+					}
+				}
+			}
+		}
+
+		statuses[i] = (int)hr;
+		if (hr != S_OK)
+		{
+			if (failedCount++ == 0)
+			{
+				firstError = hr;
+			}
+		}
+	}
+
+	if (failedCount > 0)
+	{
+		_com_error err(firstError);
+		SendError(std::string("Could not write ").append(std::to_string(failedCount)).append(" of ").append(std::to_string(count))
+			.append(" characteristic values, first error: ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Writes a buffer larger than an attribute to a characteristic, in chunks of
+// chunkSize bytes. Chunks are written without response back to back, except every
+// ackInterval-th chunk and the last one which are acknowledged by the device, so
+// that we don't get ahead of it. Characteristics that can't be written without
+// response have every chunk acknowledged. Those that can only be written without
+// response can't be acknowledged, the transfer instead pauses for
+// bulkUnacknowledgedPause every ackInterval chunks to let the device catch up.
+// Sends BulkWriteProgress~<address>~<characteristic>~<bytes written>~<total bytes>~<bytes per second>
+// at most every bulkProgressInterval, then DidWriteCharacteristicBulk~<address>~<characteristic>~<total bytes>~<milliseconds>~<bytes per second>.
+// Stops at the first error, or when the device gets disconnected.
+// --------------------------------------------------------------------------
+void writeCharacteristicBulk(const char* address, const char* service, const char* characteristic, const unsigned char* data, size_t length, int chunkSize, int ackInterval)
+{
+	if (address == nullptr)
+	{
+		SendError("Null address");
+		return;
+	}
+
+	if (service == nullptr)
+	{
+		SendError("Null service");
+		return;
+	}
+
+	if (characteristic == nullptr)
+	{
+		SendError("Null characteristic");
+		return;
+	}
+
+	if (data == nullptr && length > 0)
+	{
+		SendError("Null data");
+		return;
+	}
+
+	if (chunkSize <= 0 || chunkSize > (int)BLEConnectedServiceInfo::MaxValueSize)
+	{
+		SendError(std::string("Invalid bulk write chunk size ").append(std::to_string(chunkSize)));
+		return;
+	}
+
+	ackInterval = std::max(ackInterval, 1);
+
+	DebugLog(std::string("_winBluetoothLEWriteCharacteristicBulk: ").append(address).append(", ").append(service).append(", ").append(characteristic).append(", ").append(std::to_string(length)).append(" bytes"));
+
+	// The registry is only read for each chunk, so that a long transfer doesn't hold back
+	// the reclamation of removed entries. The transfer stops if the device gets disconnected.
+	auto deviceGUID = BLEUtils::Uuid::Parse(address);
+	auto serviceGUID = BLEUtils::Uuid::Parse(service);
+	auto characteristicGUID = BLEUtils::Uuid::Parse(characteristic);
+	bool withResponse, withoutResponse;
+	{
+		auto snapshot = registry.Read();
+		auto cservice = snapshot->FindConnectedService(deviceGUID, serviceGUID);
+		if (cservice == nullptr)
+		{
+			SendError(std::string("Could not find device ").append(address).append(" to write to."));
+			return;
+		}
+
+		auto gattCharacteristic = cservice->FindCharacteristic(characteristicGUID);
+		if (gattCharacteristic == nullptr)
+		{
+			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to write."));
+			return;
+		}
+
+		withResponse = gattCharacteristic->IsWritable != FALSE;
+		withoutResponse = gattCharacteristic->IsWritableWithoutResponse != FALSE;
+		if (!withResponse && !withoutResponse)
+		{
+			SendError(std::string("Characteristic ").append(characteristic).append(" is not writable."));
+			return;
+		}
+	}
+
+	// One buffer for all the chunks, on the stack as the characteristic's own buffer belongs to the connection
+	alignas(BTH_LE_GATT_CHARACTERISTIC_VALUE) unsigned char valueStorage[BLEConnectedServiceInfo::ValueBufferStride];
+	auto value = (PBTH_LE_GATT_CHARACTERISTIC_VALUE)valueStorage;
+
+	auto bytesPerSecond = [](size_t count, std::chrono::steady_clock::duration elapsed)
+	{
+		double seconds = std::chrono::duration<double>(elapsed).count();
+		return std::to_string(seconds > 0 ? (long long)(count / seconds) : 0);
+	};
+
+	// Each chunk overwrites the value, reads requested after it must not be answered with an older one
+	BLEReadKey readKey{ deviceGUID, serviceGUID, characteristicGUID, BLEReadDefault };
+
+	size_t chunkCount = (length + chunkSize - 1) / chunkSize;
+	auto start = std::chrono::steady_clock::now();
+	auto lastProgress = start;
+	size_t written = 0;
+	HRESULT hr = S_OK;
+	for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		size_t size = std::min(length - written, (size_t)chunkSize);
+		value->DataSize = (ULONG)size;
+		memcpy(value->Data, data + written, size);
+
+		bool paceChunk = chunk + 1 == chunkCount || (chunk + 1) % ackInterval == 0;
+		bool acknowledged = !withoutResponse || (withResponse && paceChunk);
+		{
+			auto snapshot = registry.Read();
+			auto cservice = snapshot->FindConnectedService(deviceGUID, serviceGUID);
+			auto gattCharacteristic = cservice != nullptr ? cservice->FindCharacteristic(characteristicGUID) : nullptr;
+			if (gattCharacteristic == nullptr)
+			{
+				hr = HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+				break;
+			}
+
+			readCoalescer.Invalidate(readKey);
+			hr = BluetoothGATTSetCharacteristicValue(cservice->deviceHandle, gattCharacteristic, value, 0,
+				acknowledged ? BLUETOOTH_GATT_FLAG_NONE : BLUETOOTH_GATT_FLAG_WRITE_WITHOUT_RESPONSE);
+		}
+		if (hr != S_OK)
+		{
+			break;
+		}
+		written += size;
+
+		if (!withResponse && paceChunk && written < length)
+		{
+			std::this_thread::sleep_for(bulkUnacknowledgedPause);
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - lastProgress >= bulkProgressInterval && written < length)
+		{
+			lastProgress = now;
+			std::string progressMessage = "BulkWriteProgress~";
+			progressMessage.append(address);
+			progressMessage.append("~");
+			progressMessage.append(characteristic);
+			progressMessage.append("~");
+			progressMessage.append(std::to_string(written));
+			progressMessage.append("~");
+			progressMessage.append(std::to_string(length));
+			progressMessage.append("~");
+			progressMessage.append(bytesPerSecond(written, now - start));
+			SendBluetoothMessage(progressMessage);
+		}
+	}
+
+	if (hr == S_OK)
+	{
+		// Notify that the write was successful
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		std::string message = "DidWriteCharacteristicBulk~";
+		message.append(address);
+		message.append("~");
+		message.append(characteristic);
+		message.append("~");
+		message.append(std::to_string(length));
+		message.append("~");
+		message.append(std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()));
+		message.append("~");
+		message.append(bytesPerSecond(length, elapsed));
+		SendBluetoothMessage(message);
+	}
+	else
+	{
+		_com_error err(hr);
+		SendError(std::string("Could not write bulk characteristic value for ").append(characteristic).append(" after ").append(std::to_string(written))
+			.append(" of ").append(std::to_string(length)).append(" bytes ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Called when a characteristic value changes!
+// --------------------------------------------------------------------------
+void CALLBACK HandleBLENotification(BTH_LE_GATT_EVENT_TYPE EventType, PVOID EventOutParameter, PVOID Context)
+{
+	PBLUETOOTH_GATT_VALUE_CHANGED_EVENT ValueChangedEventParameters = (PBLUETOOTH_GATT_VALUE_CHANGED_EVENT)EventOutParameter;
+
+	// This runs on a Bluetooth stack thread, so we don't touch the registry here,
+	// the subscription table validates the context and gives us the message prefix
+	bool valid = subscriptionTable.Visit(Context, ValueChangedEventParameters->ChangedAttributeHandle, [ValueChangedEventParameters](const std::string& messagePrefix)
+	{
+		// Notify that we got characteristic info
+		std::string readCharacteristicMessage = messagePrefix;
+		readCharacteristicMessage.append(BLEUtils::Base64Encode(ValueChangedEventParameters->CharacteristicValue->Data, (unsigned int)ValueChangedEventParameters->CharacteristicValueDataSize));
+		SendBluetoothMessage(readCharacteristicMessage);
+	});
+
+	if (!valid)
+	{
+		SendError("Received BLE notification for a characteristic which we are not registered with.");
+	}
+}
+
+// --------------------------------------------------------------------------
+// Finds the characteristic's Client Characteristic Configuration Descriptor, the
+// descriptors are only retrieved the first time. Sets cacheChanged if they were.
+// Must be called with the service's subscription lock held.
+// --------------------------------------------------------------------------
+const BTH_LE_GATT_DESCRIPTOR* FindClientConfig(BLEConnectedServiceInfo* cservice, PBTH_LE_GATT_CHARACTERISTIC gattCharacteristic, bool& cacheChanged)
+{
+	auto& descs = cservice->descriptors[gattCharacteristic - cservice->characteristics.data()];
+	if (descs.empty())
+	{
+		descs = GetGATTDescriptors(cservice->deviceHandle, gattCharacteristic);
+		cacheChanged = cacheChanged || !descs.empty();
+	}
+
+	auto descIt = std::find_if(descs.begin(), descs.end(), [](const BTH_LE_GATT_DESCRIPTOR& d) { return d.DescriptorType == ClientCharacteristicConfiguration; });
+	return descIt != descs.end() ? &*descIt : nullptr;
+}
+
+// --------------------------------------------------------------------------
+// Registers a single event for the notifications of all the given subscriptions,
+// which then share its handle and callback context. Must be called with the
+// service's subscription lock held, returns false on error.
+// --------------------------------------------------------------------------
+bool registerNotificationEvent(BLEConnectedServiceInfo* cservice, const BLEUtils::Uuid& addressGUID, const std::vector<BLERegisteredCharacteristicInfo*>& charInfos)
+{
+	// Prepare the messages the callback sends with each notified value
+	std::vector<BLESubscriptionTable::Target> targets;
+	targets.reserve(charInfos.size());
+	for (auto charInfo : charInfos)
+	{
+		std::string notificationMessagePrefix = "DidUpdateValueForCharacteristic~";
+		notificationMessagePrefix.append(BLEUtils::UuidToString(addressGUID));
+		notificationMessagePrefix.append("~");
+		notificationMessagePrefix.append(BLEUtils::BTHLEGUIDToString(charInfo->characteristic.CharacteristicUuid));
+		notificationMessagePrefix.append("~");
+		targets.push_back({ charInfo->characteristic.AttributeHandle, charInfo->characteristic.CharacteristicValueHandle, std::move(notificationMessagePrefix) });
+	}
+
+	void* context = subscriptionTable.Acquire(targets);
+	if (context == nullptr)
+	{
+		SendError(std::string("Could not register with the characteristics of device ").append(BLEUtils::UuidToString(addressGUID)).append(", too many subscriptions"));
+		return false;
+	}
+
+	// The registration ends with a variable number of characteristics
+	std::vector<unsigned char> registrationBuffer(offsetof(BLUETOOTH_GATT_VALUE_CHANGED_EVENT_REGISTRATION, Characteristics) + charInfos.size() * sizeof(BTH_LE_GATT_CHARACTERISTIC));
+	auto registration = (PBLUETOOTH_GATT_VALUE_CHANGED_EVENT_REGISTRATION)registrationBuffer.data();
+	registration->NumCharacteristics = (USHORT)charInfos.size();
+	for (size_t i = 0; i < charInfos.size(); ++i)
+	{
+		registration->Characteristics[i] = charInfos[i]->characteristic;
+	}
+
+	BLUETOOTH_GATT_EVENT_HANDLE eventHandle;
+	HRESULT hr = BluetoothGATTRegisterEvent(
+		cservice->deviceHandle,
+		CharacteristicValueChangedEvent,
+		(PVOID)registration,
+		(PFNBLUETOOTH_GATT_EVENT_CALLBACK)HandleBLENotification,
+		context,
+		&eventHandle,
+		BLUETOOTH_GATT_FLAG_NONE);
+	if (hr != S_OK)
+	{
+		subscriptionTable.Release(context);
+		_com_error err(hr);
+		SendError(std::string("Could not register with characteristic ").append(BLEUtils::UuidToString(addressGUID)).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+		return false;
+	}
+
+	for (auto charInfo : charInfos)
+	{
+		charInfo->characteristicHandle = eventHandle;
+		charInfo->context = context;
+	}
+	return true;
+}
+
+// A characteristic to subscribe to, the descriptor is looked up unless clientConfig is given
+struct SubscriptionRequest
+{
+	BLEUtils::Uuid characteristicGUID;
+	PBTH_LE_GATT_CHARACTERISTIC gattCharacteristic;
+	const BTH_LE_GATT_DESCRIPTOR* clientConfig;
+};
+
+// --------------------------------------------------------------------------
+// Writes the Client Characteristic Configuration Descriptors of the characteristics,
+// back to back, then registers for their notifications with a single event.
+// The characteristics whose descriptor couldn't be written are skipped, check
+// the service subscriptions for the ones that succeeded. Descriptors that had
+// to be retrieved are stored in the GATT cache.
+// Must be called with the service's subscription lock held, returns the subscription count.
+// --------------------------------------------------------------------------
+size_t registerSubscriptions(BLEConnectedServiceInfo* cservice, const BLEUtils::Uuid& addressGUID, const std::vector<SubscriptionRequest>& requests)
+{
+	std::vector<BLERegisteredCharacteristicInfo*> charInfos;
+	charInfos.reserve(requests.size());
+	bool cacheChanged = false;
+	for (const auto& request : requests)
+	{
+		auto characteristicString = BLEUtils::BTHLEGUIDToString(request.gattCharacteristic->CharacteristicUuid);
+
+		// Set up the Client Characteristic Configuration Descriptor, so that we are 'allowed' to receive notifications!
+		auto clientConfig = request.clientConfig != nullptr ? request.clientConfig : FindClientConfig(cservice, request.gattCharacteristic, cacheChanged);
+		if (clientConfig == nullptr)
+		{
+			SendError(std::string("Could not find Client Config descriptor for characteristic ").append(characteristicString));
+			continue;
+		}
+
+		// Got it, write to it now to indicate we want to be notified!
+		BTH_LE_GATT_DESCRIPTOR_VALUE newValue;
+		RtlZeroMemory(&newValue, sizeof(newValue));
+		newValue.DescriptorType = ClientCharacteristicConfiguration;
+		newValue.ClientCharacteristicConfiguration.IsSubscribeToNotification = TRUE;
+
+		BTH_LE_GATT_DESCRIPTOR descriptor = *clientConfig;
+		HRESULT hr = BluetoothGATTSetDescriptorValue(cservice->deviceHandle, &descriptor, &newValue, BLUETOOTH_GATT_FLAG_NONE);
+		if (hr != S_OK)
+		{
+			_com_error err(hr);
+			SendError(std::string("Could not set Client Config descriptor value for characteristic ").append(characteristicString).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+			continue;
+		}
+
+		auto charInfo = registry.NewSubscription();
+		charInfo->service = cservice;
+		charInfo->characteristic = *request.gattCharacteristic;
+		charInfo->clientConfig = descriptor;
+		charInfos.push_back(charInfo);
+	}
+
+	if (cacheChanged && gattCache.IsOpen())
+	{
+		gattCache.Store(cservice->service->containerId, cservice->gattFingerprint, { cservice->gattService, cservice->characteristics, cservice->descriptors });
+	}
+
+	if (charInfos.empty())
+	{
+		return 0;
+	}
+
+	if (!registerNotificationEvent(cservice, addressGUID, charInfos))
+	{
+		for (auto charInfo : charInfos)
+		{
+			registry.Delete(charInfo);
+		}
+		return 0;
+	}
+
+	// Remember we registered with the characteristics
+	for (auto charInfo : charInfos)
+	{
+		cservice->subscriptions[BLEUtils::ToUuid(charInfo->characteristic.CharacteristicUuid)] = charInfo;
+	}
+	return charInfos.size();
+}
+
+// --------------------------------------------------------------------------
+// Finds a connected service and takes its subscription lock, returns null if
+// the service isn't connected. The snapshot must be kept until the lock is released.
+// --------------------------------------------------------------------------
+BLEConnectedServiceInfo* LockConnectedService(const BLERegistrySnapshot& snapshot, const BLEUtils::Uuid& addressGUID, const BLEUtils::Uuid& serviceGUID, std::unique_lock<std::mutex>& lock)
+{
+	auto cservice = snapshot.FindConnectedService(addressGUID, serviceGUID);
+	if (cservice != nullptr)
+	{
+		lock = std::unique_lock<std::mutex>{ cservice->subscriptionMutex };
+		if (cservice->disconnected)
+		{
+			lock.unlock();
+			cservice = nullptr;
+		}
+	}
+	return cservice;
+}
+
+// --------------------------------------------------------------------------
+// Subscribe to a characteristic changing values!
+// --------------------------------------------------------------------------
+void subscribeCharacteristic(const char* address, const char* service, const char* characteristic)
+{
+	if (address == nullptr)
+	{
+		SendError("Null address");
+		return;
+	}
+
+	if (service == nullptr)
+	{
+		SendError("Null service");
+		return;
+	}
+
+	if (characteristic == nullptr)
+	{
+		SendError("Null characteristic");
+		return;
+	}
+
+	DebugLog(std::string("_winBluetoothLESubscribeCharacteristic: ").append(address).append(", ").append(service).append(", ").append(characteristic));
+
+	// Find connected service handle
+	auto addressGUID = BLEUtils::StringToUuid(address);
+	auto serviceGUID = BLEUtils::StringToUuid(service);
+	// The GATT I/O is done under the service's lock, the snapshot keeps the service around
+	auto snapshot = registry.Read();
+	std::unique_lock<std::mutex> subscriptionLock;
+	auto cservice = LockConnectedService(*snapshot, addressGUID, serviceGUID, subscriptionLock);
+	if (cservice != nullptr)
+	{
+		// Find characteristic!
+		auto characteristicGUID = BLEUtils::StringToUuid(characteristic);
+		auto gattCharacteristic = cservice->FindCharacteristic(characteristicGUID);
+		if (gattCharacteristic != nullptr)
+		{
+			if (cservice->subscriptions.find(characteristicGUID) != cservice->subscriptions.end())
+			{
+				SendError(std::string("Already subscribed to characteristic ").append(characteristic));
+			}
+			else if (gattCharacteristic->IsNotifiable)
+			{
+				if (registerSubscriptions(cservice, addressGUID, { { characteristicGUID, gattCharacteristic, nullptr } }) > 0)
+				{
+					// Send message
+					std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
+					registerCharacteristicMessage.append(address);
+					registerCharacteristicMessage.append("~");
+					registerCharacteristicMessage.append(characteristic);
+					SendBluetoothMessage(registerCharacteristicMessage);
+				}
+			}
+			else
+			{
+				SendError(std::string("Characteristic ").append(characteristic).append(" is not Notifiable."));
+			}
+		}
+		else
+		{
+			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to subscribe to."));
+		}
+	}
+	else
+	{
+		SendError(std::string("Could not find device ").append(address).append(" to subscribe to."));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Subscribes to several characteristics of a service at once, the descriptors are
+// written back to back and a single event is registered for all of them.
+// Sends the same messages as subscribing to each characteristic.
+// --------------------------------------------------------------------------
+void subscribeCharacteristics(const char* address, const char* service, const std::vector<std::string>& characteristics)
+{
+	if (address == nullptr)
+	{
+		SendError("Null address");
+		return;
+	}
+
+	if (service == nullptr)
+	{
+		SendError("Null service");
+		return;
+	}
+
+	DebugLog(std::string("_winBluetoothLESubscribeCharacteristics: ").append(address).append(", ").append(service).append(", ").append(std::to_string(characteristics.size())).append(" characteristics"));
+
+	// Find connected service handle
+	auto addressGUID = BLEUtils::StringToUuid(address);
+	auto serviceGUID = BLEUtils::StringToUuid(service);
+	// The GATT I/O is done under the service's lock, the snapshot keeps the service around
+	auto snapshot = registry.Read();
+	std::unique_lock<std::mutex> subscriptionLock;
+	auto cservice = LockConnectedService(*snapshot, addressGUID, serviceGUID, subscriptionLock);
+	if (cservice == nullptr)
+	{
+		SendError(std::string("Could not find device ").append(address).append(" to subscribe to."));
+		return;
+	}
+
+	// Find characteristics!
+	std::vector<SubscriptionRequest> requests;
+	std::vector<const std::string*> requestNames;
+	for (const auto& characteristic : characteristics)
+	{
+		auto characteristicGUID = BLEUtils::StringToUuid(characteristic);
+		auto gattCharacteristic = cservice->FindCharacteristic(characteristicGUID);
+		if (gattCharacteristic == nullptr)
+		{
+			SendError(std::string("Could not find characteristic ").append(characteristic).append(" to subscribe to."));
+		}
+		else if (cservice->subscriptions.find(characteristicGUID) != cservice->subscriptions.end()
+			|| std::any_of(requests.begin(), requests.end(), [&characteristicGUID](const SubscriptionRequest& r) { return r.characteristicGUID == characteristicGUID; }))
+		{
+			SendError(std::string("Already subscribed to characteristic ").append(characteristic));
+		}
+		else if (!gattCharacteristic->IsNotifiable)
+		{
+			SendError(std::string("Characteristic ").append(characteristic).append(" is not Notifiable."));
+		}
+		else
+		{
+			requests.push_back({ characteristicGUID, gattCharacteristic, nullptr });
+			requestNames.push_back(&characteristic);
+		}
+	}
+
+	if (requests.empty() || registerSubscriptions(cservice, addressGUID, requests) == 0)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < requests.size(); ++i)
+	{
+		if (cservice->subscriptions.find(requests[i].characteristicGUID) != cservice->subscriptions.end())
+		{
+			// Send message
+			std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
+			registerCharacteristicMessage.append(address);
+			registerCharacteristicMessage.append("~");
+			registerCharacteristicMessage.append(*requestNames[i]);
+			SendBluetoothMessage(registerCharacteristicMessage);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+// Unsubscribe! ;)
+// --------------------------------------------------------------------------
+void unsubscribeCharacteristic(const char* address, const char* service, const char* characteristic)
+{
+	if (address == nullptr)
+	{
+		SendError("Null address");
+		return;
+	}
+
+	if (service == nullptr)
+	{
+		SendError("Null service");
+		return;
+	}
+
+	if (characteristic == nullptr)
+	{
+		SendError("Null characteristic");
+		return;
+	}
+
+	DebugLog(std::string("_winBluetoothLEUnSubscribeCharacteristic: ").append(address).append(", ").append(service).append(", ").append(characteristic));
+
+	// Find registered characteristic!
+	auto addressGUID = BLEUtils::StringToUuid(address);
+	auto serviceGUID = BLEUtils::StringToUuid(service);
+	auto characteristicGUID = BLEUtils::StringToUuid(characteristic);
+	BLERegisteredCharacteristicInfo* charInfo = nullptr;
+	// The GATT I/O is done under the service's lock, the snapshot keeps the service around
+	auto snapshot = registry.Read();
+	std::unique_lock<std::mutex> subscriptionLock;
+	auto cservice = LockConnectedService(*snapshot, addressGUID, serviceGUID, subscriptionLock);
+	if (cservice != nullptr)
+	{
+		auto charIt = cservice->subscriptions.find(characteristicGUID);
+		if (charIt != cservice->subscriptions.end())
+		{
+			charInfo = charIt->second;
+		}
+	}
+
+	if (charInfo != nullptr)
+	{
+		// The characteristics registered along with this one move to an event of their own first
+		std::vector<BLERegisteredCharacteristicInfo*> siblings;
+		for (const auto& subscription : cservice->subscriptions)
+		{
+			if (subscription.second != charInfo && subscription.second->characteristicHandle == charInfo->characteristicHandle)
+			{
+				siblings.push_back(subscription.second);
+			}
+		}
+		if (!siblings.empty() && !registerNotificationEvent(cservice, addressGUID, siblings))
+		{
+			return;
+		}
+
+		// Unregister
+		HRESULT hr = BluetoothGATTUnregisterEvent(charInfo->characteristicHandle, BLUETOOTH_GATT_FLAG_NONE);
+		if (hr != S_OK && !siblings.empty())
+		{
+			// Keep the siblings on the old event, which is still registered
+			BluetoothGATTUnregisterEvent(siblings[0]->characteristicHandle, BLUETOOTH_GATT_FLAG_NONE);
+			subscriptionTable.Release(siblings[0]->context);
+			for (auto sibling : siblings)
+			{
+				sibling->characteristicHandle = charInfo->characteristicHandle;
+				sibling->context = charInfo->context;
+			}
+		}
+
+		if (hr == S_OK)
+		{
+			// Clean up
+			subscriptionTable.Release(charInfo->context);
+			cservice->subscriptions.erase(characteristicGUID);
+			registry.Delete(charInfo);
+
+			// Send message
+			std::string registerCharacteristicMessage = "DidUpdateNotificationStateForCharacteristic~";
+			registerCharacteristicMessage.append(address);
+			registerCharacteristicMessage.append("~");
+			registerCharacteristicMessage.append(characteristic);
+			SendBluetoothMessage(registerCharacteristicMessage);
+		}
+		else
+		{
+			_com_error err(hr);
+			SendError(std::string("Could not unregister from characteristic event").append(address).append(" ").append(BLEUtils::ToNarrow(err.ErrorMessage())));
+		}
+	}
+	else
+	{
+		SendError(std::string("Could not find notification registration data for characteristic ").append(characteristic));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Reconnects to a device and restores the subscriptions it had when it was last
+// disconnected, in one go. The GATT table and descriptors known from the previous
+// session aren't discovered again, and instead of the usual messages this sends
+// ResumedPeripheral~<address>~<active subscription count> once done.
+// --------------------------------------------------------------------------
+void resumePeripheral(const char* address)
+{
+	if (address == nullptr)
+	{
+		SendError(std::string("Can't resume Null device address"));
+		return;
+	}
+
+	DebugLog(std::string("_winBluetoothLEResumePeripheral: ").append(address));
+
+	auto addressGUID = BLEUtils::StringToUuid(address);
+	DeviceSession session;
+	{
+		const std::lock_guard<std::mutex> lock{ sessionMutex };
+		auto sessionIt = deviceSessions.find(addressGUID);
+		if (sessionIt != deviceSessions.end())
+		{
+			session = sessionIt->second;
+		}
+	}
+
+	// Service handles, skips what is still connected
+	if (!connectToPeripheral(address, false))
+	{
+		return;
+	}
+
+	// The subscriptions are restored service by service, with one event per service,
+	// each under the service's lock
+	size_t activeCount = 0;
+	{
+		std::vector<std::pair<BLEUtils::Uuid, std::vector<const DeviceSession::Subscription*>>> serviceSubscriptions;
+		for (const auto& subscription : session.subscriptions)
+		{
+			auto subscriptionsIt = std::find_if(serviceSubscriptions.begin(), serviceSubscriptions.end(),
+				[&subscription](const std::pair<BLEUtils::Uuid, std::vector<const DeviceSession::Subscription*>>& s) { return s.first == subscription.service; });
+			if (subscriptionsIt == serviceSubscriptions.end())
+			{
+				serviceSubscriptions.emplace_back(subscription.service, std::vector<const DeviceSession::Subscription*>());
+				subscriptionsIt = serviceSubscriptions.end() - 1;
+			}
+			subscriptionsIt->second.push_back(&subscription);
+		}
+
+		for (const auto& subscriptions : serviceSubscriptions)
+		{
+			// One snapshot per service, so that reclamation isn't held back while the device answers
+			auto snapshot = registry.Read();
+			std::unique_lock<std::mutex> subscriptionLock;
+			auto cservice = LockConnectedService(*snapshot, addressGUID, subscriptions.first, subscriptionLock);
+			std::vector<SubscriptionRequest> requests;
+			for (auto subscription : subscriptions.second)
+			{
+				auto gattCharacteristic = cservice != nullptr ? cservice->FindCharacteristic(subscription->characteristic) : nullptr;
+				if (gattCharacteristic == nullptr)
+				{
+					SendError(std::string("Could not find characteristic ").append(BLEUtils::UuidToBTHLEString(subscription->characteristic)).append(" to resume its subscription."));
+				}
+				else if (cservice->subscriptions.find(subscription->characteristic) != cservice->subscriptions.end())
+				{
+					++activeCount;
+				}
+				else
+				{
+					requests.push_back({ subscription->characteristic, gattCharacteristic, &subscription->clientConfig });
+				}
+			}
+
+			if (!requests.empty())
+			{
+				activeCount += registerSubscriptions(cservice, addressGUID, requests);
+			}
+		}
+	}
+
+	std::string resumedMessage = "ResumedPeripheral~";
+	resumedMessage.append(address);
+	resumedMessage.append("~");
+	resumedMessage.append(std::to_string(activeCount));
+	SendBluetoothMessage(resumedMessage);
+}
+
+// --------------------------------------------------------------------------
+// Clean up
+// --------------------------------------------------------------------------
+void disconnectAll()
+{
+	DebugLog("_winBluetoothLEDisconnectAll");
+
+	// Grab the device ids first, disconnecting edits the registry
+	std::vector<BLEUtils::Uuid> deviceIds;
+	{
+		auto snapshot = registry.Read();
+		deviceIds.reserve(snapshot->devices.size());
+		for (auto device : snapshot->devices)
+		{
+			deviceIds.push_back(device->containerId);
+		}
+	}
+
+	// Disconnect from devices if needed!
+	for (const auto& deviceId : deviceIds)
+	{
+		if (DisconnectServicesForDevice(deviceId))
+		{
+			// Notify that we disconnected to a service!
+			std::string connectedMessage = "DisconnectedPeripheral~";
+			connectedMessage.append(BLEUtils::UuidToString(deviceId));
+			SendBluetoothMessage(connectedMessage);
+		}
+	}
+
+	flushGattCache();
+
+	auto writer = registry.Write();
+	auto& snapshot = writer.Edit();
+	for (auto device : snapshot.devices)
+	{
+		writer.Retire(device);
+	}
+	snapshot.devices.clear();
+	snapshot.devicesById.clear();
+}
+
+// --------------------------------------------------------------------------
+// Copy of a string argument that outlives the call, a null pointer stays null
+// --------------------------------------------------------------------------
+class CommandString
+{
+public:
+	CommandString(const char* s) : _isNull(s == nullptr), _value(s != nullptr ? s : "") {}
+	const char* get() const { return _isNull ? nullptr : _value.c_str(); }
+
+private:
+	bool _isNull;
+	std::string _value;
+};
+
+// --------------------------------------------------------------------------
+// Queues the command on the device strand. It sends CommandCompleted~<id> when done,
+// or CommandFailed~<id>~<error> with the first error it sent, or when it is dropped
+// without running because the queue was stopped. Returns the request id.
+// --------------------------------------------------------------------------
+int queueCommand(const CommandString& device, std::function<void()> command)
+{
+	// Strands are keyed by the parsed address, so that any spelling of it lands on the same one
+	auto strand = device.get() != nullptr ? BLEUtils::Uuid::Parse(device.get()) : BLEUtils::Uuid();
+	return commandQueue.Enqueue(strand, [command](int requestId)
+		{
+			CommandStatus status{ false, std::string() };
+			currentCommand = &status;
+			command();
+			currentCommand = nullptr;
+
+			std::string message = status.failed ? "CommandFailed~" : "CommandCompleted~";
+			message.append(std::to_string(requestId));
+			if (status.failed)
+			{
+				message.append("~");
+				message.append(status.error);
+			}
+			SendBluetoothMessage(message);
+		},
+		[](int requestId)
+		{
+			SendBluetoothMessage(std::string("CommandFailed~").append(std::to_string(requestId)).append("~Cancelled, the command queue was stopped"));
+		});
+}
+
+// --------------------------------------------------------------------------
+// Runs the command right away, or queues it with queueCommand() in async mode.
+// Returns the request id, 0 if the command already ran.
+// --------------------------------------------------------------------------
+int runCommand(const CommandString& device, std::function<void()> command)
+{
+	if (!asyncCommands.load())
+	{
+		command();
+		return 0;
+	}
+	return queueCommand(device, std::move(command));
+}
+
+int _winBluetoothLEConnectToPeripheral(const char* address)
+{
+	CommandString addressArg(address);
+	return runCommand(addressArg, [addressArg]() { connectToPeripheral(addressArg.get()); });
+}
+
+// --------------------------------------------------------------------------
+// Devices being connected in async mode. Each device is connected by a command
+// on its own strand, at most connectConcurrency of them are queued at a time
+// and each one queues the next device once done.
+// --------------------------------------------------------------------------
+struct ConnectBatch
+{
+	std::vector<std::string> addresses;
+	std::atomic<size_t> nextAddress;
+	std::atomic<size_t> remainingCount;
+	std::atomic<size_t> failedCount;
+};
+
+// Returns the request id of the queued command, 0 if all the devices were queued already
+int queueNextConnect(std::shared_ptr<ConnectBatch> batch)
+{
+	size_t index = batch->nextAddress.fetch_add(1);
+	if (index >= batch->addresses.size())
+	{
+		return 0;
+	}
+
+	return runCommand(CommandString(batch->addresses[index].c_str()), [batch, index]()
+		{
+			if (!connectAndReport(batch->addresses[index]))
+			{
+				batch->failedCount.fetch_add(1);
+			}
+			queueNextConnect(batch);
+
+			// The last device to be done reports for the whole batch
+			if (--batch->remainingCount == 0)
+			{
+				reportConnectFailures(batch->failedCount.load(), batch->addresses.size());
+			}
+		});
+}
+
+// --------------------------------------------------------------------------
+// In async mode, each device is connected by a command on its own strand, and the devices
+// past connectConcurrency are only queued as others are done: wait for a device's
+// ConnectSucceeded message before queuing other commands for it. Returns the id of the
+// first device's command.
+// --------------------------------------------------------------------------
+int _winBluetoothLEConnectToPeripherals(const char** addresses, int count)
+{
+	std::vector<std::string> addressArgs;
+	if (addresses != nullptr)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (addresses[i] != nullptr)
+			{
+				addressArgs.emplace_back(addresses[i]);
+			}
+			else
+			{
+				SendError(std::string("Can't connect to Null device address"));
+			}
+		}
+	}
+	if (!asyncCommands.load())
+	{
+		connectToPeripherals(addressArgs);
+		return 0;
+	}
+
+	DebugLog(std::string("_winBluetoothLEConnectToPeripherals: ").append(std::to_string(addressArgs.size())).append(" devices"));
+
+	auto batch = std::make_shared<ConnectBatch>();
+	batch->addresses = std::move(addressArgs);
+	batch->nextAddress = 0;
+	batch->remainingCount = batch->addresses.size();
+	batch->failedCount = 0;
+	int firstRequestId = 0;
+	for (int i = 0; i < connectConcurrency.load(); ++i)
+	{
+		int requestId = queueNextConnect(batch);
+		firstRequestId = firstRequestId != 0 ? firstRequestId : requestId;
+	}
+	return firstRequestId;
+}
+
+// --------------------------------------------------------------------------
+// Maximum number of devices _winBluetoothLEConnectToPeripherals() opens at the same time
+// --------------------------------------------------------------------------
+void _winBluetoothLESetConnectConcurrency(int count)
+{
+	connectConcurrency.store(std::max(count, 1));
+}
+
+int _winBluetoothLEResumePeripheral(const char* address)
+{
+	CommandString addressArg(address);
+	return runCommand(addressArg, [addressArg]() { resumePeripheral(addressArg.get()); });
+}
+
+int _winBluetoothLEDisconnectPeripheral(const char* address)
+{
+	CommandString addressArg(address);
+	return runCommand(addressArg, [addressArg]() { disconnectPeripheral(addressArg.get()); });
+}
+
+int _winBluetoothLEReadCharacteristic(const char* address, const char* service, const char* characteristic)
+{
+	return _winBluetoothLEReadCharacteristicWithMode(address, service, characteristic, BLEReadDefault);
+}
+
+int _winBluetoothLEReadCharacteristicWithMode(const char* address, const char* service, const char* characteristic, int mode)
+{
+	CommandString addressArg(address), serviceArg(service), characteristicArg(characteristic);
+	return runCommand(addressArg, [addressArg, serviceArg, characteristicArg, mode]()
+		{
+			readCharacteristic(addressArg.get(), serviceArg.get(), characteristicArg.get(), mode);
+		});
+}
+
+int _winBluetoothLEStartPolling(const char* address, const char* service, const char* characteristic, int intervalMilliseconds)
+{
+	if (address == nullptr || service == nullptr || characteristic == nullptr)
+	{
+		SendError("Null address, service or characteristic to poll");
+		return 0;
+	}
+
+	if (intervalMilliseconds <= 0)
+	{
+		SendError(std::string("Invalid poll interval ").append(std::to_string(intervalMilliseconds)));
+		return 0;
+	}
+
+	auto target = std::make_shared<PollTarget>();
+	target->address = address;
+	target->characteristic = characteristic;
+	target->key = { BLEUtils::Uuid::Parse(address), BLEUtils::Uuid::Parse(service), BLEUtils::Uuid::Parse(characteristic), BLEReadFromDevice };
+	target->inFlight = false;
+	target->hasValue = false;
+
+	pollScheduler.Start(pollCharacteristic);
+
+	// Registered under the lock so that the first poll finds it
+	const std::lock_guard<std::mutex> lock{ pollMutex };
+	int pollId = pollScheduler.Add(target->key.device, std::chrono::milliseconds(intervalMilliseconds));
+	pollTargets.emplace(pollId, std::move(target));
+	return pollId;
+}
+
+void _winBluetoothLEStopPolling(int pollId)
+{
+	pollScheduler.Remove(pollId);
+
+	const std::lock_guard<std::mutex> lock{ pollMutex };
+	pollTargets.erase(pollId);
+}
+
+void _winBluetoothLESetPollRateCap(int pollsPerSecond)
+{
+	pollScheduler.SetDeviceRateCap(pollsPerSecond);
+}
+
+void _winBluetoothLESetReadFreshness(int milliseconds)
+{
+	readCoalescer.SetFreshness(std::chrono::milliseconds(std::max(milliseconds, 0)));
+}
+
+// --------------------------------------------------------------------------
+// The arguments are only copied when the write is queued, synchronous writes use them as is
+// --------------------------------------------------------------------------
+int _winBluetoothLEWriteCharacteristic(const char* address, const char* service, const char* characteristic, const unsigned char* data, int length, bool withResponse)
+{
+	if (!asyncCommands.load())
+	{
+		writeCharacteristic(address, service, characteristic, data, length, withResponse);
+		return 0;
+	}
+
+	CommandString addressArg(address), serviceArg(service), characteristicArg(characteristic);
+	std::vector<unsigned char> dataArg;
+	if (data != nullptr && length > 0)
+	{
+		dataArg.assign(data, data + length);
+	}
+	bool nullData = data == nullptr;
+	return runCommand(addressArg, [addressArg, serviceArg, characteristicArg, dataArg, nullData, length, withResponse]()
+		{
+			writeCharacteristic(addressArg.get(), serviceArg.get(), characteristicArg.get(), nullData ? nullptr : dataArg.data(), length, withResponse);
+		});
+}
+
+// --------------------------------------------------------------------------
+// A chunk size or ack interval of 0 picks the default. The data is copied once,
+// chunks are written from that copy.
+// A transfer takes seconds, so it is always queued on the device strand, even when
+// commands aren't async: returns its request id, or 0 if the arguments are invalid.
+// --------------------------------------------------------------------------
+int _winBluetoothLEWriteCharacteristicBulk(const char* address, const char* service, const char* characteristic, const unsigned char* data, int length, int chunkSize, int ackInterval)
+{
+	if (length < 0)
+	{
+		SendError(std::string("Invalid bulk write length ").append(std::to_string(length)));
+		return 0;
+	}
+
+	CommandString addressArg(address), serviceArg(service), characteristicArg(characteristic);
+	auto dataArg = std::make_shared<std::vector<unsigned char>>();
+	if (data != nullptr && length > 0)
+	{
+		dataArg->assign(data, data + length);
+	}
+	bool nullData = data == nullptr;
+	chunkSize = chunkSize != 0 ? chunkSize : defaultBulkChunkSize;
+	ackInterval = ackInterval > 0 ? ackInterval : defaultBulkAckInterval;
+	return queueCommand(addressArg, [addressArg, serviceArg, characteristicArg, dataArg, nullData, chunkSize, ackInterval]()
+		{
+			writeCharacteristicBulk(addressArg.get(), serviceArg.get(), characteristicArg.get(), nullData ? nullptr : dataArg->data(), dataArg->size(), chunkSize, ackInterval);
+		});
+}
+
+// --------------------------------------------------------------------------
+// Statuses has one entry per request, it's filled before returning unless commands are async.
+// In that case, the requests are copied and queued on the strand of their device, with one
+// command per device. Once all of them are done, the statuses are sent in the order of the
+// requests with DidWriteCharacteristics~<status>,<status>,... Returns the id of the first
+// device's command.
+// --------------------------------------------------------------------------
+int _winBluetoothLEWriteCharacteristics(const BLEWriteRequest* requests, int count, int* statuses)
+{
+	if (requests == nullptr || count <= 0)
+	{
+		return 0;
+	}
+
+	if (!asyncCommands.load())
+	{
+		std::vector<int> ignoredStatuses;
+		if (statuses == nullptr)
+		{
+			ignoredStatuses.resize(count);
+			statuses = ignoredStatuses.data();
+		}
+		writeCharacteristics(requests, count, statuses);
+		return 0;
+	}
+
+	// Copy of the requests, pointing to our own copy of the strings and values
+	struct Batch
+	{
+		std::vector<std::string> strings;
+		std::vector<unsigned char> data;
+		std::vector<int> statuses;
+		std::atomic<size_t> pendingDevices;
+	};
+	auto batch = std::make_shared<Batch>();
+	size_t dataSize = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		dataSize += std::max(requests[i].length, 0);
+	}
+	batch->data.resize(dataSize);
+	batch->strings.reserve(3 * count); // No reallocation, requests point to the strings
+	batch->statuses.resize(count);
+
+	// The requests of each device, in order, along with their index in the batch
+	struct DeviceRequests
+	{
+		BLEUtils::Uuid device;
+		CommandString address;
+		std::vector<BLEWriteRequest> requests;
+		std::vector<int> indices;
+	};
+	std::vector<DeviceRequests> devices;
+	size_t dataOffset = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		BLEWriteRequest request = requests[i];
+		for (const char** s : { &request.address, &request.service, &request.characteristic })
+		{
+			if (*s != nullptr)
+			{
+				batch->strings.emplace_back(*s);
+				*s = batch->strings.back().c_str();
+			}
+		}
+		if (request.data != nullptr && request.length > 0)
+		{
+			memcpy(batch->data.data() + dataOffset, request.data, request.length);
+			request.data = batch->data.data() + dataOffset;
+			dataOffset += request.length;
+		}
+
+		auto device = request.address != nullptr ? BLEUtils::Uuid::Parse(request.address) : BLEUtils::Uuid();
+		auto deviceIt = std::find_if(devices.begin(), devices.end(), [&device](const DeviceRequests& d) { return d.device == device; });
+		if (deviceIt == devices.end())
+		{
+			devices.push_back({ device, CommandString(request.address), {}, {} });
+			deviceIt = devices.end() - 1;
+		}
+		deviceIt->requests.push_back(request);
+		deviceIt->indices.push_back(i);
+	}
+
+	batch->pendingDevices = devices.size();
+	int firstRequestId = 0;
+	for (auto& deviceRequests : devices)
+	{
+		auto shared = std::make_shared<DeviceRequests>(std::move(deviceRequests));
+		int requestId = runCommand(shared->address, [batch, shared]()
+			{
+				std::vector<int> deviceStatuses(shared->requests.size());
+				writeCharacteristics(shared->requests.data(), (int)shared->requests.size(), deviceStatuses.data());
+				for (size_t i = 0; i < deviceStatuses.size(); ++i)
+				{
+					batch->statuses[shared->indices[i]] = deviceStatuses[i];
+				}
+
+				// The last device to be done reports for the whole batch
+				if (--batch->pendingDevices == 0)
+				{
+					std::string message = "DidWriteCharacteristics~";
+					for (size_t i = 0; i < batch->statuses.size(); ++i)
+					{
+						if (i > 0)
+						{
+							message.append(",");
+						}
+						message.append(std::to_string(batch->statuses[i]));
+					}
+					SendBluetoothMessage(message);
+				}
+			});
+		firstRequestId = firstRequestId != 0 ? firstRequestId : requestId;
+	}
+	return firstRequestId;
+}
+
+int _winBluetoothLESubscribeCharacteristic(const char* address, const char* service, const char* characteristic)
+{
+	CommandString addressArg(address), serviceArg(service), characteristicArg(characteristic);
+	return runCommand(addressArg, [addressArg, serviceArg, characteristicArg]()
+		{
+			subscribeCharacteristic(addressArg.get(), serviceArg.get(), characteristicArg.get());
+		});
+}
+
+int _winBluetoothLESubscribeCharacteristics(const char* address, const char* service, const char** characteristics, int count)
+{
+	CommandString addressArg(address), serviceArg(service);
+	std::vector<std::string> characteristicArgs;
+	if (characteristics != nullptr)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (characteristics[i] != nullptr)
+			{
+				characteristicArgs.push_back(characteristics[i]);
+			}
+		}
+	}
+	return runCommand(addressArg, [addressArg, serviceArg, characteristicArgs]()
+		{
+			subscribeCharacteristics(addressArg.get(), serviceArg.get(), characteristicArgs);
+		});
+}
+
+int _winBluetoothLEUnSubscribeCharacteristic(const char* address, const char* service, const char* characteristic)
+{
+	CommandString addressArg(address), serviceArg(service), characteristicArg(characteristic);
+	return runCommand(addressArg, [addressArg, serviceArg, characteristicArg]()
+		{
+			unsubscribeCharacteristic(addressArg.get(), serviceArg.get(), characteristicArg.get());
+		});
+}
+
+int _winBluetoothLEDisconnectAll()
+{
+	// Not tied to a device, commands for other devices may run alongside it
+	return runCommand(CommandString(nullptr), []() { disconnectAll(); });
+}
+
+// --------------------------------------------------------------------------
+// Switches between running GATT operations on the caller's thread and queuing them,
+// bulk writes are always queued
+// --------------------------------------------------------------------------
+void _winBluetoothLESetAsyncCommands(bool enabled)
+{
+	asyncCommands.store(enabled);
+}
+
+// --------------------------------------------------------------------------
+// Scheduling of the command threads, priority is one of the THREAD_PRIORITY_* values
+// and an affinity mask of 0 lets them run on any core
+// --------------------------------------------------------------------------
+void _winBluetoothLESetCommandThreadPriority(int priority)
+{
+	commandQueue.SetPriority(priority);
+}
+
+void _winBluetoothLESetCommandThreadAffinity(std::uint64_t affinityMask)
+{
+	commandQueue.SetAffinity(affinityMask);
+}
+
+// --------------------------------------------------------------------------
+// Number of command threads, applied right away
+// --------------------------------------------------------------------------
+void _winBluetoothLESetCommandThreadCount(int count)
+{
+	commandQueue.SetWorkerCount((size_t)std::max(count, 1));
+}
+
+// --------------------------------------------------------------------------
+// Sets the file where the GATT tables of the devices are cached and loads it,
+// so reconnecting skips the discovery. Null or empty disables the cache.
+// --------------------------------------------------------------------------
+void _winBluetoothLESetGattCachePath(const char* path)
+{
+	// What was learnt with the previous file is kept in it
+	flushGattCache();
+	if (path == nullptr || *path == 0)
+	{
+		gattCache.Close();
+	}
+	else if (gattCache.Open(BLEUtils::ToWide(path)))
+	{
+		DebugLog(std::string("Loaded GATT cache ").append(path));
+	}
+	else
+	{
+		DebugLog(std::string("No usable GATT cache in ").append(path).append(", it will be created"));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Memory taken by the devices, services and connections entries, along with
+// the names, characteristics and value buffers they own
+// --------------------------------------------------------------------------
+std::int64_t _winBluetoothLEGetRegistryBytesInUse()
+{
+	return static_cast<std::int64_t>(registry.BytesInUse());
+}
+
+// --------------------------------------------------------------------------
+// Memory held by the registry pools, including free entries
+// --------------------------------------------------------------------------
+std::int64_t _winBluetoothLEGetRegistryBytesReserved()
+{
+	return static_cast<std::int64_t>(registry.BytesReserved());
 }
 
 
@@ -1426,8 +3452,9 @@ BOOL WINAPI DllMain(_In_ HINSTANCE hinstDLL, _In_ DWORD fdwReason, _In_ LPVOID l
 		LogToFile("DLL_PROCESS_ATTACH");
 		break;
 	case DLL_PROCESS_DETACH:
+		// No clean up here, it joins threads which can't be done under the loader lock.
+		// _winBluetoothLEDeInitialize() must be called before unloading, UnityPluginUnload() does.
 		LogToFile("DLL_PROCESS_DETACH");
-		_winBluetoothLEDeInitialize();
 		break;
 	case DLL_THREAD_ATTACH:
 		LogToFile("DLL_THREAD_ATTACH");
@@ -9,6 +9,25 @@ using thread_id_t = std::uint32_t;
 typedef void(*DebugCallback)(timestamp_us_t timestamp, thread_id_t threadId, const char* message);
 typedef void(*SendBluetoothMessageCallback)(const char* message);
 
+// One write of _winBluetoothLEWriteCharacteristics(), laid out for marshalling
+struct BLEWriteRequest
+{
+    const char* address;
+    const char* service;
+    const char* characteristic;
+    const unsigned char* data;
+    int length;
+    int withResponse; // Non zero to wait for the device to acknowledge, 4 bytes like the default marshalling of a C# bool
+};
+
+// Where _winBluetoothLEReadCharacteristicWithMode() gets the value from
+enum BLEReadMode
+{
+    BLEReadDefault = 0,     // Let Windows decide, as _winBluetoothLEReadCharacteristic() does
+    BLEReadFromDevice = 1,  // Always ask the device
+    BLEReadFromCache = 2,   // The value Windows last got, fast but only suited to values that don't change
+};
+
 extern "C"
 {
     void UNITY_INTERFACE_EXPORT _winBluetoothLEConnectCallbacks(SendBluetoothMessageCallback sendMessageMethod, DebugCallback callbackMethod, DebugCallback warningMethod, DebugCallback errorMethod);
@@ -21,13 +40,36 @@ extern "C"
     void UNITY_INTERFACE_EXPORT _winBluetoothLEScanForPeripheralsWithServices(const char* serviceUUIDsString);
     void UNITY_INTERFACE_EXPORT _winBluetoothLERetrieveListOfPeripheralsWithServices(const char* serviceUUIDsString);
     void UNITY_INTERFACE_EXPORT _winBluetoothLEStopScan();
-    void UNITY_INTERFACE_EXPORT _winBluetoothLEConnectToPeripheral(const char* name);
-    void UNITY_INTERFACE_EXPORT _winBluetoothLEDisconnectPeripheral(const char* name);
-    void UNITY_INTERFACE_EXPORT _winBluetoothLEReadCharacteristic(const char* name, const char* service, const char* characteristic);
-    void UNITY_INTERFACE_EXPORT _winBluetoothLEWriteCharacteristic(const char* name, const char* service, const char* characteristic, const unsigned char* data, int length, bool withResponse);
-    void UNITY_INTERFACE_EXPORT _winBluetoothLESubscribeCharacteristic(const char* name, const char* service, const char* characteristic);
-    void UNITY_INTERFACE_EXPORT _winBluetoothLEUnSubscribeCharacteristic(const char* name, const char* service, const char* characteristic);
-    void UNITY_INTERFACE_EXPORT _winBluetoothLEDisconnectAll();
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetScanInterval(int milliseconds);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLERegisterServiceFilter(const char* serviceUUIDsString);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLEUnregisterServiceFilter(int filterId);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLEScanForPeripheralsWithFilter(int filterId);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLERetrieveListOfPeripheralsWithFilter(int filterId);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEConnectToPeripheral(const char* name);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEConnectToPeripherals(const char** names, int count);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetConnectConcurrency(int count);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetGattCachePath(const char* path);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEResumePeripheral(const char* name);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEDisconnectPeripheral(const char* name);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEReadCharacteristic(const char* name, const char* service, const char* characteristic);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEReadCharacteristicWithMode(const char* name, const char* service, const char* characteristic, int mode);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetReadFreshness(int milliseconds);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEStartPolling(const char* name, const char* service, const char* characteristic, int intervalMilliseconds);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLEStopPolling(int pollId);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetPollRateCap(int pollsPerSecond);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEWriteCharacteristic(const char* name, const char* service, const char* characteristic, const unsigned char* data, int length, bool withResponse);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEWriteCharacteristics(const BLEWriteRequest* requests, int count, int* statuses);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEWriteCharacteristicBulk(const char* name, const char* service, const char* characteristic, const unsigned char* data, int length, int chunkSize, int ackInterval);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLESubscribeCharacteristic(const char* name, const char* service, const char* characteristic);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLESubscribeCharacteristics(const char* name, const char* service, const char** characteristics, int count);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEUnSubscribeCharacteristic(const char* name, const char* service, const char* characteristic);
+    int UNITY_INTERFACE_EXPORT _winBluetoothLEDisconnectAll();
+    std::int64_t UNITY_INTERFACE_EXPORT _winBluetoothLEGetRegistryBytesInUse();
+    std::int64_t UNITY_INTERFACE_EXPORT _winBluetoothLEGetRegistryBytesReserved();
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetAsyncCommands(bool enabled);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetCommandThreadPriority(int priority);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetCommandThreadAffinity(std::uint64_t affinityMask);
+    void UNITY_INTERFACE_EXPORT _winBluetoothLESetCommandThreadCount(int count);
     void UNITY_INTERFACE_EXPORT _winBluetoothLEUpdate();
 
 
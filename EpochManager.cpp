@@ -0,0 +1,104 @@
+#include "stdafx.h"
+#include "EpochManager.h"
+
+#include <algorithm>	// std::min
+#include <thread>		// std::this_thread
+
+BLEEpochManager::BLEEpochManager()
+	: _epoch{ 1 }
+{
+	for (auto& slot : _slots)
+	{
+		slot.epoch = 0;
+		slot.taken = false;
+	}
+}
+
+BLEEpochManager::~BLEEpochManager()
+{
+	for (auto& retired : _retired)
+	{
+		retired.second();
+	}
+}
+
+BLEEpochManager::Guard BLEEpochManager::Enter()
+{
+	// Start looking at a slot that depends on the thread, so readers don't fight for the same one
+	size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % MaxReaders;
+	for (;;)
+	{
+		for (size_t i = 0; i < MaxReaders; ++i)
+		{
+			size_t index = (start + i) % MaxReaders;
+			auto& slot = _slots[index];
+			bool expected = false;
+			if (!slot.taken.load(std::memory_order_relaxed) && slot.taken.compare_exchange_strong(expected, true))
+			{
+				// Sequentially consistent so the shared data we load next can't be older than this epoch
+				slot.epoch.store(_epoch.load());
+				return Guard(this, index);
+			}
+		}
+		std::this_thread::yield();
+	}
+}
+
+BLEEpochManager::Guard::Guard(Guard&& other)
+	: _manager(other._manager)
+	, _slot(other._slot)
+{
+	other._manager = nullptr;
+}
+
+BLEEpochManager::Guard::~Guard()
+{
+	if (_manager != nullptr)
+	{
+		auto& slot = _manager->_slots[_slot];
+		slot.epoch.store(0);
+		slot.taken.store(false, std::memory_order_release);
+	}
+}
+
+void BLEEpochManager::Retire(std::function<void()> deleter)
+{
+	// Readers that entered from now on can't see what was retired
+	_retired.emplace_back(_epoch.fetch_add(1), std::move(deleter));
+}
+
+void BLEEpochManager::Collect()
+{
+	if (_retired.empty())
+	{
+		return;
+	}
+
+	std::uint64_t oldestReader = UINT64_MAX;
+	for (auto& slot : _slots)
+	{
+		std::uint64_t epoch = slot.epoch.load();
+		if (epoch != 0)
+		{
+			oldestReader = std::min(oldestReader, epoch);
+		}
+	}
+
+	// Retired entries are in epoch order
+	auto it = _retired.begin();
+	for (; it != _retired.end() && it->first < oldestReader; ++it)
+	{
+		it->second();
+	}
+	_retired.erase(_retired.begin(), it);
+}
+
+void BLEEpochManager::WaitForReadersAndCollect()
+{
+	Collect();
+	while (!_retired.empty())
+	{
+		std::this_thread::yield();
+		Collect();
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// --------------------------------------------------------------------------
+// Epoch based reclamation, so that readers can use shared data without locks.
+//
+// Readers announce the epoch at which they started reading in one of a fixed
+// set of slots. Writers retire what they replaced with the current epoch, and
+// it gets freed once every active reader started after that epoch.
+// --------------------------------------------------------------------------
+class BLEEpochManager
+{
+public:
+	// Maximum number of readers at any given time, more readers wait for a slot
+	static const size_t MaxReaders = 64;
+
+	class Guard
+	{
+	public:
+		Guard(Guard&& other);
+		~Guard();
+
+		Guard(const Guard&) = delete;
+		Guard& operator=(const Guard&) = delete;
+
+	private:
+		friend class BLEEpochManager;
+		Guard(BLEEpochManager* manager, size_t slot) : _manager(manager), _slot(slot) {}
+
+		BLEEpochManager* _manager;
+		size_t _slot;
+	};
+
+	BLEEpochManager();
+	~BLEEpochManager();
+
+	// Starts reading, shared data loaded while the guard is alive won't be freed
+	Guard Enter();
+
+	// Writer side, must only be called by one thread at a time
+	void Retire(std::function<void()> deleter);
+	void Collect();
+	void WaitForReadersAndCollect();
+
+private:
+	struct alignas(64) ReaderSlot
+	{
+		std::atomic<std::uint64_t> epoch; // 0 when not in use
+		std::atomic<bool> taken;
+	};
+
+	std::atomic<std::uint64_t> _epoch;
+	std::array<ReaderSlot, MaxReaders> _slots;
+	std::vector<std::pair<std::uint64_t, std::function<void()>>> _retired;
+};
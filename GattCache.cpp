@@ -0,0 +1,525 @@
+#include "stdafx.h"
+#include "GattCache.h"
+
+#include <algorithm>	// std::sort, std::find_if
+
+static const size_t HeaderSize = 16;
+static const size_t TableHeaderSize = 32;
+
+// --------------------------------------------------------------------------
+// Little endian encoding of the cache file fields
+// --------------------------------------------------------------------------
+static void Put(std::vector<std::uint8_t>& out, std::uint64_t value, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; ++i)
+	{
+		out.push_back((std::uint8_t)(value >> (8 * i)));
+	}
+}
+
+static void PutUuid(std::vector<std::uint8_t>& out, const BLEUtils::Uuid& uuid)
+{
+	Put(out, uuid.hi, 8);
+	Put(out, uuid.lo, 8);
+}
+
+static void Patch(std::vector<std::uint8_t>& out, size_t offset, std::uint64_t value, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; ++i)
+	{
+		out[offset + i] = (std::uint8_t)(value >> (8 * i));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Bounds checked decoding, reads fail once the end of the data is reached
+// --------------------------------------------------------------------------
+class CacheReader
+{
+public:
+	CacheReader(const std::uint8_t* data, size_t size) : _data(data), _size(size), _offset(0), _ok(true) {}
+
+	std::uint64_t Get(size_t bytes)
+	{
+		if (!_ok || _size - _offset < bytes)
+		{
+			_ok = false;
+			return 0;
+		}
+		std::uint64_t value = 0;
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			value |= (std::uint64_t)_data[_offset + i] << (8 * i);
+		}
+		_offset += bytes;
+		return value;
+	}
+
+	BLEUtils::Uuid GetUuid()
+	{
+		std::uint64_t hi = Get(8);
+		return BLEUtils::Uuid(hi, Get(8));
+	}
+
+	bool Ok() const { return _ok; }
+	size_t Offset() const { return _offset; }
+
+private:
+	const std::uint8_t* _data;
+	size_t _size;
+	size_t _offset;
+	bool _ok;
+};
+
+// --------------------------------------------------------------------------
+// 32-bit FNV-1a, detects truncated or corrupted files
+// --------------------------------------------------------------------------
+static std::uint32_t Checksum(const std::uint8_t* data, size_t size)
+{
+	std::uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static std::uint8_t PropertyBits(const BTH_LE_GATT_CHARACTERISTIC& c)
+{
+	return (std::uint8_t)((c.IsBroadcastable ? 0x01 : 0) | (c.IsReadable ? 0x02 : 0) | (c.IsWritable ? 0x04 : 0) | (c.IsWritableWithoutResponse ? 0x08 : 0)
+		| (c.IsSignedWritable ? 0x10 : 0) | (c.IsNotifiable ? 0x20 : 0) | (c.IsIndicatable ? 0x40 : 0) | (c.HasExtendedProperties ? 0x80 : 0));
+}
+
+static void EncodeTable(std::vector<std::uint8_t>& out, const BLEUtils::Uuid& containerId, std::uint64_t fingerprint, const std::vector<BLEGattCache::Service>& services)
+{
+	size_t start = out.size();
+	PutUuid(out, containerId);
+	Put(out, fingerprint, 8);
+	Put(out, 0, 4); // Size, patched below
+	Put(out, services.size(), 2);
+	Put(out, 0, 2);
+	for (const auto& service : services)
+	{
+		PutUuid(out, BLEUtils::ToUuid(service.gattService.ServiceUuid));
+		Put(out, service.gattService.AttributeHandle, 2);
+		Put(out, service.characteristics.size(), 2);
+		for (size_t i = 0; i < service.characteristics.size(); ++i)
+		{
+			const auto& characteristic = service.characteristics[i];
+			const auto* descriptors = i < service.descriptors.size() ? &service.descriptors[i] : nullptr;
+			PutUuid(out, BLEUtils::ToUuid(characteristic.CharacteristicUuid));
+			Put(out, characteristic.AttributeHandle, 2);
+			Put(out, characteristic.CharacteristicValueHandle, 2);
+			Put(out, PropertyBits(characteristic), 1);
+			Put(out, descriptors != nullptr ? descriptors->size() : 0, 1);
+			if (descriptors != nullptr)
+			{
+				for (const auto& descriptor : *descriptors)
+				{
+					PutUuid(out, BLEUtils::ToUuid(descriptor.DescriptorUuid));
+					Put(out, descriptor.AttributeHandle, 2);
+					Put(out, (std::uint16_t)descriptor.DescriptorType, 2);
+				}
+			}
+		}
+	}
+	Patch(out, start + 24, out.size() - start, 4);
+}
+
+BLEGattCache::BLEGattCache()
+	: _file(INVALID_HANDLE_VALUE)
+	, _mapping(NULL)
+	, _data(nullptr)
+	, _size(0)
+	, _dirty(false)
+{
+}
+
+BLEGattCache::~BLEGattCache()
+{
+	Close();
+}
+
+std::uint64_t BLEGattCache::Fingerprint(std::vector<BLEUtils::Uuid> serviceIds)
+{
+	std::sort(serviceIds.begin(), serviceIds.end());
+
+	// 64-bit FNV-1a over the sorted ids
+	std::uint64_t hash = 14695981039346656037ull;
+	for (const auto& id : serviceIds)
+	{
+		for (std::uint64_t word : { id.hi, id.lo })
+		{
+			for (int i = 0; i < 8; ++i)
+			{
+				hash = (hash ^ ((word >> (8 * i)) & 0xFF)) * 1099511628211ull;
+			}
+		}
+	}
+	return hash;
+}
+
+bool BLEGattCache::SameLayout(const Service& a, const Service& b)
+{
+	if (BLEUtils::ToUuid(a.gattService.ServiceUuid) != BLEUtils::ToUuid(b.gattService.ServiceUuid)
+		|| a.gattService.AttributeHandle != b.gattService.AttributeHandle
+		|| a.characteristics.size() != b.characteristics.size())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < a.characteristics.size(); ++i)
+	{
+		const auto& ca = a.characteristics[i];
+		const auto& cb = b.characteristics[i];
+		if (BLEUtils::ToUuid(ca.CharacteristicUuid) != BLEUtils::ToUuid(cb.CharacteristicUuid)
+			|| ca.AttributeHandle != cb.AttributeHandle
+			|| ca.CharacteristicValueHandle != cb.CharacteristicValueHandle
+			|| PropertyBits(ca) != PropertyBits(cb))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BLEGattCache::Open(const std::wstring& path)
+{
+	Close();
+
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_path = path;
+
+	_file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER fileSize;
+	if (_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &fileSize) || fileSize.QuadPart < (LONGLONG)HeaderSize)
+	{
+		Unmap();
+		return false;
+	}
+
+	_mapping = CreateFileMapping(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	const void* view = _mapping != NULL ? MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (view == nullptr || !Index((const std::uint8_t*)view, (size_t)fileSize.QuadPart))
+	{
+		if (view != nullptr)
+		{
+			UnmapViewOfFile(view);
+		}
+		Unmap();
+		return false;
+	}
+	return true;
+}
+
+void BLEGattCache::Close()
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	Unmap();
+	_buffer.clear();
+	_path.clear();
+	_storedTables.clear();
+	_removedTables.clear();
+	_dirty = false;
+}
+
+bool BLEGattCache::IsOpen() const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return !_path.empty();
+}
+
+bool BLEGattCache::Find(const BLEUtils::Uuid& containerId, std::uint64_t fingerprint, const BLEUtils::Uuid& serviceId, Service& out) const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+
+	Table decoded;
+	const Table* table = nullptr;
+	auto storedIt = _storedTables.find(containerId);
+	if (storedIt != _storedTables.end())
+	{
+		table = &storedIt->second;
+	}
+	else if (Decode(containerId, decoded))
+	{
+		table = &decoded;
+	}
+
+	if (table == nullptr || table->fingerprint != fingerprint)
+	{
+		return false;
+	}
+
+	auto serviceIt = std::find_if(table->services.begin(), table->services.end(),
+		[&serviceId](const Service& s) { return BLEUtils::ToUuid(s.gattService.ServiceUuid) == serviceId; });
+	if (serviceIt == table->services.end())
+	{
+		return false;
+	}
+	out = *serviceIt;
+	return true;
+}
+
+void BLEGattCache::Store(const BLEUtils::Uuid& containerId, std::uint64_t fingerprint, const Service& service)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+
+	// Start from what the file has, unless it was already changed
+	auto storedIt = _storedTables.find(containerId);
+	if (storedIt == _storedTables.end())
+	{
+		Table table;
+		if (!Decode(containerId, table))
+		{
+			table = Table{ fingerprint, {} };
+		}
+		storedIt = _storedTables.emplace(containerId, std::move(table)).first;
+	}
+
+	auto& table = storedIt->second;
+	if (table.fingerprint != fingerprint)
+	{
+		// The device's services changed, the other entries are outdated
+		table.fingerprint = fingerprint;
+		table.services.clear();
+	}
+
+	auto serviceId = BLEUtils::ToUuid(service.gattService.ServiceUuid);
+	auto serviceIt = std::find_if(table.services.begin(), table.services.end(),
+		[&serviceId](const Service& s) { return BLEUtils::ToUuid(s.gattService.ServiceUuid) == serviceId; });
+	if (serviceIt != table.services.end())
+	{
+		*serviceIt = service;
+	}
+	else
+	{
+		table.services.push_back(service);
+	}
+	_removedTables.erase(containerId);
+	_dirty = true;
+}
+
+void BLEGattCache::Invalidate(const BLEUtils::Uuid& containerId)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	if (_storedTables.erase(containerId) > 0)
+	{
+		_dirty = true;
+	}
+	if (_mappedTables.find(containerId) != _mappedTables.end())
+	{
+		_removedTables.insert(containerId);
+		_dirty = true;
+	}
+}
+
+bool BLEGattCache::Flush()
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	if (!_dirty || _path.empty())
+	{
+		return true;
+	}
+
+	std::vector<std::uint8_t> contents;
+	Encode(contents);
+
+	// Written next to the file and moved over it, so a crash never leaves a partial file
+	std::wstring tempPath = _path + L".tmp";
+	HANDLE file = CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	DWORD written = 0;
+	bool ok = WriteFile(file, contents.data(), (DWORD)contents.size(), &written, NULL) && written == contents.size();
+	CloseHandle(file);
+	if (!ok)
+	{
+		DeleteFile(tempPath.c_str());
+		return false;
+	}
+
+	// The mapped file can't be replaced, from now on the tables are read from the new contents in memory
+	Unmap();
+	ok = MoveFileEx(tempPath.c_str(), _path.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+	_buffer = std::move(contents);
+	Index(_buffer.data(), _buffer.size());
+	_dirty = !ok;
+	return ok;
+}
+
+bool BLEGattCache::Attach(const std::uint8_t* data, size_t size)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return Index(data, size);
+}
+
+void BLEGattCache::Serialize(std::vector<std::uint8_t>& out) const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	Encode(out);
+}
+
+void BLEGattCache::Unmap()
+{
+	if (_data != nullptr && _mapping != NULL)
+	{
+		UnmapViewOfFile(_data);
+	}
+	if (_mapping != NULL)
+	{
+		CloseHandle(_mapping);
+		_mapping = NULL;
+	}
+	if (_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+	}
+	_data = nullptr;
+	_size = 0;
+	_mappedTables.clear();
+}
+
+// --------------------------------------------------------------------------
+// Checks the header and notes where each table starts, the tables themselves
+// are only decoded when looked up. Pending changes are dropped.
+// --------------------------------------------------------------------------
+bool BLEGattCache::Index(const std::uint8_t* data, size_t size)
+{
+	_mappedTables.clear();
+	_storedTables.clear();
+	_removedTables.clear();
+	_data = nullptr;
+	_size = 0;
+
+	CacheReader reader(data, size);
+	if (reader.Get(4) != Magic || reader.Get(2) != Version)
+	{
+		return false;
+	}
+	reader.Get(2);
+	size_t tableCount = (size_t)reader.Get(4);
+	std::uint32_t checksum = (std::uint32_t)reader.Get(4);
+	if (!reader.Ok() || Checksum(data + HeaderSize, size - HeaderSize) != checksum)
+	{
+		return false;
+	}
+
+	size_t offset = HeaderSize;
+	for (size_t i = 0; i < tableCount; ++i)
+	{
+		CacheReader table(data + offset, size - offset);
+		auto containerId = table.GetUuid();
+		table.Get(8);
+		size_t tableSize = (size_t)table.Get(4);
+		if (!table.Ok() || tableSize < TableHeaderSize || tableSize > size - offset)
+		{
+			_mappedTables.clear();
+			return false;
+		}
+		_mappedTables[containerId] = offset;
+		offset += tableSize;
+	}
+
+	_data = data;
+	_size = size;
+	return true;
+}
+
+bool BLEGattCache::Decode(const BLEUtils::Uuid& containerId, Table& out) const
+{
+	if (_removedTables.count(containerId) > 0)
+	{
+		return false;
+	}
+	auto it = _mappedTables.find(containerId);
+	if (it == _mappedTables.end())
+	{
+		return false;
+	}
+
+	CacheReader reader(_data + it->second, _size - it->second);
+	reader.GetUuid();
+	out.fingerprint = reader.Get(8);
+	size_t tableSize = (size_t)reader.Get(4);
+	size_t serviceCount = (size_t)reader.Get(2);
+	reader.Get(2);
+	out.services.resize(serviceCount);
+	for (auto& service : out.services)
+	{
+		service.gattService.ServiceUuid = BLEUtils::UuidToBTHLEUUID(reader.GetUuid());
+		service.gattService.AttributeHandle = (USHORT)reader.Get(2);
+		size_t characteristicCount = (size_t)reader.Get(2);
+		if (!reader.Ok())
+		{
+			return false;
+		}
+		service.characteristics.resize(characteristicCount);
+		service.descriptors.resize(characteristicCount);
+		for (size_t i = 0; i < characteristicCount; ++i)
+		{
+			auto& characteristic = service.characteristics[i];
+			characteristic.ServiceHandle = service.gattService.AttributeHandle;
+			characteristic.CharacteristicUuid = BLEUtils::UuidToBTHLEUUID(reader.GetUuid());
+			characteristic.AttributeHandle = (USHORT)reader.Get(2);
+			characteristic.CharacteristicValueHandle = (USHORT)reader.Get(2);
+			std::uint8_t bits = (std::uint8_t)reader.Get(1);
+			characteristic.IsBroadcastable = (bits & 0x01) != 0;
+			characteristic.IsReadable = (bits & 0x02) != 0;
+			characteristic.IsWritable = (bits & 0x04) != 0;
+			characteristic.IsWritableWithoutResponse = (bits & 0x08) != 0;
+			characteristic.IsSignedWritable = (bits & 0x10) != 0;
+			characteristic.IsNotifiable = (bits & 0x20) != 0;
+			characteristic.IsIndicatable = (bits & 0x40) != 0;
+			characteristic.HasExtendedProperties = (bits & 0x80) != 0;
+
+			size_t descriptorCount = (size_t)reader.Get(1);
+			if (!reader.Ok())
+			{
+				return false;
+			}
+			service.descriptors[i].resize(descriptorCount);
+			for (auto& descriptor : service.descriptors[i])
+			{
+				descriptor.ServiceHandle = service.gattService.AttributeHandle;
+				descriptor.CharacteristicHandle = characteristic.AttributeHandle;
+				descriptor.DescriptorUuid = BLEUtils::UuidToBTHLEUUID(reader.GetUuid());
+				descriptor.AttributeHandle = (USHORT)reader.Get(2);
+				descriptor.DescriptorType = (BTH_LE_GATT_DESCRIPTOR_TYPE)reader.Get(2);
+			}
+		}
+	}
+	return reader.Ok() && reader.Offset() == tableSize;
+}
+
+void BLEGattCache::Encode(std::vector<std::uint8_t>& out) const
+{
+	out.clear();
+	Put(out, Magic, 4);
+	Put(out, Version, 2);
+	Put(out, 0, 2);
+	Put(out, 0, 4); // Table count and checksum, patched below
+	Put(out, 0, 4);
+
+	// Tables from the file that didn't change are copied as is
+	size_t tableCount = 0;
+	for (const auto& mapped : _mappedTables)
+	{
+		if (_storedTables.count(mapped.first) == 0 && _removedTables.count(mapped.first) == 0)
+		{
+			CacheReader reader(_data + mapped.second + 24, 4);
+			size_t tableSize = (size_t)reader.Get(4);
+			out.insert(out.end(), _data + mapped.second, _data + mapped.second + tableSize);
+			++tableCount;
+		}
+	}
+	for (const auto& stored : _storedTables)
+	{
+		EncodeTable(out, stored.first, stored.second.fingerprint, stored.second.services);
+		++tableCount;
+	}
+
+	Patch(out, 8, tableCount, 4);
+	Patch(out, 12, Checksum(out.data() + HeaderSize, out.size() - HeaderSize), 4);
+}
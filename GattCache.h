@@ -0,0 +1,113 @@
+#pragma once
+
+#include <windows.h>
+#include <bthdef.h>
+#include <bluetoothleapis.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Utils.h"
+
+// --------------------------------------------------------------------------
+// On-disk cache of the GATT tables of the devices we connected to, so that
+// reconnecting can skip service and characteristic discovery.
+//
+// A device's table is keyed by its container id and a fingerprint of the
+// services Windows lists for it, a firmware that adds or removes services
+// therefore misses the cache. The file is memory-mapped when opened and
+// tables are decoded from the mapping on lookup. Changes are kept in memory
+// until Flush() rewrites the file.
+//
+// File format, little endian, version 1:
+//   header:         u32 magic 'BGTC', u16 version, u16 reserved, u32 table count, u32 FNV-1a of the rest of the file
+//   table:          uuid container id, u64 fingerprint, u32 byte size (including this header), u16 service count, u16 reserved
+//   service:        uuid, u16 attribute handle, u16 characteristic count
+//   characteristic: uuid, u16 attribute handle, u16 value handle, u8 property bits, u8 descriptor count
+//   descriptor:     uuid, u16 attribute handle, u16 descriptor type
+// UUIDs are 16 bytes, high word first. Service handles are implied by the parents.
+// --------------------------------------------------------------------------
+class BLEGattCache
+{
+public:
+	static const std::uint32_t Magic = 0x43544742; // "BGTC"
+	static const std::uint16_t Version = 1;
+
+	struct Service
+	{
+		BTH_LE_GATT_SERVICE gattService;
+		std::vector<BTH_LE_GATT_CHARACTERISTIC> characteristics;
+		std::vector<std::vector<BTH_LE_GATT_DESCRIPTOR>> descriptors; // Per characteristic, empty if not discovered
+	};
+
+	BLEGattCache();
+	~BLEGattCache();
+
+	BLEGattCache(const BLEGattCache&) = delete;
+	BLEGattCache& operator=(const BLEGattCache&) = delete;
+
+	// Order independent hash of the ids of a device's services
+	static std::uint64_t Fingerprint(std::vector<BLEUtils::Uuid> serviceIds);
+
+	// Whether two versions of a service have the same attributes
+	static bool SameLayout(const Service& a, const Service& b);
+
+	// Maps the cache file, an invalid or outdated file is ignored and replaced on the next flush.
+	// Returns false if there was no usable file.
+	bool Open(const std::wstring& path);
+
+	// Forgets the file and all the tables, pending changes are lost
+	void Close();
+
+	bool IsOpen() const;
+
+	// Copies the cached service into out, returns false on a miss
+	bool Find(const BLEUtils::Uuid& containerId, std::uint64_t fingerprint, const BLEUtils::Uuid& serviceId, Service& out) const;
+
+	// Adds or replaces a service, the device's other services are dropped if the fingerprint changed
+	void Store(const BLEUtils::Uuid& containerId, std::uint64_t fingerprint, const Service& service);
+
+	// Drops the device's table
+	void Invalidate(const BLEUtils::Uuid& containerId);
+
+	// Writes the file if anything changed, replacing the mapped one. Returns false on error.
+	bool Flush();
+
+	// The binary format, separate from the file so it can be checked on its own.
+	// Attach() doesn't copy the data, which must remain valid until detached or closed.
+	bool Attach(const std::uint8_t* data, size_t size);
+	void Serialize(std::vector<std::uint8_t>& out) const;
+
+private:
+	struct Table
+	{
+		std::uint64_t fingerprint;
+		std::vector<Service> services;
+	};
+
+	// Must be called with _mutex held
+	void Unmap();
+	bool Index(const std::uint8_t* data, size_t size);
+	bool Decode(const BLEUtils::Uuid& containerId, Table& out) const;
+	void Encode(std::vector<std::uint8_t>& out) const;
+
+	mutable std::mutex _mutex;
+	std::wstring _path;
+
+	// The mapped file, or the contents last flushed, and where each device's table starts in it
+	HANDLE _file;
+	HANDLE _mapping;
+	std::vector<std::uint8_t> _buffer;
+	const std::uint8_t* _data;
+	size_t _size;
+	std::unordered_map<BLEUtils::Uuid, size_t> _mappedTables;
+
+	// Changed since the file was mapped
+	std::unordered_map<BLEUtils::Uuid, Table> _storedTables;
+	std::unordered_set<BLEUtils::Uuid> _removedTables;
+	bool _dirty;
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// --------------------------------------------------------------------------
+// Pool of objects allocated in contiguous chunks.
+//
+// Objects never move once created, freed slots are reused before a new chunk
+// is allocated, and chunks are only given back to the system by Reset(), so
+// repeated scan / connect cycles run in constant memory.
+// Thread safe, the lock is only held while taking or giving back a slot.
+// --------------------------------------------------------------------------
+template <typename T, size_t ChunkSize = 64>
+class BLEObjectPool
+{
+public:
+	BLEObjectPool() : _free(nullptr), _inUse(0) {}
+	~BLEObjectPool() { Reset(); }
+
+	BLEObjectPool(const BLEObjectPool&) = delete;
+	BLEObjectPool& operator=(const BLEObjectPool&) = delete;
+
+	template <typename... Args>
+	T* New(Args&&... args)
+	{
+		Slot* slot;
+		{
+			const std::lock_guard<std::mutex> lock{ _mutex };
+			if (_free == nullptr)
+			{
+				AddChunk();
+			}
+			slot = _free;
+			_free = slot->next;
+			++_inUse;
+		}
+		return new (slot->storage) T(std::forward<Args>(args)...);
+	}
+
+	void Delete(T* object)
+	{
+		if (object != nullptr)
+		{
+			object->~T();
+			auto slot = reinterpret_cast<Slot*>(object);
+			const std::lock_guard<std::mutex> lock{ _mutex };
+			slot->next = _free;
+			_free = slot;
+			--_inUse;
+		}
+	}
+
+	// Gives all the chunks back, only possible once every object was deleted
+	bool Reset()
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		if (_inUse > 0)
+		{
+			return false;
+		}
+		_chunks.clear();
+		_free = nullptr;
+		return true;
+	}
+
+	size_t Count() const
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		return _inUse;
+	}
+
+	size_t BytesInUse() const { return Count() * sizeof(Slot); }
+
+	size_t BytesReserved() const
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		return _chunks.size() * ChunkSize * sizeof(Slot);
+	}
+
+private:
+	union Slot
+	{
+		Slot* next;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	void AddChunk()
+	{
+		std::unique_ptr<Slot[]> chunk(new Slot[ChunkSize]);
+		for (size_t i = 0; i < ChunkSize; ++i)
+		{
+			chunk[i].next = i + 1 < ChunkSize ? &chunk[i + 1] : _free;
+		}
+		_free = &chunk[0];
+		_chunks.push_back(std::move(chunk));
+	}
+
+	mutable std::mutex _mutex;
+	std::vector<std::unique_ptr<Slot[]>> _chunks;
+	Slot* _free;
+	size_t _inUse;
+};
@@ -0,0 +1,222 @@
+#include "stdafx.h"
+#include "PollScheduler.h"
+
+#include <algorithm>	// std::max
+
+BLEPollScheduler::BLEPollScheduler()
+	: _stopRequested(false)
+	, _start(std::chrono::steady_clock::now())
+	, _processedTick(0)
+	, _slots(SlotCount)
+	, _nextPollId(1)
+	, _rateCap(10)
+	, _random(std::random_device()())
+{
+}
+
+BLEPollScheduler::~BLEPollScheduler()
+{
+	Stop();
+}
+
+void BLEPollScheduler::Start(Poll poll)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	if (_worker.joinable())
+	{
+		return;
+	}
+
+	_poll = std::move(poll);
+	_stopRequested = false;
+	_worker = std::thread(&BLEPollScheduler::Run, this);
+}
+
+void BLEPollScheduler::Stop()
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_stopRequested = true;
+	}
+	_wakeUp.notify_all();
+
+	if (_worker.joinable())
+	{
+		_worker.join();
+	}
+}
+
+bool BLEPollScheduler::IsRunning() const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return _worker.joinable() && !_stopRequested;
+}
+
+int BLEPollScheduler::Add(const BLEUtils::Uuid& device, std::chrono::milliseconds interval)
+{
+	int pollId;
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		pollId = _nextPollId++;
+		std::int64_t intervalTicks = std::max<std::int64_t>(interval.count() / TickMilliseconds, 1);
+		_entries[pollId] = Entry{ device, intervalTicks, 0 };
+		++_devices[device].polls;
+
+		// Start at a random phase of the interval
+		std::uniform_int_distribution<std::int64_t> phase(1, intervalTicks);
+		Schedule(pollId, CurrentTick() + phase(_random));
+	}
+
+	// The worker may be waiting for a later tick, or for any poll at all
+	_wakeUp.notify_all();
+	return pollId;
+}
+
+bool BLEPollScheduler::Remove(int pollId)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	auto it = _entries.find(pollId);
+	if (it == _entries.end())
+	{
+		return false;
+	}
+
+	// The pair left in the wheel is skipped when its slot comes up
+	auto budget = _devices.find(it->second.device);
+	if (--budget->second.polls == 0)
+	{
+		_devices.erase(budget);
+	}
+	_entries.erase(it);
+	return true;
+}
+
+void BLEPollScheduler::Clear()
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_entries.clear();
+	_devices.clear();
+	for (auto& slot : _slots)
+	{
+		slot.clear();
+	}
+}
+
+size_t BLEPollScheduler::Count() const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return _entries.size();
+}
+
+void BLEPollScheduler::SetDeviceRateCap(int pollsPerSecond)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_rateCap = std::max(pollsPerSecond, 0);
+}
+
+std::int64_t BLEPollScheduler::CurrentTick() const
+{
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start);
+	return elapsed.count() / TickMilliseconds;
+}
+
+void BLEPollScheduler::Schedule(int pollId, std::int64_t dueTick)
+{
+	_entries[pollId].dueTick = dueTick;
+	_slots[dueTick % SlotCount].emplace_back(pollId, dueTick);
+}
+
+std::int64_t BLEPollScheduler::Jitter(std::int64_t intervalTicks)
+{
+	// Up to a tenth of the interval either way, which averages out over the periods
+	std::int64_t range = intervalTicks / 10;
+	if (range == 0)
+	{
+		return intervalTicks;
+	}
+	std::uniform_int_distribution<std::int64_t> offset(-range, range);
+	return std::max<std::int64_t>(intervalTicks + offset(_random), 1);
+}
+
+void BLEPollScheduler::Run()
+{
+	std::vector<int> duePolls;
+	std::unique_lock<std::mutex> lock{ _mutex };
+	while (!_stopRequested)
+	{
+		// After a long wait, one turn of the wheel is enough to find every late poll
+		std::int64_t now = CurrentTick();
+		_processedTick = std::max<std::int64_t>(_processedTick, now - (std::int64_t)SlotCount);
+
+		std::int64_t ticksPerPoll = _rateCap > 0 ? (1000 / TickMilliseconds + _rateCap - 1) / _rateCap : 0;
+		while (_processedTick < now)
+		{
+			++_processedTick;
+			auto& slot = _slots[_processedTick % SlotCount];
+			for (size_t i = 0; i < slot.size();)
+			{
+				int pollId = slot[i].first;
+				std::int64_t dueTick = slot[i].second;
+				auto it = _entries.find(pollId);
+				bool stale = it == _entries.end() || it->second.dueTick != dueTick;
+				if (!stale && dueTick > _processedTick)
+				{
+					// Due on a later turn
+					++i;
+					continue;
+				}
+
+				slot[i] = slot.back();
+				slot.pop_back();
+				if (stale)
+				{
+					continue;
+				}
+
+				// Over the device rate cap, try again when it allows another poll
+				auto& entry = it->second;
+				auto& budget = _devices[entry.device];
+				if (budget.nextTick > _processedTick)
+				{
+					Schedule(pollId, budget.nextTick);
+					continue;
+				}
+				budget.nextTick = _processedTick + ticksPerPoll;
+
+				duePolls.push_back(pollId);
+				Schedule(pollId, _processedTick + Jitter(entry.intervalTicks));
+			}
+		}
+
+		if (!duePolls.empty())
+		{
+			lock.unlock();
+			for (int pollId : duePolls)
+			{
+				_poll(pollId);
+			}
+			duePolls.clear();
+			lock.lock();
+			continue;
+		}
+
+		// Sleep until the next tick that has polls in its slot
+		std::int64_t nextTick = -1;
+		for (std::int64_t tick = _processedTick + 1; tick <= _processedTick + (std::int64_t)SlotCount; ++tick)
+		{
+			if (!_slots[tick % SlotCount].empty())
+			{
+				nextTick = tick;
+				break;
+			}
+		}
+		if (nextTick < 0)
+		{
+			_wakeUp.wait(lock);
+		}
+		else
+		{
+			_wakeUp.wait_until(lock, _start + std::chrono::milliseconds(nextTick * TickMilliseconds));
+		}
+	}
+}
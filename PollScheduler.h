@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Utils.h"
+
+// --------------------------------------------------------------------------
+// Calls a function on a worker thread for each registered poll, at the rate
+// the poll was registered with. The function is expected to hand the actual
+// read over to another thread and return right away.
+//
+// Polls are kept in a hashed timer wheel: each slot lists the polls due on
+// the ticks that map to it, so a tick only looks at one slot whatever the
+// number of polls. Every period is offset by a random jitter, and the first
+// one starts at a random phase, so polls registered together don't fire
+// together. Polls of a device are also limited to a maximum rate, a poll
+// over the limit is postponed until the device has room for it.
+// Start() and Stop() are meant to be called from a single thread.
+// --------------------------------------------------------------------------
+class BLEPollScheduler
+{
+public:
+	typedef std::function<void(int pollId)> Poll;
+
+	static const int TickMilliseconds = 10;
+	static const size_t SlotCount = 512;
+
+	BLEPollScheduler();
+	~BLEPollScheduler();
+
+	BLEPollScheduler(const BLEPollScheduler&) = delete;
+	BLEPollScheduler& operator=(const BLEPollScheduler&) = delete;
+
+	// Starts the worker if it isn't running, the function is used until stopped
+	void Start(Poll poll);
+
+	// Waits for the worker to exit, the polls are kept
+	void Stop();
+
+	bool IsRunning() const;
+
+	// Returns the new poll id, non zero
+	int Add(const BLEUtils::Uuid& device, std::chrono::milliseconds interval);
+	bool Remove(int pollId);
+	void Clear();
+	size_t Count() const;
+
+	// Maximum polls per second for any single device, 0 for no limit
+	void SetDeviceRateCap(int pollsPerSecond);
+
+private:
+	struct Entry
+	{
+		BLEUtils::Uuid device;
+		std::int64_t intervalTicks;
+		std::int64_t dueTick;
+	};
+
+	struct DeviceBudget
+	{
+		int polls;				// Polls of the device on the entries
+		std::int64_t nextTick;	// First tick the device may be polled again under the rate cap
+	};
+
+	void Run();
+
+	// Must be called with _mutex held
+	std::int64_t CurrentTick() const;
+	void Schedule(int pollId, std::int64_t dueTick);
+	std::int64_t Jitter(std::int64_t intervalTicks);
+
+	mutable std::mutex _mutex;
+	std::condition_variable _wakeUp;
+	std::thread _worker;
+	Poll _poll;
+	bool _stopRequested;
+
+	std::chrono::steady_clock::time_point _start;
+	std::int64_t _processedTick; // Last tick whose slot was processed
+	std::vector<std::vector<std::pair<int, std::int64_t>>> _slots; // Poll id and due tick, stale pairs are skipped
+	std::unordered_map<int, Entry> _entries;
+	std::unordered_map<BLEUtils::Uuid, DeviceBudget> _devices;
+	int _nextPollId;
+	int _rateCap;
+	std::minstd_rand _random;
+};
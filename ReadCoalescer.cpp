@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "ReadCoalescer.h"
+
+#include <algorithm>	// std::find
+#include <iterator>	// std::next
+
+BLEReadCoalescer::BLEReadCoalescer()
+	: _lastTicket(0)
+	, _freshness(0)
+{
+}
+
+bool BLEReadCoalescer::Join(const BLEReadKey& key, Result& out)
+{
+	std::unique_lock<std::mutex> lock{ _mutex };
+	std::uint64_t ticket = ++_lastTicket;
+	auto it = _entries.find(key);
+	while (it != _entries.end() && it->second.reading)
+	{
+		_readCompleted.wait(lock);
+		it = _entries.find(key);
+	}
+
+	if (it == _entries.end())
+	{
+		it = _entries.emplace(key, Entry{ false, false, false, 0, 0, 0, {}, { false, {}, {} } }).first;
+		if (std::find(_modes.begin(), _modes.end(), key.mode) == _modes.end())
+		{
+			_modes.push_back(key.mode);
+		}
+	}
+
+	auto& entry = it->second;
+	if (entry.hasResult)
+	{
+		bool answered = entry.answeredTicket >= ticket;
+		bool fresh = entry.fresh && entry.result.succeeded && _freshness.count() > 0
+			&& std::chrono::steady_clock::now() - entry.readTime <= _freshness;
+		if (answered || fresh)
+		{
+			out = entry.result;
+			return true;
+		}
+	}
+
+	entry.reading = true;
+	entry.readTicket = _lastTicket;
+	return false;
+}
+
+void BLEReadCoalescer::Complete(const BLEReadKey& key, const Result& result)
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		auto it = _entries.find(key);
+		if (it != _entries.end())
+		{
+			auto& entry = it->second;
+
+			// A write issued while reading may or may not be in the value, which then
+			// only answers the reads requested before the write
+			bool writtenWhileReading = entry.writeTicket > entry.readTicket;
+			entry.reading = false;
+			entry.hasResult = true;
+			entry.fresh = !writtenWhileReading;
+			entry.answeredTicket = writtenWhileReading ? entry.writeTicket - 1 : _lastTicket;
+			entry.readTime = std::chrono::steady_clock::now();
+			entry.result.succeeded = result.succeeded;
+			entry.result.value.assign(result.value.begin(), result.value.end());
+			entry.result.error = result.error;
+		}
+	}
+	_readCompleted.notify_all();
+}
+
+void BLEReadCoalescer::Invalidate(const BLEReadKey& key)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	std::uint64_t ticket = 0;
+	for (int mode : _modes)
+	{
+		auto it = _entries.find({ key.device, key.service, key.characteristic, mode });
+		if (it != _entries.end())
+		{
+			if (ticket == 0)
+			{
+				ticket = ++_lastTicket;
+			}
+			it->second.hasResult = false;
+			it->second.writeTicket = ticket;
+		}
+	}
+}
+
+void BLEReadCoalescer::Forget(const BLEUtils::Uuid& device)
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		for (auto it = _entries.begin(); it != _entries.end();)
+		{
+			it = it->first.device == device ? _entries.erase(it) : std::next(it);
+		}
+	}
+	_readCompleted.notify_all();
+}
+
+void BLEReadCoalescer::Clear()
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_entries.clear();
+	}
+	_readCompleted.notify_all();
+}
+
+void BLEReadCoalescer::SetFreshness(std::chrono::milliseconds freshness)
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	_freshness = freshness;
+}
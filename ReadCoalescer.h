@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Utils.h"
+
+// Characteristic read, reads of different modes are kept apart
+struct BLEReadKey
+{
+	BLEUtils::Uuid device;
+	BLEUtils::Uuid service;
+	BLEUtils::Uuid characteristic;
+	int mode;
+
+	bool operator==(const BLEReadKey& other) const
+	{
+		return device == other.device && service == other.service && characteristic == other.characteristic && mode == other.mode;
+	}
+};
+
+struct BLEReadKeyHash
+{
+	size_t operator()(const BLEReadKey& key) const
+	{
+		size_t h = key.device.Hash();
+		h ^= key.service.Hash() + 0x9E3779B9 + (h << 6) + (h >> 2);
+		h ^= key.characteristic.Hash() + 0x9E3779B9 + (h << 6) + (h >> 2);
+		return h ^ (size_t)key.mode;
+	}
+};
+
+// --------------------------------------------------------------------------
+// Merges reads of the same characteristic so that reads made while another
+// one is in flight share its result instead of each going to the device.
+//
+// Each read takes a ticket when it runs, a read completing after that answers
+// it. Tickets are taken from a single counter, so comparing a ticket with the
+// last ticket given out when a read completed tells whether the read completed
+// after the request. Optionally, a successful read also answers the reads made
+// within the freshness window that follows it.
+//
+// Writes must call Invalidate() before they are issued: results known at that
+// point, or read while the write is in flight, then only answer the reads
+// requested before the write.
+// --------------------------------------------------------------------------
+class BLEReadCoalescer
+{
+public:
+	struct Result
+	{
+		bool succeeded;
+		std::vector<unsigned char> value;
+		std::string error;
+	};
+
+	BLEReadCoalescer();
+
+	BLEReadCoalescer(const BLEReadCoalescer&) = delete;
+	BLEReadCoalescer& operator=(const BLEReadCoalescer&) = delete;
+
+	// Called when the read runs, takes its ticket. If another thread is reading the characteristic,
+	// waits for it. Returns true and copies the result if that read answers this one, otherwise
+	// the caller must read the value and pass the result to Complete().
+	bool Join(const BLEReadKey& key, Result& out);
+	void Complete(const BLEReadKey& key, const Result& result);
+
+	// Called before writing the characteristic, the key's mode is ignored
+	void Invalidate(const BLEReadKey& key);
+
+	// Drops what is known about the device's characteristics
+	void Forget(const BLEUtils::Uuid& device);
+	void Clear();
+
+	// 0 to only merge reads that overlap
+	void SetFreshness(std::chrono::milliseconds freshness);
+
+private:
+	struct Entry
+	{
+		bool reading;
+		bool hasResult;
+		bool fresh;						// Whether the result may answer reads within the freshness window
+		std::uint64_t answeredTicket;	// Last ticket the result answers
+		std::uint64_t readTicket;		// Last ticket given out when the read in flight started
+		std::uint64_t writeTicket;		// Ticket of the last invalidation
+		std::chrono::steady_clock::time_point readTime;
+		Result result;
+	};
+
+	std::mutex _mutex;
+	std::condition_variable _readCompleted;
+	std::unordered_map<BLEReadKey, Entry, BLEReadKeyHash> _entries;
+	std::vector<int> _modes; // Modes seen so far, for invalidating every mode of a characteristic
+	std::uint64_t _lastTicket;
+	std::chrono::milliseconds _freshness;
+};
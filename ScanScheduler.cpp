@@ -0,0 +1,116 @@
+#include "stdafx.h"
+#include "ScanScheduler.h"
+
+BLEScanScheduler::BLEScanScheduler()
+	: _interval(2000)
+	, _generation(0)
+	, _stopRequested(true)
+	, _shutdownRequested(false)
+{
+}
+
+BLEScanScheduler::~BLEScanScheduler()
+{
+	Shutdown();
+}
+
+void BLEScanScheduler::Start(Scan scan)
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_scan = std::move(scan);
+		++_generation;
+		_stopRequested = false;
+		_shutdownRequested = false;
+		if (!_worker.joinable())
+		{
+			_worker = std::thread(&BLEScanScheduler::Run, this);
+		}
+	}
+	_wakeUp.notify_all();
+}
+
+void BLEScanScheduler::Stop()
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		++_generation;
+		_stopRequested = true;
+	}
+	_wakeUp.notify_all();
+}
+
+void BLEScanScheduler::Shutdown()
+{
+	std::thread worker;
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		++_generation;
+		_stopRequested = true;
+		_shutdownRequested = true;
+		worker = std::move(_worker);
+	}
+	_wakeUp.notify_all();
+
+	if (worker.joinable())
+	{
+		worker.join();
+	}
+}
+
+bool BLEScanScheduler::IsRunning() const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return _worker.joinable() && !_stopRequested;
+}
+
+bool BLEScanScheduler::IsCurrent(std::uint64_t generation) const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return generation == _generation && !_stopRequested;
+}
+
+void BLEScanScheduler::SetInterval(std::chrono::milliseconds interval)
+{
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_interval = interval;
+	}
+	_wakeUp.notify_all();
+}
+
+std::chrono::milliseconds BLEScanScheduler::Interval() const
+{
+	const std::lock_guard<std::mutex> lock{ _mutex };
+	return _interval;
+}
+
+// --------------------------------------------------------------------------
+// Worker loop, the scan function is called without holding the lock.
+// While stopped, the worker waits to be started again or shut down.
+// --------------------------------------------------------------------------
+void BLEScanScheduler::Run()
+{
+	std::unique_lock<std::mutex> lock{ _mutex };
+	while (!_shutdownRequested)
+	{
+		if (_stopRequested)
+		{
+			_wakeUp.wait(lock);
+			continue;
+		}
+
+		auto scan = _scan;
+		auto generation = _generation;
+		lock.unlock();
+		scan(generation);
+		lock.lock();
+
+		// Wait for the next scan, waking up early if stopped, restarted or if the interval changes
+		auto lastScan = std::chrono::steady_clock::now();
+		while (!_stopRequested && generation == _generation && std::chrono::steady_clock::now() < lastScan + _interval)
+		{
+			_wakeUp.wait_until(lock, lastScan + _interval);
+		}
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// --------------------------------------------------------------------------
+// Runs a scan on a worker thread right away, then again at a fixed interval
+// until stopped. The scan itself is whatever function it is given, so this
+// doesn't depend on how devices are enumerated.
+//
+// Starting and stopping don't wait for the scan in progress, which would block
+// the caller for a whole enumeration. Instead, each start or stop begins a new
+// generation, which the scan is given and should check with IsCurrent() before
+// reporting anything, so that a scan that is no longer wanted is dropped.
+// The worker is only joined by Shutdown().
+// Start() and Stop() are meant to be called from a single thread.
+// --------------------------------------------------------------------------
+class BLEScanScheduler
+{
+public:
+	using Scan = std::function<void(std::uint64_t generation)>;
+
+	BLEScanScheduler();
+	~BLEScanScheduler();
+
+	BLEScanScheduler(const BLEScanScheduler&) = delete;
+	BLEScanScheduler& operator=(const BLEScanScheduler&) = delete;
+
+	// Starts scanning, or restarts right away with the new function if already running
+	void Start(Scan scan);
+
+	// Wakes the worker up, returns without waiting for the scan in progress
+	void Stop();
+
+	// Stops and waits for the worker to exit, must not be called from DllMain
+	void Shutdown();
+
+	bool IsRunning() const;
+
+	// Whether the scan of the given generation is still wanted
+	bool IsCurrent(std::uint64_t generation) const;
+
+	// Time between the end of a scan and the start of the next one, takes effect immediately
+	void SetInterval(std::chrono::milliseconds interval);
+	std::chrono::milliseconds Interval() const;
+
+private:
+	void Run();
+
+	mutable std::mutex _mutex;
+	std::condition_variable _wakeUp;
+	std::thread _worker;
+	Scan _scan;
+	std::chrono::milliseconds _interval;
+	std::uint64_t _generation;
+	bool _stopRequested;
+	bool _shutdownRequested;
+};
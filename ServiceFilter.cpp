@@ -0,0 +1,38 @@
+#include "stdafx.h"
+#include <windows.h>
+#include "ServiceFilter.h"
+
+#include <algorithm>	// std::sort, std::unique
+
+BLEServiceFilter BLEServiceFilter::Parse(const char* uuidString)
+{
+	BLEServiceFilter filter;
+	if (uuidString != nullptr)
+	{
+		// Split on '|', skipping empty entries
+		const char* start = uuidString;
+		for (const char* c = uuidString; ; ++c)
+		{
+			if (*c == '|' || *c == '\0')
+			{
+				if (c != start)
+				{
+					auto uuid = BLEUtils::StringToUuid(std::string(start, c));
+					if (!uuid.IsNull())
+					{
+						filter._uuids.push_back(uuid);
+					}
+				}
+				if (*c == '\0')
+				{
+					break;
+				}
+				start = c + 1;
+			}
+		}
+	}
+
+	std::sort(filter._uuids.begin(), filter._uuids.end());
+	filter._uuids.erase(std::unique(filter._uuids.begin(), filter._uuids.end()), filter._uuids.end());
+	return filter;
+}
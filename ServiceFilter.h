@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include "Utils.h"
+
+// --------------------------------------------------------------------------
+// A set of service UUIDs, parsed once and then matched against many services.
+// UUIDs are kept sorted and without duplicates in their canonical form, so that
+// short and long forms of the same id are the same entry. Matching is done by
+// looking each of them up in the registry indices.
+// --------------------------------------------------------------------------
+class BLEServiceFilter
+{
+public:
+	// Parses a '|' separated list of UUID strings
+	static BLEServiceFilter Parse(const char* uuidString);
+
+	bool IsEmpty() const { return _uuids.empty(); }
+	const std::vector<BLEUtils::Uuid>& Uuids() const { return _uuids; }
+
+private:
+	std::vector<BLEUtils::Uuid> _uuids;
+};
@@ -0,0 +1,162 @@
+#include "stdafx.h"
+#include "SetupDiDeviceSource.h"
+#include "DeviceRegistry.h"
+
+#include <devguid.h>
+
+#include <algorithm>	// std::replace
+#include <cwchar>		// wcsnlen
+
+// --------------------------------------------------------------------------
+// Formats the last Windows error
+// --------------------------------------------------------------------------
+static std::string LastErrorMessage()
+{
+	wchar_t buf[256];
+	FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
+	return BLEUtils::ToNarrow(buf);
+}
+
+BLESetupDiDeviceSource::BLESetupDiDeviceSource()
+	: _hardwareIdBuffer(256)
+	, _propertyBuffer(256)
+{
+}
+
+// --------------------------------------------------------------------------
+// Reads a device Property, used to retrieve device name, address, etc...
+// The string is read into buffer, which is reused from one call to the next
+// and only grows. Returns the string length, 0 on error.
+// --------------------------------------------------------------------------
+size_t BLESetupDiDeviceSource::ReadProperty(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDeviceInfoData, DWORD property, std::vector<wchar_t>& buffer, BLEScanResult& result)
+{
+	DWORD regDataType;
+	DWORD requiredSize = 0;
+	while (!SetupDiGetDeviceRegistryProperty(hDevInfo, pDeviceInfoData, property, &regDataType, (PBYTE)buffer.data(), (DWORD)(buffer.size() * sizeof(wchar_t)), &requiredSize))
+	{
+		if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+		{
+			// The required size is in bytes
+			buffer.resize((requiredSize + sizeof(wchar_t) - 1) / sizeof(wchar_t));
+		}
+		else
+		{
+			result.errors.push_back(std::string("Could not read device property ").append(std::to_string(property)).append(": ").append(LastErrorMessage()));
+			return 0;
+		}
+	}
+
+	// Only the first string of multi-strings (i.e. hardware ids)
+	return wcsnlen(buffer.data(), requiredSize / sizeof(wchar_t));
+}
+
+// --------------------------------------------------------------------------
+// Reads a device's instance Id, used to generate the device path and later open handle to it
+// Same as ReadProperty(), returns the length of the id read into buffer, 0 on error.
+// --------------------------------------------------------------------------
+size_t BLESetupDiDeviceSource::ReadDeviceInstanceId(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDeviceInfoData, std::vector<wchar_t>& buffer, BLEScanResult& result)
+{
+	DWORD requiredSize = 0;
+	while (!SetupDiGetDeviceInstanceId(hDevInfo, pDeviceInfoData, buffer.data(), (DWORD)buffer.size(), &requiredSize))
+	{
+		if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+		{
+			buffer.resize(requiredSize);
+		}
+		else
+		{
+			result.errors.push_back(std::string("Could not read device instance Id: ").append(LastErrorMessage()));
+			return 0;
+		}
+	}
+	return wcsnlen(buffer.data(), requiredSize);
+}
+
+// --------------------------------------------------------------------------
+// Finds all the bluetooth devices
+// --------------------------------------------------------------------------
+bool BLESetupDiDeviceSource::Enumerate(const BLERegistrySnapshot& known, BLEScanResult& result, BLEScanObserver* observer)
+{
+	// Create a HDEVINFO with all present devices.
+	HDEVINFO hDevInfo = SetupDiGetClassDevs(&GUID_DEVCLASS_BLUETOOTH, 0, 0, DIGCF_PRESENT);
+	if (hDevInfo == INVALID_HANDLE_VALUE)
+	{
+		result.errors.push_back(std::string("Could not request bluetooth device list: ").append(LastErrorMessage()));
+		return false;
+	}
+
+	// Enumerate through all devices in Set.
+	SP_DEVINFO_DATA DeviceInfoData;
+	DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+	for (DWORD i = 0; SetupDiEnumDeviceInfo(hDevInfo, i, &DeviceInfoData); i++)
+	{
+		// Check the hardware Id
+		size_t hardwareIdLength = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_HARDWAREID, _hardwareIdBuffer, result);
+
+		// We're only interested in entries that start with either 'BTHLE\' or 'BTHLEDEVICE\'
+		auto hardwareId = BLEUtils::ParseHardwareId(_hardwareIdBuffer.data(), hardwareIdLength);
+		if (hardwareId.kind == BLEUtils::HardwareIdKind::Other)
+		{
+			continue;
+		}
+
+		// Then grab the container GUID, this is what we use to match devices and services to the same physical device
+		size_t length = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_BASE_CONTAINERID, _propertyBuffer, result);
+		auto containerId = BLEUtils::Uuid::Parse(_propertyBuffer.data(), _propertyBuffer.data() + length);
+		if (containerId.IsNull())
+		{
+			// Can't be matched to a device, ReadProperty() already reported the error if there is no id
+			if (length != 0)
+			{
+				result.errors.push_back(std::string("Invalid container id \'").append(BLEUtils::ToNarrow(_propertyBuffer.data(), length))
+					.append("\' for the hardware ID \'").append(BLEUtils::ToNarrow(_hardwareIdBuffer.data(), hardwareIdLength)).append("\'"));
+			}
+			continue;
+		}
+
+		if (hardwareId.kind == BLEUtils::HardwareIdKind::Device)
+		{
+			// Fetch the name!
+			length = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_FRIENDLYNAME, _propertyBuffer, result);
+			result.devices.push_back({ containerId, BLEUtils::ToNarrow(_propertyBuffer.data(), length) });
+			if (observer != nullptr)
+			{
+				observer->DeviceFound(result.devices.back());
+			}
+		}
+		else if (hardwareId.guid != nullptr)
+		{
+			BLEScanResult::Service service;
+			service.containerId = containerId;
+			service.id = BLEUtils::Uuid::Parse(hardwareId.guid, hardwareId.guid + hardwareId.guidLength);
+			service.hasDetails = known.FindService(service.containerId, service.id) == nullptr;
+			if (service.hasDetails)
+			{
+				length = ReadProperty(hDevInfo, &DeviceInfoData, SPDRP_DEVICEDESC, _propertyBuffer, result);
+				service.name = BLEUtils::ToNarrow(_propertyBuffer.data(), length);
+
+				// Parse the device instance id to get the device path!
+				length = ReadDeviceInstanceId(hDevInfo, &DeviceInfoData, _propertyBuffer, result);
+				std::replace(_propertyBuffer.data(), _propertyBuffer.data() + length, L'\\', L'#');
+
+				// Create the device path
+				service.path = "\\\\?\\";
+				service.path.append(length != 0 ? BLEUtils::ToNarrow(_propertyBuffer.data(), length) : std::string("<no_id>"));
+				service.path.append("#");
+				service.path.append(BLEUtils::ToNarrow(hardwareId.guid, hardwareId.guidLength));
+			}
+			result.services.push_back(std::move(service));
+			if (observer != nullptr)
+			{
+				observer->ServiceFound(result.services.back());
+			}
+		}
+		else
+		{
+			result.errors.push_back(std::string("Could not extract service GUID from the hardware ID \'").append(BLEUtils::ToNarrow(_hardwareIdBuffer.data(), hardwareIdLength)).append("\'"));
+		}
+	}
+
+	SetupDiDestroyDeviceInfoList(hDevInfo);
+	return true;
+}
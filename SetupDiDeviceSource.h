@@ -0,0 +1,28 @@
+#pragma once
+
+#include <windows.h>
+#include <setupapi.h>
+
+#include <vector>
+
+#include "DeviceSource.h"
+
+// --------------------------------------------------------------------------
+// Enumerates the Bluetooth LE devices and services Windows knows about
+// through the SetupDi API
+// --------------------------------------------------------------------------
+class BLESetupDiDeviceSource : public BLEDeviceSource
+{
+public:
+	BLESetupDiDeviceSource();
+
+	bool Enumerate(const BLERegistrySnapshot& known, BLEScanResult& result, BLEScanObserver* observer) override;
+
+private:
+	size_t ReadProperty(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDeviceInfoData, DWORD property, std::vector<wchar_t>& buffer, BLEScanResult& result);
+	size_t ReadDeviceInstanceId(HDEVINFO hDevInfo, PSP_DEVINFO_DATA pDeviceInfoData, std::vector<wchar_t>& buffer, BLEScanResult& result);
+
+	// Scratch buffers reused from one enumeration to the next, the hardware id is kept while reading the other properties
+	std::vector<wchar_t> _hardwareIdBuffer;
+	std::vector<wchar_t> _propertyBuffer;
+};
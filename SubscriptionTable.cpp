@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include "SubscriptionTable.h"
+
+#include <thread>		// std::this_thread::yield
+
+BLESubscriptionTable::BLESubscriptionTable()
+{
+	_freeSlots.reserve(Capacity);
+	for (size_t i = 0; i < Capacity; ++i)
+	{
+		_slots[i].generation = 0;
+		_slots[i].inFlight = 0;
+		// Hand out low indices first
+		_freeSlots.push_back((std::uint32_t)(Capacity - 1 - i));
+	}
+}
+
+void* BLESubscriptionTable::Acquire(const std::vector<Target>& targets)
+{
+	std::uint32_t index = TakeSlot();
+	if (index == Capacity)
+	{
+		return nullptr;
+	}
+
+	// The slot is free, no callback reads its payload until the new generation is published
+	_slots[index].targets = targets;
+	return Publish(index);
+}
+
+std::uint32_t BLESubscriptionTable::TakeSlot()
+{
+	const std::lock_guard<std::mutex> lock{ _freeSlotsMutex };
+	if (_freeSlots.empty())
+	{
+		return Capacity;
+	}
+	std::uint32_t index = _freeSlots.back();
+	_freeSlots.pop_back();
+	return index;
+}
+
+void* BLESubscriptionTable::Publish(std::uint32_t index)
+{
+	auto& slot = _slots[index];
+	std::uint32_t generation = (slot.generation.load() + 1) & GenerationMask;
+	slot.generation.store(generation);
+
+	return reinterpret_cast<void*>((std::uintptr_t)((generation << IndexBits) | index));
+}
+
+void BLESubscriptionTable::Release(void* context)
+{
+	std::uint32_t index, generation;
+	if (!Decode(context, index, generation))
+	{
+		return;
+	}
+
+	auto& slot = _slots[index];
+	std::uint32_t expected = generation;
+	if (!slot.generation.compare_exchange_strong(expected, (generation + 1) & GenerationMask))
+	{
+		// Already released
+		return;
+	}
+
+	// Callbacks that loaded the old generation may still be reading the slot
+	while (slot.inFlight.load() != 0)
+	{
+		std::this_thread::yield();
+	}
+
+	const std::lock_guard<std::mutex> lock{ _freeSlotsMutex };
+	_freeSlots.push_back(index);
+}
+
+bool BLESubscriptionTable::Decode(void* context, std::uint32_t& index, std::uint32_t& generation)
+{
+	std::uintptr_t value = reinterpret_cast<std::uintptr_t>(context);
+	std::uintptr_t high = value >> IndexBits;
+	index = (std::uint32_t)(value & ((1u << IndexBits) - 1));
+	generation = (std::uint32_t)(high & GenerationMask);
+
+	// Live slots have an odd generation
+	return index < Capacity && high <= GenerationMask && (generation & 1) != 0;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------------------------
+// Fixed table of characteristic subscriptions, shared with the notification
+// callback which runs on a Bluetooth stack thread.
+//
+// The context given to the OS for each subscription is a slot index plus the
+// slot generation, so the callback validates it in O(1) without any lock.
+// A slot's generation is odd while it is in use and bumped on release, which
+// then waits for the callbacks that were already running before the slot can
+// be reused.
+// A slot may also cover several characteristics registered with a single
+// event, the callback then finds the characteristic by its attribute handle.
+// --------------------------------------------------------------------------
+class BLESubscriptionTable
+{
+public:
+	static const size_t Capacity = 256;
+
+	BLESubscriptionTable();
+
+	// One of the characteristics of a slot, notifications may identify it either by its
+	// declaration or by its value handle. The message prefix is what the notification
+	// callback prepends to the characteristic value.
+	struct Target
+	{
+		std::uint16_t attributeHandle;
+		std::uint16_t valueHandle;
+		std::string messagePrefix;
+	};
+
+	// Takes a slot for a registration covering the given characteristics and returns
+	// the context to give to BluetoothGATTRegisterEvent, or nullptr if the table is full
+	void* Acquire(const std::vector<Target>& targets);
+
+	// Invalidates the context and waits for in-flight callbacks using it to complete
+	void Release(void* context);
+
+	// Called from the notification callback, invokes visitor with the message prefix of the
+	// characteristic if the context is still valid, returns false otherwise. The changed
+	// attribute handle is only looked at when the slot covers several characteristics.
+	template <typename Visitor>
+	bool Visit(void* context, std::uint16_t changedHandle, Visitor&& visitor)
+	{
+		std::uint32_t index, generation;
+		if (!Decode(context, index, generation))
+		{
+			return false;
+		}
+
+		auto& slot = _slots[index];
+		slot.inFlight.fetch_add(1);
+		bool valid = slot.generation.load() == generation;
+		if (valid)
+		{
+			for (const auto& target : slot.targets)
+			{
+				if (slot.targets.size() == 1 || target.valueHandle == changedHandle || target.attributeHandle == changedHandle)
+				{
+					visitor(target.messagePrefix);
+					break;
+				}
+			}
+		}
+		slot.inFlight.fetch_sub(1);
+		return valid;
+	}
+
+private:
+	static const std::uint32_t IndexBits = 8;
+	static const std::uint32_t GenerationMask = (1u << (32 - IndexBits)) - 1;
+	static_assert(Capacity <= (1u << IndexBits), "Subscription table capacity doesn't fit in the context index bits");
+
+	struct Slot
+	{
+		std::atomic<std::uint32_t> generation;
+		std::atomic<std::uint32_t> inFlight;
+		std::vector<Target> targets;
+	};
+
+	std::uint32_t TakeSlot(); // Returns Capacity if there is none left
+	void* Publish(std::uint32_t index);
+	static bool Decode(void* context, std::uint32_t& index, std::uint32_t& generation);
+
+	std::array<Slot, Capacity> _slots;
+	std::vector<std::uint32_t> _freeSlots;
+	std::mutex _freeSlotsMutex; // Only taken by Acquire/Release, never by the callback
+};
@@ -0,0 +1,100 @@
+#include <windows.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "DiceBLEWin.h"
+#include "FakeBluetooth.h"
+#include "SimulatedLibrary.h"
+
+// --------------------------------------------------------------------------
+// Throughput of _winBluetoothLEWriteCharacteristicBulk() per acknowledgement
+// interval, against a simulated device where each write takes some time on
+// the radio and those with response also wait for the device to answer.
+// The transfer runs on a command thread, the call returns right away.
+// --------------------------------------------------------------------------
+
+using namespace std::chrono;
+
+static const microseconds WriteLatency(50);
+static const microseconds AcknowledgeLatency(2000);
+static const int ChunkSize = 20;
+static const int AckIntervals[] = { 1, 4, 16, 64 };
+
+struct Transfer
+{
+	double callSeconds;		// Until the call returned
+	double bytesPerSecond;	// Until the transfer was reported done
+};
+
+static Transfer RunTransfer(const std::string& address, const std::string& service, const std::string& characteristic, const std::vector<unsigned char>& data, int ackInterval)
+{
+	FakeBluetooth::ResetCounters();
+	auto start = steady_clock::now();
+	int requestId = _winBluetoothLEWriteCharacteristicBulk(address.c_str(), service.c_str(), characteristic.c_str(), data.data(), (int)data.size(), ChunkSize, ackInterval);
+	double callSeconds = SecondsSince(start);
+	CHECK(requestId > 0);
+
+	auto done = SimulatedLibrary::WaitForMessages("DidWriteCharacteristicBulk~" + address + "~", 1, seconds(60));
+	double elapsed = SecondsSince(start);
+	CHECK(done.size() == 1);
+
+	// Every ackInterval-th chunk and the last one are acknowledged
+	auto counters = FakeBluetooth::GetCounters();
+	size_t chunkCount = (data.size() + ChunkSize - 1) / ChunkSize;
+	size_t acknowledged = chunkCount / ackInterval + (chunkCount % ackInterval != 0 ? 1 : 0);
+	CHECK(counters.writes == chunkCount);
+	CHECK(counters.bytesWritten == data.size());
+	CHECK(counters.acknowledgedWrites == acknowledged);
+
+	return { callSeconds, data.size() / elapsed };
+}
+
+int main(int argc, char** argv)
+{
+	int size = argc > 1 ? atoi(argv[1]) : 16384;
+
+	SimulatedLibrary::HookMessages();
+	auto device = FakeBluetooth::MakeDevice(0, 1, 4);
+	CHECK(SimulatedLibrary::AddAndScan({ device }));
+	std::string address = SimulatedLibrary::AddressOf(device);
+	std::string service = BLEUtils::UuidToString(device.services[0].id);
+	std::string characteristic = BLEUtils::UuidToString(device.services[0].characteristics[0]);
+	_winBluetoothLEConnectToPeripheral(address.c_str());
+	CHECK(registry.Read()->FindConnectedService(device.containerId, device.services[0].id) != nullptr);
+	SimulatedLibrary::TakeMessages();
+
+	FakeBluetooth::SetWriteLatency(WriteLatency);
+	FakeBluetooth::SetAcknowledgeLatency(AcknowledgeLatency);
+
+	std::vector<unsigned char> data(size);
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = (unsigned char)i;
+	}
+
+	printf("%d bytes in chunks of %d, %lld us per write, %lld us more with response\n", size, ChunkSize, (long long)WriteLatency.count(), (long long)AcknowledgeLatency.count());
+	std::vector<Transfer> transfers;
+	for (int ackInterval : AckIntervals)
+	{
+		transfers.push_back(RunTransfer(address, service, characteristic, data, ackInterval));
+		printf("Acknowledged every %2d chunks: %8.0f bytes/s, call returned after %.3f ms\n", ackInterval, transfers.back().bytesPerSecond, transfers.back().callSeconds * 1e3);
+	}
+
+	// The caller doesn't wait for the transfer, and acknowledging less often is faster
+	for (const auto& transfer : transfers)
+	{
+		CHECK(transfer.callSeconds < 0.05);
+	}
+	CHECK(transfers[2].bytesPerSecond > transfers[0].bytesPerSecond * 2);
+
+	// A negative length is an error rather than an empty transfer
+	CHECK(_winBluetoothLEWriteCharacteristicBulk(address.c_str(), service.c_str(), characteristic.c_str(), data.data(), -1, ChunkSize, 1) == 0);
+	CHECK(SimulatedLibrary::WaitForMessages("Error~Invalid bulk write length -1", 1, seconds(1)).size() == 1);
+
+	_winBluetoothLEDeInitialize();
+	return CheckResult();
+}
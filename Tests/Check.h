@@ -0,0 +1,40 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+
+// --------------------------------------------------------------------------
+// Minimal checks for the test programs: a failed check is printed and makes
+// the program exit with an error once done, see CheckResult().
+// --------------------------------------------------------------------------
+inline int& CheckFailures()
+{
+	static int failures = 0;
+	return failures;
+}
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			++CheckFailures(); \
+		} \
+	} while (0)
+
+inline int CheckResult()
+{
+	if (CheckFailures() != 0)
+	{
+		fprintf(stderr, "%d check(s) failed\n", CheckFailures());
+		return 1;
+	}
+	return 0;
+}
+
+// Seconds elapsed since start
+inline double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
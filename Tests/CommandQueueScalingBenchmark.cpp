@@ -0,0 +1,122 @@
+#include <windows.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "CommandQueue.h"
+
+// --------------------------------------------------------------------------
+// Command throughput of BLECommandQueue as the number of workers and of
+// devices grows. Each command blocks for a while, like a GATT operation
+// waiting on the radio, so the throughput is bounded by how many of them
+// run at the same time: the number of workers, or of devices if fewer as
+// the commands of a device run one after the other.
+// --------------------------------------------------------------------------
+
+using namespace std::chrono;
+
+static const microseconds CommandDuration(500);
+static const size_t WorkerCounts[] = { 1, 2, 4, 8, 16 };
+static const size_t DeviceCounts[] = { 1, 4, 16, 64 };
+
+struct Device
+{
+	std::atomic<int> running{ 0 };
+	std::atomic<int> lastRun{ -1 };
+};
+
+// Runs count commands spread over the devices, returns the commands run per second
+static double Run(BLECommandQueue& queue, size_t workerCount, size_t deviceCount, int count)
+{
+	queue.SetWorkerCount(workerCount);
+	std::vector<Device> devices(deviceCount);
+	std::atomic<int> outOfOrder{ 0 }, overlapping{ 0 };
+
+	std::mutex mutex;
+	std::condition_variable done;
+	int completed = 0;
+
+	auto start = steady_clock::now();
+	for (int i = 0; i < count; ++i)
+	{
+		size_t index = i % deviceCount;
+		int sequence = i / (int)deviceCount;
+		queue.Enqueue(BLEUtils::Uuid(0xD1CE0000 + index, 1), [&, index, sequence](int)
+		{
+			auto& device = devices[index];
+			if (device.running.fetch_add(1) != 0)
+			{
+				overlapping.fetch_add(1);
+			}
+			if (device.lastRun.exchange(sequence) != sequence - 1)
+			{
+				outOfOrder.fetch_add(1);
+			}
+			std::this_thread::sleep_for(CommandDuration);
+			device.running.fetch_sub(1);
+
+			const std::lock_guard<std::mutex> lock{ mutex };
+			if (++completed == count)
+			{
+				done.notify_one();
+			}
+		});
+	}
+
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		CHECK(done.wait_for(lock, seconds(60), [&]() { return completed == count; }));
+	}
+	double elapsed = SecondsSince(start);
+
+	// The commands of a device never run together nor out of order, and none is left behind
+	CHECK(overlapping.load() == 0);
+	CHECK(outOfOrder.load() == 0);
+	CHECK(queue.PendingCount() == 0);
+	return count / elapsed;
+}
+
+int main(int argc, char** argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 4000;
+
+	BLECommandQueue queue;
+	printf("%d commands of %lld us per run\n", count, (long long)CommandDuration.count());
+	printf("workers");
+	for (size_t deviceCount : DeviceCounts)
+	{
+		printf("  %4zu devices", deviceCount);
+	}
+	printf("   (commands/s)\n");
+
+	double single = 0, widest = 0;
+	for (size_t workerCount : WorkerCounts)
+	{
+		printf("%7zu", workerCount);
+		for (size_t deviceCount : DeviceCounts)
+		{
+			double throughput = Run(queue, workerCount, deviceCount, count);
+			printf("  %12.0f", throughput);
+			if (workerCount == 1 && deviceCount == 64)
+			{
+				single = throughput;
+			}
+			if (workerCount == 8 && deviceCount == 64)
+			{
+				widest = throughput;
+			}
+		}
+		printf("\n");
+	}
+	queue.Stop();
+
+	// Far from perfect scaling is fine on a loaded machine, no scaling isn't
+	CHECK(widest > single * 3);
+	return CheckResult();
+}
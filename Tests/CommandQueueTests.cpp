@@ -0,0 +1,172 @@
+#include <windows.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "CommandQueue.h"
+#include "DiceBLEWin.h"
+
+// --------------------------------------------------------------------------
+// Stopping BLECommandQueue while commands wait behind a running one: those
+// that didn't run are cancelled, and through the exports each of them sends
+// CommandFailed with its request id.
+// --------------------------------------------------------------------------
+
+extern BLECommandQueue commandQueue;
+
+using namespace std::chrono;
+
+// Keeps a command running until released
+class Gate
+{
+public:
+	Gate() : _entered(false), _open(false) {}
+
+	void Pass()
+	{
+		std::unique_lock<std::mutex> lock{ _mutex };
+		_entered = true;
+		_changed.notify_all();
+		_changed.wait(lock, [this]() { return _open; });
+	}
+
+	bool WaitUntilEntered()
+	{
+		std::unique_lock<std::mutex> lock{ _mutex };
+		return _changed.wait_for(lock, seconds(5), [this]() { return _entered; });
+	}
+
+	// Opens the gate a bit later, once the caller is blocked in Stop()
+	std::thread OpenLater()
+	{
+		return std::thread([this]()
+		{
+			std::this_thread::sleep_for(milliseconds(50));
+			const std::lock_guard<std::mutex> lock{ _mutex };
+			_open = true;
+			_changed.notify_all();
+		});
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	bool _entered;
+	bool _open;
+};
+
+// The commands queued behind the running one are cancelled in order, after it completed
+static void TestStopCancelsDropped()
+{
+	BLECommandQueue queue;
+	queue.SetWorkerCount(1);
+	BLEUtils::Uuid deviceA(1, 1), deviceB(2, 2);
+
+	std::mutex mutex;
+	std::vector<int> ran, cancelled;
+	auto record = [&mutex](std::vector<int>& list, int requestId)
+	{
+		const std::lock_guard<std::mutex> lock{ mutex };
+		list.push_back(requestId);
+	};
+
+	Gate gate;
+	int running = queue.Enqueue(deviceA, [&](int requestId) { gate.Pass(); record(ran, requestId); }, [&](int requestId) { record(cancelled, requestId); });
+	CHECK(gate.WaitUntilEntered());
+
+	std::vector<int> queued;
+	for (int i = 0; i < 6; ++i)
+	{
+		queued.push_back(queue.Enqueue(i % 2 == 0 ? deviceA : deviceB,
+			[&](int requestId) { record(ran, requestId); },
+			[&](int requestId) { record(cancelled, requestId); }));
+	}
+	// Without a cancel function, dropped silently
+	queue.Enqueue(deviceB, [&](int requestId) { record(ran, requestId); });
+	CHECK(queue.PendingCount() == 7);
+
+	auto opener = gate.OpenLater();
+	queue.Stop();
+	opener.join();
+
+	CHECK(ran == std::vector<int>{ running });
+	CHECK(cancelled == queued);
+	CHECK(queue.PendingCount() == 0);
+
+	// Usable again
+	Gate next;
+	queue.Enqueue(deviceA, [&next](int) { next.Pass(); });
+	CHECK(next.WaitUntilEntered());
+	auto nextOpener = next.OpenLater();
+	queue.Stop();
+	nextOpener.join();
+}
+
+static std::mutex messageMutex;
+static std::vector<std::string> received;
+
+static void OnMessage(const char* message)
+{
+	const std::lock_guard<std::mutex> lock{ messageMutex };
+	received.push_back(message);
+}
+
+static void OnLog(timestamp_us_t, thread_id_t, const char*)
+{
+}
+
+// Commands queued through the exports send CommandFailed when dropped, before DeInitialized
+static void TestDroppedCommandsFail()
+{
+	_winBluetoothLEConnectCallbacks(OnMessage, OnLog, OnLog, OnLog);
+	_winBluetoothLESetAsyncCommands(true);
+	_winBluetoothLESetCommandThreadCount(1);
+
+	const char* address = "{d1ce0000-0001-4000-8000-000000000000}";
+	Gate gate;
+	commandQueue.Enqueue(BLEUtils::Uuid::Parse(address), [&gate](int) { gate.Pass(); });
+	CHECK(gate.WaitUntilEntered());
+
+	std::vector<int> requestIds;
+	requestIds.push_back(_winBluetoothLEDisconnectPeripheral(address));
+	requestIds.push_back(_winBluetoothLEReadCharacteristic(address, "{0000fff0-0000-1000-8000-00805f9b34fb}", "{0000fff1-0000-1000-8000-00805f9b34fb}"));
+	for (int requestId : requestIds)
+	{
+		CHECK(requestId > 0);
+	}
+
+	auto opener = gate.OpenLater();
+	_winBluetoothLEDeInitialize();
+	opener.join();
+	_winBluetoothLESetAsyncCommands(false);
+
+	const std::lock_guard<std::mutex> lock{ messageMutex };
+	std::vector<std::string> failures;
+	for (const auto& message : received)
+	{
+		if (message.compare(0, strlen("CommandFailed~"), "CommandFailed~") == 0)
+		{
+			failures.push_back(message);
+		}
+	}
+	CHECK(failures.size() == requestIds.size());
+	for (size_t i = 0; i < failures.size() && i < requestIds.size(); ++i)
+	{
+		std::string prefix = "CommandFailed~" + std::to_string(requestIds[i]) + "~";
+		CHECK(failures[i].compare(0, prefix.size(), prefix) == 0);
+	}
+	CHECK(!received.empty() && received.back() == "DeInitialized");
+}
+
+int main()
+{
+	TestStopCancelsDropped();
+	TestDroppedCommandsFail();
+	return CheckResult();
+}
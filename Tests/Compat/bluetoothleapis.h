@@ -0,0 +1,121 @@
+#pragma once
+
+#include <windows.h>
+
+typedef struct _BTH_LE_UUID
+{
+	BOOLEAN IsShortUuid;
+	union
+	{
+		USHORT ShortUuid;
+		GUID LongUuid;
+	} Value;
+} BTH_LE_UUID, *PBTH_LE_UUID;
+
+static const GUID BTH_LE_ATT_BLUETOOTH_BASE_GUID = { 0x00000000, 0x0000, 0x1000, { 0x80, 0x00, 0x00, 0x80, 0x5F, 0x9B, 0x34, 0xFB } };
+
+typedef struct _BTH_LE_GATT_SERVICE
+{
+	BTH_LE_UUID ServiceUuid;
+	USHORT AttributeHandle;
+} BTH_LE_GATT_SERVICE, *PBTH_LE_GATT_SERVICE;
+
+typedef struct _BTH_LE_GATT_CHARACTERISTIC
+{
+	USHORT ServiceHandle;
+	BTH_LE_UUID CharacteristicUuid;
+	USHORT AttributeHandle;
+	USHORT CharacteristicValueHandle;
+	BOOLEAN IsBroadcastable;
+	BOOLEAN IsReadable;
+	BOOLEAN IsWritable;
+	BOOLEAN IsWritableWithoutResponse;
+	BOOLEAN IsSignedWritable;
+	BOOLEAN IsNotifiable;
+	BOOLEAN IsIndicatable;
+	BOOLEAN HasExtendedProperties;
+} BTH_LE_GATT_CHARACTERISTIC, *PBTH_LE_GATT_CHARACTERISTIC;
+
+typedef struct _BTH_LE_GATT_CHARACTERISTIC_VALUE
+{
+	ULONG DataSize;
+	UCHAR Data[1];
+} BTH_LE_GATT_CHARACTERISTIC_VALUE, *PBTH_LE_GATT_CHARACTERISTIC_VALUE;
+
+typedef enum _BTH_LE_GATT_DESCRIPTOR_TYPE
+{
+	CharacteristicExtendedProperties,
+	CharacteristicUserDescription,
+	ClientCharacteristicConfiguration,
+	ServerCharacteristicConfiguration,
+	CharacteristicFormat,
+	CharacteristicAggregateFormat,
+	CustomDescriptor
+} BTH_LE_GATT_DESCRIPTOR_TYPE;
+
+typedef struct _BTH_LE_GATT_DESCRIPTOR
+{
+	USHORT ServiceHandle;
+	USHORT CharacteristicHandle;
+	BTH_LE_GATT_DESCRIPTOR_TYPE DescriptorType;
+	BTH_LE_UUID DescriptorUuid;
+	USHORT AttributeHandle;
+} BTH_LE_GATT_DESCRIPTOR, *PBTH_LE_GATT_DESCRIPTOR;
+
+typedef struct _BTH_LE_GATT_DESCRIPTOR_VALUE
+{
+	BTH_LE_GATT_DESCRIPTOR_TYPE DescriptorType;
+	BTH_LE_UUID DescriptorUuid;
+	union
+	{
+		struct
+		{
+			BOOLEAN IsSubscribeToNotification;
+			BOOLEAN IsSubscribeToIndication;
+		} ClientCharacteristicConfiguration;
+	};
+	ULONG DataSize;
+	UCHAR Data[1];
+} BTH_LE_GATT_DESCRIPTOR_VALUE, *PBTH_LE_GATT_DESCRIPTOR_VALUE;
+
+typedef enum _BTH_LE_GATT_EVENT_TYPE
+{
+	CharacteristicValueChangedEvent
+} BTH_LE_GATT_EVENT_TYPE;
+
+typedef ULONGLONG BTH_LE_GATT_RELIABLE_WRITE_CONTEXT;
+
+typedef struct _BLUETOOTH_GATT_VALUE_CHANGED_EVENT_REGISTRATION
+{
+	USHORT NumCharacteristics;
+	BTH_LE_GATT_CHARACTERISTIC Characteristics[1];
+} BLUETOOTH_GATT_VALUE_CHANGED_EVENT_REGISTRATION, *PBLUETOOTH_GATT_VALUE_CHANGED_EVENT_REGISTRATION;
+
+typedef struct _BLUETOOTH_GATT_VALUE_CHANGED_EVENT
+{
+	USHORT ChangedAttributeHandle;
+	size_t CharacteristicValueDataSize;
+	PBTH_LE_GATT_CHARACTERISTIC_VALUE CharacteristicValue;
+} BLUETOOTH_GATT_VALUE_CHANGED_EVENT, *PBLUETOOTH_GATT_VALUE_CHANGED_EVENT;
+
+typedef void* BLUETOOTH_GATT_EVENT_HANDLE;
+typedef void (*PFNBLUETOOTH_GATT_EVENT_CALLBACK)(BTH_LE_GATT_EVENT_TYPE eventType, PVOID eventOutParameter, PVOID context);
+
+#define BLUETOOTH_GATT_FLAG_NONE 0x00
+#define BLUETOOTH_GATT_FLAG_CONNECTION_ENCRYPTED 0x01
+#define BLUETOOTH_GATT_FLAG_CONNECTION_AUTHENTICATED 0x02
+#define BLUETOOTH_GATT_FLAG_FORCE_READ_FROM_DEVICE 0x04
+#define BLUETOOTH_GATT_FLAG_FORCE_READ_FROM_CACHE 0x08
+#define BLUETOOTH_GATT_FLAG_SIGNED_WRITE 0x10
+#define BLUETOOTH_GATT_FLAG_WRITE_WITHOUT_RESPONSE 0x20
+#define BLUETOOTH_GATT_FLAG_RETURN_ALL 0x40
+
+HRESULT BluetoothGATTGetServices(HANDLE device, USHORT count, PBTH_LE_GATT_SERVICE services, USHORT* actualCount, ULONG flags);
+HRESULT BluetoothGATTGetCharacteristics(HANDLE device, PBTH_LE_GATT_SERVICE service, USHORT count, PBTH_LE_GATT_CHARACTERISTIC characteristics, USHORT* actualCount, ULONG flags);
+HRESULT BluetoothGATTGetDescriptors(HANDLE device, PBTH_LE_GATT_CHARACTERISTIC characteristic, USHORT count, PBTH_LE_GATT_DESCRIPTOR descriptors, USHORT* actualCount, ULONG flags);
+HRESULT BluetoothGATTGetCharacteristicValue(HANDLE device, PBTH_LE_GATT_CHARACTERISTIC characteristic, ULONG size, PBTH_LE_GATT_CHARACTERISTIC_VALUE value, USHORT* requiredSize, ULONG flags);
+HRESULT BluetoothGATTGetDescriptorValue(HANDLE device, PBTH_LE_GATT_DESCRIPTOR descriptor, ULONG size, PBTH_LE_GATT_DESCRIPTOR_VALUE value, USHORT* requiredSize, ULONG flags);
+HRESULT BluetoothGATTSetCharacteristicValue(HANDLE device, PBTH_LE_GATT_CHARACTERISTIC characteristic, PBTH_LE_GATT_CHARACTERISTIC_VALUE value, BTH_LE_GATT_RELIABLE_WRITE_CONTEXT context, ULONG flags);
+HRESULT BluetoothGATTSetDescriptorValue(HANDLE device, PBTH_LE_GATT_DESCRIPTOR descriptor, PBTH_LE_GATT_DESCRIPTOR_VALUE value, ULONG flags);
+HRESULT BluetoothGATTRegisterEvent(HANDLE service, BTH_LE_GATT_EVENT_TYPE eventType, PVOID eventParameter, PFNBLUETOOTH_GATT_EVENT_CALLBACK callback, PVOID context, BLUETOOTH_GATT_EVENT_HANDLE* eventHandle, ULONG flags);
+HRESULT BluetoothGATTUnregisterEvent(BLUETOOTH_GATT_EVENT_HANDLE eventHandle, ULONG flags);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <windows.h>
+
+class _com_error
+{
+public:
+	explicit _com_error(HRESULT hr) : _hr(hr) {}
+	const wchar_t* ErrorMessage() const { return L"Unknown error"; }
+
+private:
+	HRESULT _hr;
+};
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <windows.h>
+
+extern const GUID GUID_DEVCLASS_BLUETOOTH;
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <windows.h>
+
+typedef void* HDEVINFO;
+
+typedef struct _SP_DEVINFO_DATA
+{
+	DWORD cbSize;
+	GUID ClassGuid;
+	DWORD DevInst;
+	ULONG_PTR Reserved;
+} SP_DEVINFO_DATA, *PSP_DEVINFO_DATA;
+
+typedef struct _SP_DEVICE_INTERFACE_DATA
+{
+	DWORD cbSize;
+	GUID InterfaceClassGuid;
+	DWORD Flags;
+	ULONG_PTR Reserved;
+} SP_DEVICE_INTERFACE_DATA, *PSP_DEVICE_INTERFACE_DATA;
+
+typedef struct _SP_DEVICE_INTERFACE_DETAIL_DATA
+{
+	DWORD cbSize;
+	WCHAR DevicePath[1];
+} SP_DEVICE_INTERFACE_DETAIL_DATA, *PSP_DEVICE_INTERFACE_DETAIL_DATA;
+
+#define DIGCF_PRESENT 0x02
+#define DIGCF_DEVICEINTERFACE 0x10
+
+#define SPDRP_DEVICEDESC 0x00
+#define SPDRP_HARDWAREID 0x01
+#define SPDRP_FRIENDLYNAME 0x0C
+#define SPDRP_BASE_CONTAINERID 0x24
+
+HDEVINFO SetupDiGetClassDevs(const GUID* classGuid, LPCWSTR enumerator, void* parent, DWORD flags);
+BOOL SetupDiEnumDeviceInfo(HDEVINFO devInfo, DWORD index, PSP_DEVINFO_DATA devInfoData);
+BOOL SetupDiGetDeviceRegistryProperty(HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, DWORD property, DWORD* regDataType, PBYTE buffer, DWORD size, DWORD* requiredSize);
+BOOL SetupDiGetDeviceInstanceId(HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, LPTSTR buffer, DWORD size, DWORD* requiredSize);
+BOOL SetupDiGetDeviceInterfaceDetail(HDEVINFO devInfo, PSP_DEVICE_INTERFACE_DATA interfaceData, PSP_DEVICE_INTERFACE_DETAIL_DATA detailData, DWORD size, DWORD* requiredSize, PSP_DEVINFO_DATA devInfoData);
+BOOL SetupDiDestroyDeviceInfoList(HDEVINFO devInfo);
@@ -0,0 +1,156 @@
+#pragma once
+
+// --------------------------------------------------------------------------
+// The subset of the Windows API the library uses, so that it builds on Linux
+// for the tests. The functions are implemented by Fakes/FakeWindows.cpp and
+// Fakes/FakeBluetooth.cpp. Built with -fshort-wchar, wchar_t holds UTF-16
+// code units as it does on Windows.
+// --------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef unsigned int DWORD;
+typedef unsigned int ULONG;
+typedef int LONG;
+typedef unsigned short USHORT;
+typedef unsigned char UCHAR;
+typedef unsigned char BYTE;
+typedef BYTE* PBYTE;
+typedef int BOOL;
+typedef unsigned char BOOLEAN;
+typedef int HRESULT;
+typedef void* HANDLE;
+typedef HANDLE HINSTANCE;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef wchar_t WCHAR;
+typedef wchar_t* LPTSTR;
+typedef wchar_t* LPWSTR;
+typedef const wchar_t* LPCWSTR;
+typedef unsigned long long ULONGLONG;
+typedef long long LONGLONG;
+typedef std::uintptr_t ULONG_PTR;
+typedef ULONG_PTR DWORD_PTR;
+typedef ULONG* PULONG;
+typedef USHORT* PUSHORT;
+
+typedef union
+{
+	struct
+	{
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _GUID
+{
+	unsigned int Data1;
+	unsigned short Data2;
+	unsigned short Data3;
+	unsigned char Data4[8];
+} GUID;
+typedef GUID CLSID;
+typedef GUID UUID;
+
+inline bool operator==(const GUID& a, const GUID& b) { return memcmp(&a, &b, sizeof(GUID)) == 0; }
+inline bool operator!=(const GUID& a, const GUID& b) { return !(a == b); }
+
+#define TRUE 1
+#define FALSE 0
+#define CALLBACK
+#define WINAPI
+#define _In_
+#define _In_opt_
+#define _Out_
+
+#define S_OK ((HRESULT)0)
+#define E_FAIL ((HRESULT)0x80004005)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000E)
+#define E_PENDING ((HRESULT)0x8000000A)
+#define E_ABORT ((HRESULT)0x80004004)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define HRESULT_FROM_WIN32(x) ((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : ((HRESULT)(((x) & 0x0000FFFF) | (7 << 16) | 0x80000000)))
+
+#define ERROR_INVALID_DATA 13L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_ALREADY_EXISTS 183L
+#define ERROR_MORE_DATA 234L
+#define ERROR_NO_MORE_ITEMS 259L
+#define ERROR_DEVICE_NOT_CONNECTED 1167L
+#define ERROR_NOT_FOUND 1168L
+#define ERROR_TIMEOUT 1460L
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(std::intptr_t)-1)
+#define GENERIC_READ 0x80000000L
+#define GENERIC_WRITE 0x40000000L
+#define FILE_SHARE_READ 1
+#define FILE_SHARE_WRITE 2
+#define FILE_SHARE_DELETE 4
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define PAGE_READONLY 2
+#define FILE_MAP_READ 4
+#define MOVEFILE_REPLACE_EXISTING 1
+#define MAX_PATH 260
+
+#define FORMAT_MESSAGE_FROM_SYSTEM 0x1000
+#define FORMAT_MESSAGE_IGNORE_INSERTS 0x200
+#define LANG_NEUTRAL 0
+#define SUBLANG_DEFAULT 1
+#define MAKELANGID(p, s) ((((USHORT)(s)) << 10) | (USHORT)(p))
+
+#define THREAD_PRIORITY_BELOW_NORMAL -1
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_ABOVE_NORMAL 1
+#define THREAD_PRIORITY_HIGHEST 2
+#define INFINITE 0xFFFFFFFF
+
+#define DLL_PROCESS_DETACH 0
+#define DLL_PROCESS_ATTACH 1
+#define DLL_THREAD_ATTACH 2
+#define DLL_THREAD_DETACH 3
+
+#define RtlZeroMemory(d, l) memset((d), 0, (l))
+#define ZeroMemory RtlZeroMemory
+#define CopyMemory memcpy
+#define sprintf_s snprintf
+
+inline int fopen_s(FILE** file, const char* name, const char* mode)
+{
+	*file = fopen(name, mode);
+	return *file != nullptr ? 0 : 1;
+}
+
+DWORD GetLastError();
+void SetLastError(DWORD error);
+DWORD GetCurrentThreadId();
+void Sleep(DWORD milliseconds);
+DWORD FormatMessage(DWORD flags, const void* source, DWORD messageId, DWORD languageId, LPWSTR buffer, DWORD size, void* arguments);
+
+HANDLE CreateFile(LPCWSTR fileName, DWORD access, DWORD shareMode, void* security, DWORD creation, DWORD flags, HANDLE templateFile);
+BOOL CloseHandle(HANDLE handle);
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER* size);
+BOOL WriteFile(HANDLE file, const void* buffer, DWORD size, DWORD* written, void* overlapped);
+BOOL MoveFileEx(LPCWSTR existingFileName, LPCWSTR newFileName, DWORD flags);
+BOOL DeleteFile(LPCWSTR fileName);
+HANDLE CreateFileMapping(HANDLE file, void* security, DWORD protect, DWORD sizeHigh, DWORD sizeLow, LPCWSTR name);
+void* MapViewOfFile(HANDLE mapping, DWORD access, DWORD offsetHigh, DWORD offsetLow, size_t size);
+BOOL UnmapViewOfFile(const void* address);
+
+HANDLE GetCurrentThread();
+HANDLE GetCurrentProcess();
+BOOL SetThreadPriority(HANDLE thread, int priority);
+DWORD_PTR SetThreadAffinityMask(HANDLE thread, DWORD_PTR mask);
+BOOL GetProcessAffinityMask(HANDLE process, DWORD_PTR* processMask, DWORD_PTR* systemMask);
+
+HRESULT CLSIDFromString(LPCWSTR string, GUID* guid);
@@ -0,0 +1,148 @@
+#include <windows.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "CommandQueue.h"
+#include "DiceBLEWin.h"
+#include "FakeBluetooth.h"
+#include "SimulatedLibrary.h"
+
+// --------------------------------------------------------------------------
+// Connecting to simulated devices whose services take a while to open: the
+// services of a device are opened in parallel with the help of the command
+// workers, and so are several devices, and connecting doesn't depend on a
+// worker being free. Commands run on the caller's thread here.
+// --------------------------------------------------------------------------
+
+extern BLECommandQueue commandQueue;
+
+using namespace std::chrono;
+
+static const milliseconds OpenLatency(40);
+static const int ServiceCount = 4;
+
+static bool IsConnected(const FakeBluetooth::Device& device)
+{
+	auto snapshot = registry.Read();
+	for (const auto& service : device.services)
+	{
+		if (snapshot->FindConnectedService(device.containerId, service.id) == nullptr)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// The services are opened alongside each other
+static void TestParallelDiscovery(const FakeBluetooth::Device& device)
+{
+	auto start = steady_clock::now();
+	_winBluetoothLEConnectToPeripheral(SimulatedLibrary::AddressOf(device).c_str());
+	double elapsed = SecondsSince(start);
+	CHECK(IsConnected(device));
+	CHECK(elapsed < duration<double>(OpenLatency).count() * ServiceCount * 0.75);
+	CHECK(SimulatedLibrary::WaitForMessages("ConnectedPeripheral~" + SimulatedLibrary::AddressOf(device), 1, seconds(1)).size() == 1);
+	_winBluetoothLEDisconnectPeripheral(SimulatedLibrary::AddressOf(device).c_str());
+	CHECK(!IsConnected(device));
+}
+
+// With every worker busy, the connecting thread opens all the services itself
+static void TestBusyWorkers(const FakeBluetooth::Device& device)
+{
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool entered = false, released = false;
+	_winBluetoothLESetCommandThreadCount(1);
+	commandQueue.Enqueue(BLEUtils::Uuid(1, 1), [&](int)
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		entered = true;
+		changed.notify_all();
+		changed.wait(lock, [&]() { return released; });
+	});
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		CHECK(changed.wait_for(lock, seconds(5), [&]() { return entered; }));
+	}
+
+	_winBluetoothLEConnectToPeripheral(SimulatedLibrary::AddressOf(device).c_str());
+	CHECK(IsConnected(device));
+
+	{
+		const std::lock_guard<std::mutex> lock{ mutex };
+		released = true;
+	}
+	changed.notify_all();
+	_winBluetoothLEDisconnectPeripheral(SimulatedLibrary::AddressOf(device).c_str());
+	_winBluetoothLESetCommandThreadCount(4);
+}
+
+// Connects to all the devices at once, returns the time it took
+static double ConnectAll(const std::vector<FakeBluetooth::Device>& devices, int concurrency)
+{
+	std::vector<std::string> addresses;
+	std::vector<const char*> addressArgs;
+	for (const auto& device : devices)
+	{
+		addresses.push_back(SimulatedLibrary::AddressOf(device));
+	}
+	for (const auto& address : addresses)
+	{
+		addressArgs.push_back(address.c_str());
+	}
+
+	_winBluetoothLESetConnectConcurrency(concurrency);
+	auto start = steady_clock::now();
+	CHECK(_winBluetoothLEConnectToPeripherals(addressArgs.data(), (int)addressArgs.size()) == 0);
+	double elapsed = SecondsSince(start);
+
+	CHECK(SimulatedLibrary::WaitForMessages("ConnectSucceeded~", devices.size(), seconds(1)).size() == devices.size());
+	for (const auto& device : devices)
+	{
+		CHECK(IsConnected(device));
+		_winBluetoothLEDisconnectPeripheral(SimulatedLibrary::AddressOf(device).c_str());
+	}
+	return elapsed;
+}
+
+// Up to the connect concurrency devices are opened at the same time
+static void TestConcurrentConnects(const std::vector<FakeBluetooth::Device>& devices)
+{
+	double opening = duration<double>(OpenLatency).count();
+	double sequential = ConnectAll(devices, 1);
+	CHECK(sequential >= opening * devices.size() * 0.9);
+	double concurrent = ConnectAll(devices, 4);
+	CHECK(concurrent < opening * devices.size() * 0.5);
+
+	// No addresses at all
+	CHECK(_winBluetoothLEConnectToPeripherals(nullptr, 3) == 0);
+	_winBluetoothLESetConnectConcurrency(8);
+}
+
+int main()
+{
+	SimulatedLibrary::HookMessages();
+	auto device = FakeBluetooth::MakeDevice(0, ServiceCount, 4);
+	std::vector<FakeBluetooth::Device> devices;
+	for (int i = 1; i <= 8; ++i)
+	{
+		devices.push_back(FakeBluetooth::MakeDevice(i));
+	}
+	auto all = devices;
+	all.push_back(device);
+	CHECK(SimulatedLibrary::AddAndScan(all));
+	FakeBluetooth::SetOpenLatency(OpenLatency);
+
+	TestParallelDiscovery(device);
+	TestBusyWorkers(device);
+	TestConcurrentConnects(devices);
+
+	_winBluetoothLEDeInitialize();
+	return CheckResult();
+}
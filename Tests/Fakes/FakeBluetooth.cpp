@@ -0,0 +1,524 @@
+#include "FakeBluetooth.h"
+
+#include <setupapi.h>
+#include <devguid.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>		// offsetof
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// --------------------------------------------------------------------------
+// State of the simulated system. Opened services are identified by their
+// position in openableServices, which only grows, so that a handle outlives
+// the device it was opened on. Service handles are that position plus one,
+// well below any heap address, which is how CloseHandle() tells them from
+// file handles.
+// --------------------------------------------------------------------------
+namespace
+{
+	struct OpenableService
+	{
+		BLEUtils::Uuid containerId;
+		BLEUtils::Uuid serviceId;
+	};
+
+	struct SetupDiEntry
+	{
+		std::wstring hardwareId;
+		std::wstring containerId;
+		std::wstring name;
+		std::wstring instanceId;
+	};
+
+	struct DeviceList
+	{
+		std::vector<SetupDiEntry> entries;
+	};
+
+	const size_t MaxServiceHandle = 0x10000;
+
+	std::mutex mutex;
+	std::vector<FakeBluetooth::Device> devices;
+	std::vector<OpenableService> openableServices;
+	std::chrono::microseconds openLatency{ 0 };
+	std::chrono::microseconds writeLatency{ 0 };
+	std::chrono::microseconds acknowledgeLatency{ 0 };
+	FakeBluetooth::Counters counters{};
+
+	std::wstring ToWide(const std::string& s)
+	{
+		return std::wstring(s.begin(), s.end());
+	}
+
+	std::wstring Braced(const BLEUtils::Uuid& id)
+	{
+		return ToWide("{" + BLEUtils::UuidToString(id) + "}");
+	}
+
+	USHORT ServiceAttributeHandle(size_t serviceIndex)
+	{
+		return (USHORT)(1 + serviceIndex * 0x100);
+	}
+
+	// Index in openableServices, added if needed. Must be called with the mutex held.
+	size_t OpenableServiceIndex(const BLEUtils::Uuid& containerId, const BLEUtils::Uuid& serviceId)
+	{
+		for (size_t i = 0; i < openableServices.size(); ++i)
+		{
+			if (openableServices[i].containerId == containerId && openableServices[i].serviceId == serviceId)
+			{
+				return i;
+			}
+		}
+		openableServices.push_back({ containerId, serviceId });
+		return openableServices.size() - 1;
+	}
+
+	// The service a handle was opened on and its position in the device, null if the device is gone.
+	// Must be called with the mutex held.
+	const FakeBluetooth::Service* FindService(HANDLE handle, size_t& serviceIndex)
+	{
+		size_t i = (size_t)handle - 1;
+		if (!FakeBluetooth::IsServiceHandle(handle) || i >= openableServices.size())
+		{
+			return nullptr;
+		}
+		for (const auto& device : devices)
+		{
+			if (device.containerId == openableServices[i].containerId)
+			{
+				for (serviceIndex = 0; serviceIndex < device.services.size(); ++serviceIndex)
+				{
+					if (device.services[serviceIndex].id == openableServices[i].serviceId)
+					{
+						return &device.services[serviceIndex];
+					}
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	BTH_LE_GATT_CHARACTERISTIC MakeCharacteristic(size_t serviceIndex, size_t index, const BLEUtils::Uuid& id)
+	{
+		BTH_LE_GATT_CHARACTERISTIC characteristic = {};
+		characteristic.ServiceHandle = ServiceAttributeHandle(serviceIndex);
+		characteristic.CharacteristicUuid = BLEUtils::UuidToBTHLEUUID(id);
+		characteristic.AttributeHandle = (USHORT)(characteristic.ServiceHandle + 1 + 3 * index);
+		characteristic.CharacteristicValueHandle = (USHORT)(characteristic.AttributeHandle + 1);
+		characteristic.IsReadable = TRUE;
+		characteristic.IsWritable = TRUE;
+		characteristic.IsWritableWithoutResponse = TRUE;
+		characteristic.IsNotifiable = TRUE;
+		return characteristic;
+	}
+
+	BOOL CopyString(const std::wstring& s, size_t extraNulls, PBYTE buffer, DWORD size, DWORD* requiredSize)
+	{
+		DWORD required = (DWORD)((s.size() + 1 + extraNulls) * sizeof(wchar_t));
+		if (requiredSize != nullptr)
+		{
+			*requiredSize = required;
+		}
+		if (buffer == nullptr || size < required)
+		{
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return FALSE;
+		}
+		memset(buffer, 0, required);
+		memcpy(buffer, s.data(), s.size() * sizeof(wchar_t));
+		return TRUE;
+	}
+}
+
+// --------------------------------------------------------------------------
+// Setting up the simulation
+// --------------------------------------------------------------------------
+FakeBluetooth::Device FakeBluetooth::MakeDevice(int index, int serviceCount, int characteristicCount)
+{
+	Device device;
+	device.containerId = BLEUtils::Uuid(0xD1CE0000u + (std::uint32_t)index, 0x0001, 0x4000, 0x8000000000000000ull | (std::uint64_t)index);
+	device.name = "Die " + std::to_string(index);
+	for (int s = 0; s < serviceCount; ++s)
+	{
+		Service service;
+		service.id = MakeServiceId(s);
+		for (int c = 0; c < characteristicCount; ++c)
+		{
+			service.characteristics.push_back(MakeCharacteristicId(s, c));
+		}
+		device.services.push_back(std::move(service));
+	}
+	return device;
+}
+
+BLEUtils::Uuid FakeBluetooth::MakeServiceId(int index)
+{
+	return BLEUtils::Uuid(0x6E400001u + ((std::uint32_t)index << 16), 0xB5A3, 0xF393, 0xE0A9E50E24DCCA9Eull);
+}
+
+BLEUtils::Uuid FakeBluetooth::MakeCharacteristicId(int serviceIndex, int index)
+{
+	return BLEUtils::Uuid(0x6E400002u + ((std::uint32_t)serviceIndex << 16) + (std::uint32_t)index, 0xB5A3, 0xF393, 0xE0A9E50E24DCCA9Eull);
+}
+
+void FakeBluetooth::AddDevice(const Device& device)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	devices.push_back(device);
+}
+
+void FakeBluetooth::RemoveDevice(const BLEUtils::Uuid& containerId)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	devices.erase(std::remove_if(devices.begin(), devices.end(), [&](const Device& device) { return device.containerId == containerId; }), devices.end());
+}
+
+void FakeBluetooth::UpdateDevice(const Device& device)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	for (auto& existing : devices)
+	{
+		if (existing.containerId == device.containerId)
+		{
+			existing = device;
+		}
+	}
+}
+
+void FakeBluetooth::Reset()
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	devices.clear();
+	openLatency = std::chrono::microseconds(0);
+	writeLatency = std::chrono::microseconds(0);
+	acknowledgeLatency = std::chrono::microseconds(0);
+	counters = Counters{};
+}
+
+void FakeBluetooth::SetOpenLatency(std::chrono::microseconds latency)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	openLatency = latency;
+}
+
+void FakeBluetooth::SetWriteLatency(std::chrono::microseconds latency)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	writeLatency = latency;
+}
+
+void FakeBluetooth::SetAcknowledgeLatency(std::chrono::microseconds latency)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	acknowledgeLatency = latency;
+}
+
+FakeBluetooth::Counters FakeBluetooth::GetCounters()
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	return counters;
+}
+
+void FakeBluetooth::ResetCounters()
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	counters = Counters{};
+}
+
+// --------------------------------------------------------------------------
+// Device paths end with the service's position in openableServices, see SetupDiGetDeviceInstanceId()
+// --------------------------------------------------------------------------
+HANDLE FakeBluetooth::OpenService(const std::string& path)
+{
+	std::chrono::microseconds latency;
+	size_t index = 0;
+	bool found = false;
+	{
+		const std::lock_guard<std::mutex> lock{ mutex };
+		latency = openLatency;
+		auto start = path.find("#FAKE#");
+		if (start != std::string::npos)
+		{
+			index = (size_t)strtoul(path.c_str() + start + 6, nullptr, 10);
+			size_t serviceIndex;
+			found = index < openableServices.size() && FindService((HANDLE)(index + 1), serviceIndex) != nullptr;
+			++counters.opens;
+		}
+	}
+	std::this_thread::sleep_for(latency);
+
+	if (!found)
+	{
+		SetLastError(ERROR_NOT_FOUND);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)(index + 1);
+}
+
+BOOL FakeBluetooth::CloseService(HANDLE handle)
+{
+	return IsServiceHandle(handle);
+}
+
+bool FakeBluetooth::IsServiceHandle(HANDLE handle)
+{
+	return handle != NULL && (size_t)handle < MaxServiceHandle;
+}
+
+// --------------------------------------------------------------------------
+// SetupDi, the list is a copy of the devices present when it is requested
+// --------------------------------------------------------------------------
+HDEVINFO SetupDiGetClassDevs(const GUID*, LPCWSTR, void*, DWORD)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	auto list = new DeviceList();
+	for (const auto& device : devices)
+	{
+		std::string mac = BLEUtils::UuidToString(device.containerId).substr(24);
+		list->entries.push_back({ ToWide("BTHLE\\Dev_" + mac), Braced(device.containerId), ToWide(device.name), ToWide("BTHLE\\DEV_" + mac) });
+		for (const auto& service : device.services)
+		{
+			size_t index = OpenableServiceIndex(device.containerId, service.id);
+			list->entries.push_back({ ToWide("BTHLEDevice\\") + Braced(service.id) + ToWide("_Dev_VID&0001_PID&0001"),
+				Braced(device.containerId), ToWide("Service"), ToWide("BTHLEDEVICE\\FAKE\\" + std::to_string(index)) });
+		}
+	}
+	return list;
+}
+
+BOOL SetupDiEnumDeviceInfo(HDEVINFO devInfo, DWORD index, PSP_DEVINFO_DATA devInfoData)
+{
+	auto list = (DeviceList*)devInfo;
+	if (index >= list->entries.size())
+	{
+		SetLastError(ERROR_NO_MORE_ITEMS);
+		return FALSE;
+	}
+	devInfoData->DevInst = index;
+	return TRUE;
+}
+
+BOOL SetupDiGetDeviceRegistryProperty(HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, DWORD property, DWORD* regDataType, PBYTE buffer, DWORD size, DWORD* requiredSize)
+{
+	const auto& entry = ((DeviceList*)devInfo)->entries[devInfoData->DevInst];
+	if (regDataType != nullptr)
+	{
+		*regDataType = 0;
+	}
+	switch (property)
+	{
+	case SPDRP_HARDWAREID:
+		return CopyString(entry.hardwareId, 1, buffer, size, requiredSize);
+	case SPDRP_BASE_CONTAINERID:
+		return CopyString(entry.containerId, 0, buffer, size, requiredSize);
+	case SPDRP_FRIENDLYNAME:
+	case SPDRP_DEVICEDESC:
+		return CopyString(entry.name, 0, buffer, size, requiredSize);
+	default:
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+}
+
+BOOL SetupDiGetDeviceInstanceId(HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, LPTSTR buffer, DWORD size, DWORD* requiredSize)
+{
+	const auto& entry = ((DeviceList*)devInfo)->entries[devInfoData->DevInst];
+	DWORD required = (DWORD)entry.instanceId.size() + 1;
+	if (requiredSize != nullptr)
+	{
+		*requiredSize = required;
+	}
+	if (buffer == nullptr || size < required)
+	{
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+	memcpy(buffer, entry.instanceId.c_str(), required * sizeof(wchar_t));
+	return TRUE;
+}
+
+BOOL SetupDiGetDeviceInterfaceDetail(HDEVINFO, PSP_DEVICE_INTERFACE_DATA, PSP_DEVICE_INTERFACE_DETAIL_DATA, DWORD, DWORD*, PSP_DEVINFO_DATA)
+{
+	SetLastError(ERROR_NOT_FOUND);
+	return FALSE;
+}
+
+BOOL SetupDiDestroyDeviceInfoList(HDEVINFO devInfo)
+{
+	delete (DeviceList*)devInfo;
+	return TRUE;
+}
+
+// --------------------------------------------------------------------------
+// GATT, a service handle only sees its own service
+// --------------------------------------------------------------------------
+HRESULT BluetoothGATTGetServices(HANDLE device, USHORT count, PBTH_LE_GATT_SERVICE services, USHORT* actualCount, ULONG)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	++counters.serviceQueries;
+	size_t serviceIndex;
+	auto service = FindService(device, serviceIndex);
+	if (service == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	*actualCount = 1;
+	if (count < 1 || services == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_MORE_DATA);
+	}
+	services[0].ServiceUuid = BLEUtils::UuidToBTHLEUUID(service->id);
+	services[0].AttributeHandle = ServiceAttributeHandle(serviceIndex);
+	return S_OK;
+}
+
+HRESULT BluetoothGATTGetCharacteristics(HANDLE device, PBTH_LE_GATT_SERVICE, USHORT count, PBTH_LE_GATT_CHARACTERISTIC characteristics, USHORT* actualCount, ULONG)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	++counters.characteristicQueries;
+	size_t serviceIndex;
+	auto service = FindService(device, serviceIndex);
+	if (service == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	*actualCount = (USHORT)service->characteristics.size();
+	if (count < service->characteristics.size() || (characteristics == nullptr && !service->characteristics.empty()))
+	{
+		return HRESULT_FROM_WIN32(ERROR_MORE_DATA);
+	}
+	for (size_t i = 0; i < service->characteristics.size(); ++i)
+	{
+		characteristics[i] = MakeCharacteristic(serviceIndex, i, service->characteristics[i]);
+	}
+	return S_OK;
+}
+
+HRESULT BluetoothGATTGetDescriptors(HANDLE device, PBTH_LE_GATT_CHARACTERISTIC characteristic, USHORT count, PBTH_LE_GATT_DESCRIPTOR descriptors, USHORT* actualCount, ULONG)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	size_t serviceIndex;
+	if (FindService(device, serviceIndex) == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	*actualCount = 1;
+	if (count < 1 || descriptors == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_MORE_DATA);
+	}
+	BTH_LE_GATT_DESCRIPTOR& clientConfig = descriptors[0];
+	clientConfig = {};
+	clientConfig.ServiceHandle = characteristic->ServiceHandle;
+	clientConfig.CharacteristicHandle = characteristic->AttributeHandle;
+	clientConfig.DescriptorType = ClientCharacteristicConfiguration;
+	clientConfig.DescriptorUuid.IsShortUuid = TRUE;
+	clientConfig.DescriptorUuid.Value.ShortUuid = 0x2902;
+	clientConfig.AttributeHandle = (USHORT)(characteristic->AttributeHandle + 2);
+	return S_OK;
+}
+
+HRESULT BluetoothGATTGetCharacteristicValue(HANDLE device, PBTH_LE_GATT_CHARACTERISTIC, ULONG size, PBTH_LE_GATT_CHARACTERISTIC_VALUE value, USHORT* requiredSize, ULONG)
+{
+	static const UCHAR data[] = { 1, 2, 3, 4 };
+
+	const std::lock_guard<std::mutex> lock{ mutex };
+	size_t serviceIndex;
+	if (FindService(device, serviceIndex) == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	USHORT required = (USHORT)(offsetof(BTH_LE_GATT_CHARACTERISTIC_VALUE, Data) + sizeof(data));
+	if (requiredSize != nullptr)
+	{
+		*requiredSize = required;
+	}
+	if (value == nullptr || size < required)
+	{
+		return HRESULT_FROM_WIN32(ERROR_MORE_DATA);
+	}
+	++counters.reads;
+	value->DataSize = sizeof(data);
+	memcpy(value->Data, data, sizeof(data));
+	return S_OK;
+}
+
+HRESULT BluetoothGATTGetDescriptorValue(HANDLE device, PBTH_LE_GATT_DESCRIPTOR descriptor, ULONG size, PBTH_LE_GATT_DESCRIPTOR_VALUE value, USHORT* requiredSize, ULONG)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	size_t serviceIndex;
+	if (FindService(device, serviceIndex) == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	USHORT required = (USHORT)(offsetof(BTH_LE_GATT_DESCRIPTOR_VALUE, Data) + 2);
+	if (requiredSize != nullptr)
+	{
+		*requiredSize = required;
+	}
+	if (value == nullptr || size < required)
+	{
+		return HRESULT_FROM_WIN32(ERROR_MORE_DATA);
+	}
+	memset(value, 0, required);
+	value->DescriptorType = descriptor->DescriptorType;
+	value->DescriptorUuid = descriptor->DescriptorUuid;
+	value->DataSize = 2;
+	return S_OK;
+}
+
+HRESULT BluetoothGATTSetCharacteristicValue(HANDLE device, PBTH_LE_GATT_CHARACTERISTIC, PBTH_LE_GATT_CHARACTERISTIC_VALUE value, BTH_LE_GATT_RELIABLE_WRITE_CONTEXT, ULONG flags)
+{
+	std::chrono::microseconds latency;
+	{
+		const std::lock_guard<std::mutex> lock{ mutex };
+		size_t serviceIndex;
+		if (FindService(device, serviceIndex) == nullptr)
+		{
+			return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+		}
+		++counters.writes;
+		counters.bytesWritten += value->DataSize;
+		latency = writeLatency;
+		if ((flags & BLUETOOTH_GATT_FLAG_WRITE_WITHOUT_RESPONSE) == 0)
+		{
+			++counters.acknowledgedWrites;
+			latency += acknowledgeLatency;
+		}
+	}
+	std::this_thread::sleep_for(latency);
+	return S_OK;
+}
+
+HRESULT BluetoothGATTSetDescriptorValue(HANDLE device, PBTH_LE_GATT_DESCRIPTOR, PBTH_LE_GATT_DESCRIPTOR_VALUE, ULONG)
+{
+	const std::lock_guard<std::mutex> lock{ mutex };
+	size_t serviceIndex;
+	return FindService(device, serviceIndex) != nullptr ? S_OK : HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+}
+
+// --------------------------------------------------------------------------
+// Notifications are accepted but never sent
+// --------------------------------------------------------------------------
+HRESULT BluetoothGATTRegisterEvent(HANDLE service, BTH_LE_GATT_EVENT_TYPE, PVOID, PFNBLUETOOTH_GATT_EVENT_CALLBACK, PVOID, BLUETOOTH_GATT_EVENT_HANDLE* eventHandle, ULONG)
+{
+	static std::atomic<std::uintptr_t> nextEventHandle{ 1 };
+
+	const std::lock_guard<std::mutex> lock{ mutex };
+	size_t serviceIndex;
+	if (FindService(service, serviceIndex) == nullptr)
+	{
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	*eventHandle = (BLUETOOTH_GATT_EVENT_HANDLE)nextEventHandle.fetch_add(1);
+	return S_OK;
+}
+
+HRESULT BluetoothGATTUnregisterEvent(BLUETOOTH_GATT_EVENT_HANDLE, ULONG)
+{
+	return S_OK;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <windows.h>
+#include <bluetoothleapis.h>
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+// --------------------------------------------------------------------------
+// Simulated Bluetooth LE devices behind the SetupDi and GATT functions of the
+// compatibility headers.
+//
+// Each device shows up in the SetupDi list as a "BTHLE\" entry followed by a
+// "BTHLEDevice\" entry per service, like real ones. Opening the path of a
+// service gives a handle on which the GATT functions work, until the device
+// is removed. Writes can be given a latency to simulate the radio, those with
+// response an additional one for the round trip to the device.
+// --------------------------------------------------------------------------
+namespace FakeBluetooth
+{
+	struct Service
+	{
+		BLEUtils::Uuid id;
+		std::vector<BLEUtils::Uuid> characteristics;
+	};
+
+	struct Device
+	{
+		BLEUtils::Uuid containerId;
+		std::string name;
+		std::vector<Service> services;
+	};
+
+	struct Counters
+	{
+		size_t opens;
+		size_t serviceQueries;
+		size_t characteristicQueries;
+		size_t reads;
+		size_t writes;
+		size_t acknowledgedWrites;
+		size_t bytesWritten;
+	};
+
+	// A device with ids derived from index, its services have the ids of MakeServiceId(0) onwards
+	Device MakeDevice(int index, int serviceCount = 1, int characteristicCount = 4);
+	BLEUtils::Uuid MakeServiceId(int index);
+	BLEUtils::Uuid MakeCharacteristicId(int serviceIndex, int index);
+
+	void AddDevice(const Device& device);
+	void RemoveDevice(const BLEUtils::Uuid& containerId);
+
+	// Replaces the services the device reports from now on, as a firmware update would
+	void UpdateDevice(const Device& device);
+
+	// Removes the devices and clears the latencies and the counters
+	void Reset();
+
+	void SetOpenLatency(std::chrono::microseconds latency);
+	void SetWriteLatency(std::chrono::microseconds latency);
+	void SetAcknowledgeLatency(std::chrono::microseconds latency); // Added to the writes with response
+
+	Counters GetCounters();
+	void ResetCounters();
+
+	// Used by CreateFile() and CloseHandle() for device paths
+	HANDLE OpenService(const std::string& path);
+	BOOL CloseService(HANDLE handle);
+	bool IsServiceHandle(HANDLE handle);
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "DeviceSource.h"
+#include "DeviceRegistry.h"
+#include "FakeBluetooth.h"
+
+// --------------------------------------------------------------------------
+// Device source listing simulated devices without going through SetupDi.
+// Each entry can take some time to enumerate, like on a system with many
+// paired devices, and enumerations can be held until released to check what
+// happens while a scan is in progress.
+// --------------------------------------------------------------------------
+class FakeDeviceSource : public BLEDeviceSource
+{
+public:
+	FakeDeviceSource() : _entryLatency(0), _held(false), _enumerating(0), _enumerations(0) {}
+
+	void SetDevices(std::vector<FakeBluetooth::Device> devices)
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_devices = std::move(devices);
+	}
+
+	void SetEntryLatency(std::chrono::microseconds latency)
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_entryLatency = latency;
+	}
+
+	// Enumerations started while held wait before listing anything
+	void Hold()
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_held = true;
+	}
+
+	void Release()
+	{
+		{
+			const std::lock_guard<std::mutex> lock{ _mutex };
+			_held = false;
+		}
+		_changed.notify_all();
+	}
+
+	// Waits until an enumeration is waiting to be released, returns false on timeout
+	bool WaitUntilHeld(std::chrono::milliseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock{ _mutex };
+		return _changed.wait_for(lock, timeout, [this]() { return _enumerating > 0; });
+	}
+
+	// Waits until count enumerations completed, returns false on timeout
+	bool WaitForEnumerations(int count, std::chrono::milliseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock{ _mutex };
+		return _changed.wait_for(lock, timeout, [this, count]() { return _enumerations >= count; });
+	}
+
+	int Enumerations()
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		return _enumerations;
+	}
+
+	bool Enumerate(const BLERegistrySnapshot& known, BLEScanResult& result, BLEScanObserver* observer) override
+	{
+		std::vector<FakeBluetooth::Device> devices;
+		std::chrono::microseconds entryLatency;
+		{
+			std::unique_lock<std::mutex> lock{ _mutex };
+			++_enumerating;
+			_changed.notify_all();
+			_changed.wait(lock, [this]() { return !_held; });
+			--_enumerating;
+			devices = _devices;
+			entryLatency = _entryLatency;
+		}
+
+		for (const auto& device : devices)
+		{
+			std::this_thread::sleep_for(entryLatency);
+			result.devices.push_back({ device.containerId, device.name });
+			if (observer != nullptr)
+			{
+				observer->DeviceFound(result.devices.back());
+			}
+
+			for (const auto& service : device.services)
+			{
+				std::this_thread::sleep_for(entryLatency);
+				BLEScanResult::Service entry;
+				entry.containerId = device.containerId;
+				entry.id = service.id;
+				entry.hasDetails = known.FindService(device.containerId, service.id) == nullptr;
+				if (entry.hasDetails)
+				{
+					entry.name = "Service";
+					entry.path = "\\\\?\\BTHLEDEVICE#SIMULATED#" + BLEUtils::UuidToString(service.id);
+				}
+				result.services.push_back(std::move(entry));
+				if (observer != nullptr)
+				{
+					observer->ServiceFound(result.services.back());
+				}
+			}
+		}
+
+		{
+			const std::lock_guard<std::mutex> lock{ _mutex };
+			++_enumerations;
+		}
+		_changed.notify_all();
+		return true;
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::vector<FakeBluetooth::Device> _devices;
+	std::chrono::microseconds _entryLatency;
+	bool _held;
+	int _enumerating;
+	int _enumerations;
+};
@@ -0,0 +1,331 @@
+#include <windows.h>
+#include <devguid.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "FakeBluetooth.h"
+
+// --------------------------------------------------------------------------
+// The Windows functions the library uses besides Bluetooth, implemented on
+// top of POSIX. Files are real files, so the GATT cache can be tested with
+// its file. Paths starting with "\\?\" are device paths and are opened by
+// FakeBluetooth instead.
+// --------------------------------------------------------------------------
+
+const GUID GUID_DEVCLASS_BLUETOOTH = { 0xe0cbf06c, 0xcd8b, 0x4647, { 0xbb, 0x8a, 0x26, 0x3b, 0x43, 0xf0, 0xf9, 0x74 } };
+
+static thread_local DWORD lastError = 0;
+
+DWORD GetLastError()
+{
+	return lastError;
+}
+
+void SetLastError(DWORD error)
+{
+	lastError = error;
+}
+
+DWORD GetCurrentThreadId()
+{
+	return (DWORD)std::hash<std::thread::id>()(std::this_thread::get_id());
+}
+
+void Sleep(DWORD milliseconds)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+DWORD FormatMessage(DWORD, const void*, DWORD messageId, DWORD, LPWSTR buffer, DWORD size, void*)
+{
+	char message[32];
+	int length = snprintf(message, sizeof(message), "Error %u", messageId);
+	DWORD i = 0;
+	for (; i + 1 < size && i < (DWORD)length; ++i)
+	{
+		buffer[i] = message[i];
+	}
+	if (size > 0)
+	{
+		buffer[i] = 0;
+	}
+	return i;
+}
+
+// --------------------------------------------------------------------------
+// Files and their mappings, handles point to a FileHandle
+// --------------------------------------------------------------------------
+struct FileHandle
+{
+	int fd;
+	bool mapping;
+};
+
+static std::mutex viewsMutex;
+static std::unordered_map<const void*, size_t> viewSizes;
+
+static std::string ToPath(LPCWSTR path)
+{
+	std::string ret;
+	for (; *path != 0; ++path)
+	{
+		ret.push_back((char)*path);
+	}
+	return ret;
+}
+
+static FileHandle* ToFile(HANDLE handle)
+{
+	return FakeBluetooth::IsServiceHandle(handle) || handle == INVALID_HANDLE_VALUE ? nullptr : (FileHandle*)handle;
+}
+
+HANDLE CreateFile(LPCWSTR fileName, DWORD access, DWORD, void*, DWORD creation, DWORD, HANDLE)
+{
+	std::string path = ToPath(fileName);
+	if (path.compare(0, 4, "\\\\?\\") == 0)
+	{
+		return FakeBluetooth::OpenService(path);
+	}
+
+	int flags = (access & GENERIC_WRITE) != 0 ? ((access & GENERIC_READ) != 0 ? O_RDWR : O_WRONLY) : O_RDONLY;
+	if (creation == CREATE_ALWAYS)
+	{
+		flags |= O_CREAT | O_TRUNC;
+	}
+	else if (creation == OPEN_ALWAYS)
+	{
+		flags |= O_CREAT;
+	}
+	int fd = open(path.c_str(), flags, 0644);
+	if (fd < 0)
+	{
+		SetLastError(ERROR_NOT_FOUND);
+		return INVALID_HANDLE_VALUE;
+	}
+	return new FileHandle{ fd, false };
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+	if (FakeBluetooth::IsServiceHandle(handle))
+	{
+		return FakeBluetooth::CloseService(handle);
+	}
+
+	FileHandle* file = ToFile(handle);
+	if (file == nullptr)
+	{
+		return FALSE;
+	}
+	if (!file->mapping)
+	{
+		close(file->fd);
+	}
+	delete file;
+	return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE handle, LARGE_INTEGER* size)
+{
+	FileHandle* file = ToFile(handle);
+	struct stat info;
+	if (file == nullptr || fstat(file->fd, &info) != 0)
+	{
+		return FALSE;
+	}
+	size->QuadPart = info.st_size;
+	return TRUE;
+}
+
+BOOL WriteFile(HANDLE handle, const void* buffer, DWORD size, DWORD* written, void*)
+{
+	FileHandle* file = ToFile(handle);
+	ssize_t count = file != nullptr ? write(file->fd, buffer, size) : -1;
+	*written = count > 0 ? (DWORD)count : 0;
+	return count == (ssize_t)size;
+}
+
+BOOL MoveFileEx(LPCWSTR existingFileName, LPCWSTR newFileName, DWORD)
+{
+	return rename(ToPath(existingFileName).c_str(), ToPath(newFileName).c_str()) == 0;
+}
+
+BOOL DeleteFile(LPCWSTR fileName)
+{
+	return unlink(ToPath(fileName).c_str()) == 0;
+}
+
+HANDLE CreateFileMapping(HANDLE handle, void*, DWORD, DWORD, DWORD, LPCWSTR)
+{
+	FileHandle* file = ToFile(handle);
+	return file != nullptr ? new FileHandle{ file->fd, true } : NULL;
+}
+
+void* MapViewOfFile(HANDLE handle, DWORD, DWORD, DWORD, size_t)
+{
+	FileHandle* mapping = ToFile(handle);
+	struct stat info;
+	if (mapping == nullptr || fstat(mapping->fd, &info) != 0 || info.st_size == 0)
+	{
+		return nullptr;
+	}
+
+	void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, mapping->fd, 0);
+	if (view == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	const std::lock_guard<std::mutex> lock{ viewsMutex };
+	viewSizes[view] = (size_t)info.st_size;
+	return view;
+}
+
+BOOL UnmapViewOfFile(const void* address)
+{
+	const std::lock_guard<std::mutex> lock{ viewsMutex };
+	auto view = viewSizes.find(address);
+	if (view == viewSizes.end())
+	{
+		return FALSE;
+	}
+	munmap(const_cast<void*>(address), view->second);
+	viewSizes.erase(view);
+	return TRUE;
+}
+
+// --------------------------------------------------------------------------
+// Threads, their settings are accepted and ignored
+// --------------------------------------------------------------------------
+HANDLE GetCurrentThread()
+{
+	return NULL;
+}
+
+HANDLE GetCurrentProcess()
+{
+	return NULL;
+}
+
+BOOL SetThreadPriority(HANDLE, int)
+{
+	return TRUE;
+}
+
+DWORD_PTR SetThreadAffinityMask(HANDLE, DWORD_PTR)
+{
+	return 1;
+}
+
+BOOL GetProcessAffinityMask(HANDLE, DWORD_PTR* processMask, DWORD_PTR* systemMask)
+{
+	*processMask = 1;
+	*systemMask = 1;
+	return TRUE;
+}
+
+// --------------------------------------------------------------------------
+// Parses "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}"
+// --------------------------------------------------------------------------
+HRESULT CLSIDFromString(LPCWSTR string, GUID* guid)
+{
+	std::string narrow = ToPath(string);
+	unsigned int d[11];
+	int end = 0;
+	if (sscanf(narrow.c_str(), "{%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x}%n",
+		&d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7], &d[8], &d[9], &d[10], &end) != 11 || end != 38 || narrow.size() != 38)
+	{
+		memset(guid, 0, sizeof(GUID));
+		return E_INVALIDARG;
+	}
+	guid->Data1 = d[0];
+	guid->Data2 = (unsigned short)d[1];
+	guid->Data3 = (unsigned short)d[2];
+	for (int i = 0; i < 8; ++i)
+	{
+		guid->Data4[i] = (unsigned char)d[3 + i];
+	}
+	return S_OK;
+}
+
+// --------------------------------------------------------------------------
+// With -fshort-wchar the C library wide string functions, which work on
+// 4 byte characters, don't match our wchar_t anymore. These replace the ones
+// the library and std::wstring use.
+// --------------------------------------------------------------------------
+extern "C"
+{
+	size_t wcslen(const wchar_t* s) noexcept
+	{
+		const wchar_t* p = s;
+		while (*p != 0)
+		{
+			++p;
+		}
+		return p - s;
+	}
+
+	size_t wcsnlen(const wchar_t* s, size_t maxLength) noexcept
+	{
+		size_t length = 0;
+		while (length < maxLength && s[length] != 0)
+		{
+			++length;
+		}
+		return length;
+	}
+
+	int wmemcmp(const wchar_t* a, const wchar_t* b, size_t count) noexcept
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (a[i] != b[i])
+			{
+				return a[i] < b[i] ? -1 : 1;
+			}
+		}
+		return 0;
+	}
+
+	// Declared as two C++ overloads by the C library headers, defined under its C name
+	wchar_t* ShortWmemchr(const wchar_t* s, wchar_t c, size_t count) noexcept __asm__("wmemchr");
+	wchar_t* ShortWmemchr(const wchar_t* s, wchar_t c, size_t count) noexcept
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (s[i] == c)
+			{
+				return const_cast<wchar_t*>(s + i);
+			}
+		}
+		return nullptr;
+	}
+
+	wchar_t* wmemcpy(wchar_t* dst, const wchar_t* src, size_t count) noexcept
+	{
+		return (wchar_t*)memcpy(dst, src, count * sizeof(wchar_t));
+	}
+
+	wchar_t* wmemmove(wchar_t* dst, const wchar_t* src, size_t count) noexcept
+	{
+		return (wchar_t*)memmove(dst, src, count * sizeof(wchar_t));
+	}
+
+	wchar_t* wmemset(wchar_t* dst, wchar_t c, size_t count) noexcept
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			dst[i] = c;
+		}
+		return dst;
+	}
+}
@@ -0,0 +1,320 @@
+#include <windows.h>
+#include <bluetoothleapis.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "Check.h"
+#include "CommandQueue.h"
+#include "DiceBLEWin.h"
+#include "FakeBluetooth.h"
+#include "GattCache.h"
+#include "SimulatedLibrary.h"
+#include "SimulatedRegistry.h"
+
+// --------------------------------------------------------------------------
+// BLEGattCache on its own: the binary format through Attach() and Serialize(),
+// invalidation, and loading a file written by Flush(). Then through the
+// library: reconnecting uses the cache, which is checked against the device
+// on the device's strand, and a device whose table changed is reconnected.
+// --------------------------------------------------------------------------
+
+extern BLECommandQueue commandQueue;
+
+using namespace std::chrono;
+
+static const BLEUtils::Uuid DeviceId(0xD1CE0000, 1, 0x4000, 0x8000000000000000);
+static const std::uint64_t Fingerprint = 0x0123456789ABCDEF;
+
+static std::uint32_t Read32(const std::vector<std::uint8_t>& data, size_t offset)
+{
+	return data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16) | ((std::uint32_t)data[offset + 3] << 24);
+}
+
+static BLEGattCache::Service MakeService(int serviceIndex, int characteristicCount, bool withDescriptors)
+{
+	FakeBluetooth::Service fake{ FakeBluetooth::MakeServiceId(serviceIndex), {} };
+	for (int i = 0; i < characteristicCount; ++i)
+	{
+		fake.characteristics.push_back(FakeBluetooth::MakeCharacteristicId(serviceIndex, i));
+	}
+
+	BLEGattCache::Service service;
+	service.gattService.ServiceUuid = BLEUtils::UuidToBTHLEUUID(fake.id);
+	service.gattService.AttributeHandle = 1;
+	service.characteristics = SimulatedCharacteristics(fake);
+	if (withDescriptors)
+	{
+		for (const auto& characteristic : service.characteristics)
+		{
+			BTH_LE_GATT_DESCRIPTOR descriptor = {};
+			descriptor.ServiceHandle = 1;
+			descriptor.CharacteristicHandle = characteristic.AttributeHandle;
+			descriptor.DescriptorType = ClientCharacteristicConfiguration;
+			descriptor.DescriptorUuid = BLEUtils::UuidToBTHLEUUID(BLEUtils::Uuid::FromShortId(0x2902));
+			descriptor.AttributeHandle = (USHORT)(characteristic.CharacteristicValueHandle + 1);
+			service.descriptors.push_back({ descriptor });
+		}
+	}
+	return service;
+}
+
+// The layout documented in GattCache.h, and the checks made when attaching
+static void TestFormat()
+{
+	BLEGattCache cache;
+	auto first = MakeService(0, 4, true);
+	auto second = MakeService(1, 2, false);
+	cache.Store(DeviceId, Fingerprint, first);
+	cache.Store(DeviceId, Fingerprint, second);
+
+	std::vector<std::uint8_t> data;
+	cache.Serialize(data);
+	CHECK(data.size() > 16);
+	CHECK(Read32(data, 0) == BLEGattCache::Magic);
+	CHECK((data[4] | (data[5] << 8)) == BLEGattCache::Version);
+	CHECK(Read32(data, 8) == 1);
+	std::uint32_t hash = 2166136261u;
+	for (size_t i = 16; i < data.size(); ++i)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	CHECK(Read32(data, 12) == hash);
+
+	// Table header: container id, fingerprint, size of the rest of the file, 2 services
+	CHECK(Read32(data, 16 + 16 + 8) == data.size() - 16);
+	CHECK((data[16 + 16 + 8 + 4] | (data[16 + 16 + 8 + 5] << 8)) == 2);
+
+	BLEGattCache attached;
+	CHECK(attached.Attach(data.data(), data.size()));
+	BLEGattCache::Service found;
+	CHECK(attached.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(BLEGattCache::SameLayout(found, first));
+	CHECK(found.descriptors.size() == first.descriptors.size());
+	if (found.descriptors.size() == first.descriptors.size() && !found.descriptors.empty())
+	{
+		CHECK(found.descriptors[3].size() == 1);
+		CHECK(found.descriptors[3][0].AttributeHandle == first.descriptors[3][0].AttributeHandle);
+		CHECK(found.descriptors[3][0].DescriptorType == ClientCharacteristicConfiguration);
+	}
+	CHECK(attached.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(1), found));
+	CHECK(BLEGattCache::SameLayout(found, second));
+	CHECK(found.descriptors.empty() || found.descriptors[0].empty());
+
+	// Misses: other fingerprint, device or service
+	CHECK(!attached.Find(DeviceId, Fingerprint + 1, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(!attached.Find(BLEUtils::Uuid(1, 2), Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(!attached.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(2), found));
+
+	// Serializing what was attached gives the same bytes
+	std::vector<std::uint8_t> again;
+	attached.Serialize(again);
+	CHECK(again == data);
+
+	// Corrupted, truncated or of another version
+	auto corrupted = data;
+	corrupted[corrupted.size() / 2] ^= 0x10;
+	CHECK(!BLEGattCache().Attach(corrupted.data(), corrupted.size()));
+	CHECK(!BLEGattCache().Attach(data.data(), data.size() - 1));
+	CHECK(!BLEGattCache().Attach(data.data(), 10));
+	auto otherVersion = data;
+	otherVersion[4] = BLEGattCache::Version + 1;
+	CHECK(!BLEGattCache().Attach(otherVersion.data(), otherVersion.size()));
+}
+
+// Invalidated devices and outdated fingerprints miss, also once serialized
+static void TestInvalidation()
+{
+	BLEGattCache cache;
+	BLEUtils::Uuid otherDevice(0xD1CE0001, 1, 0x4000, 0x8000000000000001);
+	cache.Store(DeviceId, Fingerprint, MakeService(0, 4, false));
+	cache.Store(DeviceId, Fingerprint, MakeService(1, 4, false));
+	cache.Store(otherDevice, Fingerprint, MakeService(0, 4, false));
+
+	std::vector<std::uint8_t> data;
+	cache.Serialize(data);
+	BLEGattCache attached;
+	CHECK(attached.Attach(data.data(), data.size()));
+
+	BLEGattCache::Service found;
+	attached.Invalidate(DeviceId);
+	CHECK(!attached.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(attached.Find(otherDevice, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+
+	// A new set of services drops the device's other services
+	attached.Store(otherDevice, Fingerprint + 1, MakeService(1, 4, false));
+	CHECK(!attached.Find(otherDevice, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(!attached.Find(otherDevice, Fingerprint + 1, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(attached.Find(otherDevice, Fingerprint + 1, FakeBluetooth::MakeServiceId(1), found));
+
+	std::vector<std::uint8_t> changed;
+	attached.Serialize(changed);
+	BLEGattCache reloaded;
+	CHECK(reloaded.Attach(changed.data(), changed.size()));
+	CHECK(!reloaded.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(1), found));
+	CHECK(reloaded.Find(otherDevice, Fingerprint + 1, FakeBluetooth::MakeServiceId(1), found));
+	CHECK(Read32(changed, 8) == 1);
+}
+
+// A flushed file is loaded by the next cache opening it
+static void TestLoad(const std::string& path)
+{
+	std::wstring widePath = BLEUtils::ToWide(path.c_str());
+	{
+		BLEGattCache cache;
+		CHECK(!cache.Open(widePath));
+		CHECK(cache.IsOpen());
+		cache.Store(DeviceId, Fingerprint, MakeService(0, 4, true));
+		CHECK(cache.Flush());
+	}
+
+	BLEGattCache cache;
+	CHECK(cache.Open(widePath));
+	BLEGattCache::Service found;
+	CHECK(cache.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+	CHECK(BLEGattCache::SameLayout(found, MakeService(0, 4, false)));
+
+	// Changes are only written by Flush(), replacing the mapped file
+	cache.Invalidate(DeviceId);
+	CHECK(cache.Open(widePath));
+	CHECK(cache.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+	cache.Invalidate(DeviceId);
+	CHECK(cache.Flush());
+	CHECK(cache.Open(widePath));
+	CHECK(!cache.Find(DeviceId, Fingerprint, FakeBluetooth::MakeServiceId(0), found));
+
+	// A file that isn't a cache is ignored
+	FILE* file = fopen(path.c_str(), "wb");
+	fputs("not a cache", file);
+	fclose(file);
+	CHECK(!cache.Open(widePath));
+	unlink(path.c_str());
+}
+
+// Holds the commands of a device until released
+class StrandBlocker
+{
+public:
+	explicit StrandBlocker(const BLEUtils::Uuid& device) : _entered(false), _released(false)
+	{
+		commandQueue.Enqueue(device, [this](int)
+		{
+			std::unique_lock<std::mutex> lock{ _mutex };
+			_entered = true;
+			_changed.notify_all();
+			_changed.wait(lock, [this]() { return _released; });
+		});
+		std::unique_lock<std::mutex> lock{ _mutex };
+		CHECK(_changed.wait_for(lock, seconds(5), [this]() { return _entered; }));
+	}
+
+	void Release()
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		_released = true;
+		_changed.notify_all();
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	bool _entered;
+	bool _released;
+};
+
+static size_t CharacteristicCount(const FakeBluetooth::Device& device)
+{
+	auto snapshot = registry.Read();
+	auto cservice = snapshot->FindConnectedService(device.containerId, device.services[0].id);
+	return cservice != nullptr ? cservice->characteristics.size() : 0;
+}
+
+// Reconnecting uses the cache, the check against the device happens later on the device strand
+static void TestLibrary(const std::string& path)
+{
+	SimulatedLibrary::HookMessages();
+	auto device = FakeBluetooth::MakeDevice(0, 1, 4);
+	std::string address = SimulatedLibrary::AddressOf(device);
+	CHECK(SimulatedLibrary::AddAndScan({ device }));
+	_winBluetoothLESetGattCachePath(path.c_str());
+
+	// First connection discovers the table and disconnecting writes it
+	_winBluetoothLEConnectToPeripheral(address.c_str());
+	CHECK(CharacteristicCount(device) == 4);
+	_winBluetoothLEDisconnectPeripheral(address.c_str());
+	CHECK(access(path.c_str(), F_OK) == 0);
+
+	// The connection comes from the cache, the check waits for the device's earlier commands
+	FakeBluetooth::ResetCounters();
+	{
+		StrandBlocker blocker(device.containerId);
+		_winBluetoothLEConnectToPeripheral(address.c_str());
+		CHECK(CharacteristicCount(device) == 4);
+		CHECK(FakeBluetooth::GetCounters().characteristicQueries == 0);
+		blocker.Release();
+		auto deadline = steady_clock::now() + seconds(5);
+		while (FakeBluetooth::GetCounters().characteristicQueries == 0 && steady_clock::now() < deadline)
+		{
+			std::this_thread::sleep_for(milliseconds(1));
+		}
+		CHECK(FakeBluetooth::GetCounters().characteristicQueries > 0);
+	}
+	// The table matched, the connection is kept
+	std::this_thread::sleep_for(milliseconds(20));
+	CHECK(CharacteristicCount(device) == 4);
+	_winBluetoothLEDisconnectPeripheral(address.c_str());
+
+	// A firmware update changed the table: the cached one is used, found wrong, and the device reconnected
+	auto updated = FakeBluetooth::MakeDevice(0, 1, 5);
+	FakeBluetooth::UpdateDevice(updated);
+	SimulatedLibrary::TakeMessages();
+	{
+		StrandBlocker blocker(device.containerId);
+		_winBluetoothLEConnectToPeripheral(address.c_str());
+		CHECK(CharacteristicCount(device) == 4);
+		blocker.Release();
+	}
+	std::vector<std::string> connections;
+	auto deadline = steady_clock::now() + seconds(5);
+	while (connections.size() < 3 && steady_clock::now() < deadline)
+	{
+		for (const auto& message : SimulatedLibrary::TakeMessages())
+		{
+			if (SimulatedLibrary::StartsWith(message, "DisconnectedPeripheral~") || SimulatedLibrary::StartsWith(message, "ConnectedPeripheral~"))
+			{
+				connections.push_back(message);
+			}
+		}
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+	CHECK(connections == (std::vector<std::string>{ "ConnectedPeripheral~" + address, "DisconnectedPeripheral~" + address, "ConnectedPeripheral~" + address }));
+	CHECK(CharacteristicCount(device) == 5);
+	_winBluetoothLEDisconnectPeripheral(address.c_str());
+
+	// And the cache was updated
+	BLEGattCache cache;
+	CHECK(cache.Open(BLEUtils::ToWide(path.c_str())));
+	BLEGattCache::Service found;
+	CHECK(cache.Find(device.containerId, BLEGattCache::Fingerprint({ device.services[0].id }), device.services[0].id, found));
+	CHECK(found.characteristics.size() == 5);
+
+	_winBluetoothLEDeInitialize();
+	_winBluetoothLESetGattCachePath(nullptr);
+	unlink(path.c_str());
+}
+
+int main()
+{
+	std::string path = "/tmp/GattCacheTests-" + std::to_string(getpid()) + ".bin";
+	TestFormat();
+	TestInvalidation();
+	TestLoad(path);
+	TestLibrary(path);
+	return CheckResult();
+}
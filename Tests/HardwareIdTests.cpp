@@ -0,0 +1,128 @@
+#include <windows.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "Check.h"
+#include "Utils.h"
+
+// --------------------------------------------------------------------------
+// BLEUtils::ParseHardwareId(), on the ids Windows lists and on broken ones
+// --------------------------------------------------------------------------
+
+static BLEUtils::HardwareId Parse(const std::wstring& id)
+{
+	return BLEUtils::ParseHardwareId(id.c_str(), id.size());
+}
+
+static std::wstring Guid(const BLEUtils::HardwareId& id)
+{
+	return id.guid != nullptr ? std::wstring(id.guid, id.guidLength) : std::wstring();
+}
+
+static void TestDevices()
+{
+	auto id = Parse(L"BTHLE\\Dev_d3a1f5e0c2b4");
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Device);
+	CHECK(id.guid == nullptr);
+
+	// Without a MAC, still a device
+	id = Parse(L"BTHLE\\");
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Device);
+	id = Parse(L"BTHLE\\GenericDevice");
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Device);
+}
+
+static void TestServices()
+{
+	const std::wstring uuid = L"{6e400001-b5a3-f393-e0a9-e50e24dcca9e}";
+	auto id = Parse(L"BTHLEDevice\\" + uuid + L"_Dev_VID&02005f_PID&0001_REV&0001_d3a1f5e0c2b4");
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Service);
+	CHECK(Guid(id) == uuid);
+	CHECK(BLEUtils::Uuid::Parse(id.guid, id.guid + id.guidLength) == BLEUtils::Uuid::Parse("6e400001-b5a3-f393-e0a9-e50e24dcca9e"));
+
+	// Short ids are listed expanded, as is
+	id = Parse(L"BTHLEDevice\\{0000180f-0000-1000-8000-00805f9b34fb}_Dev_VID&02005f_PID&0001_REV&0001_d3a1f5e0c2b4");
+	CHECK(BLEUtils::Uuid::Parse(id.guid, id.guid + id.guidLength) == BLEUtils::Uuid::FromShortId(0x180F));
+
+	// Without a MAC
+	id = Parse(L"BTHLEDevice\\" + uuid);
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Service);
+	CHECK(Guid(id) == uuid);
+	id = Parse(L"BTHLEDevice\\" + uuid + L"_Dev_VID&02005f_PID&0001_REV&0001");
+	CHECK(Guid(id) == uuid);
+}
+
+static void TestMalformed()
+{
+	// Not Bluetooth LE, or cut before the prefix is complete
+	CHECK(Parse(L"USB\\VID_045E&PID_0040").kind == BLEUtils::HardwareIdKind::Other);
+	CHECK(Parse(L"BTHENUM\\{00001101-0000-1000-8000-00805f9b34fb}").kind == BLEUtils::HardwareIdKind::Other);
+	CHECK(Parse(L"BTHLE").kind == BLEUtils::HardwareIdKind::Other);
+	CHECK(Parse(L"BTHLEDevice").kind == BLEUtils::HardwareIdKind::Other);
+	CHECK(Parse(L"bthle\\dev_d3a1f5e0c2b4").kind == BLEUtils::HardwareIdKind::Other);
+	CHECK(Parse(L"").kind == BLEUtils::HardwareIdKind::Other);
+	CHECK(BLEUtils::ParseHardwareId(nullptr, 0).kind == BLEUtils::HardwareIdKind::Other);
+
+	// Services without a UUID, or with unbalanced braces
+	auto id = Parse(L"BTHLEDevice\\");
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Service);
+	CHECK(id.guid == nullptr);
+	id = Parse(L"BTHLEDevice\\6e400001-b5a3-f393-e0a9-e50e24dcca9e_Dev_VID&02005f");
+	CHECK(id.guid == nullptr);
+	id = Parse(L"BTHLEDevice\\{6e400001-b5a3-f393-e0a9-e50e24dcca9e_Dev_VID&02005f");
+	CHECK(id.guid == nullptr);
+	id = Parse(L"BTHLEDevice\\}{");
+	CHECK(id.guid == nullptr);
+
+	// Braces around something else, the UUID parser rejects it afterwards
+	id = Parse(L"BTHLEDevice\\{not-a-uuid}_Dev");
+	CHECK(Guid(id) == L"{not-a-uuid}");
+	CHECK(BLEUtils::Uuid::Parse(id.guid, id.guid + id.guidLength).IsNull());
+
+	// The length is what counts, not the terminator
+	const std::wstring truncated = L"BTHLEDevice\\{6e400001-b5a3-f393-e0a9-e50e24dcca9e}";
+	id = BLEUtils::ParseHardwareId(truncated.c_str(), truncated.size() - 1);
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Service);
+	CHECK(id.guid == nullptr);
+	id = BLEUtils::ParseHardwareId(truncated.c_str(), 5);
+	CHECK(id.kind == BLEUtils::HardwareIdKind::Other);
+}
+
+// --------------------------------------------------------------------------
+// Parsing cost for the mix of ids a scan goes through, printed for reference
+// --------------------------------------------------------------------------
+static void Benchmark(int iterations)
+{
+	const std::wstring ids[] =
+	{
+		L"BTHLE\\Dev_d3a1f5e0c2b4",
+		L"BTHLEDevice\\{6e400001-b5a3-f393-e0a9-e50e24dcca9e}_Dev_VID&02005f_PID&0001_REV&0001_d3a1f5e0c2b4",
+		L"BTHLEDevice\\{0000180f-0000-1000-8000-00805f9b34fb}_Dev_VID&02005f_PID&0001_REV&0001_d3a1f5e0c2b4",
+		L"USB\\VID_045E&PID_0040&REV_0300",
+	};
+
+	size_t services = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (const auto& id : ids)
+		{
+			auto parsed = BLEUtils::ParseHardwareId(id.c_str(), id.size());
+			services += parsed.guidLength;
+		}
+	}
+	double seconds = SecondsSince(start);
+	CHECK(services == (size_t)iterations * 76);
+	printf("ParseHardwareId: %.1f ns per id\n", seconds * 1e9 / (iterations * 4.0));
+}
+
+int main(int argc, char** argv)
+{
+	TestDevices();
+	TestServices();
+	TestMalformed();
+	Benchmark(argc > 1 ? atoi(argv[1]) : 100000);
+	return CheckResult();
+}
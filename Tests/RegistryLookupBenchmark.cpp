@@ -0,0 +1,89 @@
+#include <windows.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Check.h"
+#include "DeviceRegistry.h"
+#include "FakeBluetooth.h"
+#include "SimulatedRegistry.h"
+
+// --------------------------------------------------------------------------
+// Cost of finding a characteristic, as each read and write does, with 100
+// simulated connected devices: once with a snapshot taken per lookup, like
+// the exports do, and once on a snapshot kept across lookups
+// --------------------------------------------------------------------------
+
+static const int DeviceCount = 100;
+static const int CharacteristicCount = 8;
+
+struct Lookup
+{
+	BLEUtils::Uuid device;
+	BLEUtils::Uuid service;
+	BLEUtils::Uuid characteristic;
+};
+
+int main(int argc, char** argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+
+	BLEDeviceRegistry registry;
+	std::vector<FakeBluetooth::Device> devices;
+	{
+		auto writer = registry.Write();
+		for (int i = 0; i < DeviceCount; ++i)
+		{
+			devices.push_back(FakeBluetooth::MakeDevice(i, 2, CharacteristicCount));
+			AddSimulatedDevice(writer, registry, devices.back(), true);
+		}
+	}
+
+	// The same random mix for both runs
+	std::mt19937 random(42);
+	std::vector<Lookup> lookups(4096);
+	for (auto& lookup : lookups)
+	{
+		const auto& device = devices[random() % DeviceCount];
+		const auto& service = device.services[random() % device.services.size()];
+		lookup = { device.containerId, service.id, service.characteristics[random() % CharacteristicCount] };
+	}
+
+	size_t found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		const auto& lookup = lookups[i % lookups.size()];
+		auto snapshot = registry.Read();
+		auto cservice = snapshot->FindConnectedService(lookup.device, lookup.service);
+		found += cservice != nullptr && cservice->FindCharacteristic(lookup.characteristic) != nullptr;
+	}
+	double withSnapshot = SecondsSince(start);
+	CHECK(found == (size_t)iterations);
+
+	found = 0;
+	start = std::chrono::steady_clock::now();
+	{
+		auto snapshot = registry.Read();
+		for (int i = 0; i < iterations; ++i)
+		{
+			const auto& lookup = lookups[i % lookups.size()];
+			auto cservice = snapshot->FindConnectedService(lookup.device, lookup.service);
+			found += cservice != nullptr && cservice->FindCharacteristic(lookup.characteristic) != nullptr;
+		}
+	}
+	double lookupOnly = SecondsSince(start);
+	CHECK(found == (size_t)iterations);
+
+	// Misses go through the same path
+	auto snapshot = registry.Read();
+	CHECK(snapshot->FindConnectedService(BLEUtils::Uuid(1, 2), devices[0].services[0].id) == nullptr);
+	CHECK(snapshot->FindConnectedService(devices[0].containerId, devices[0].services[0].id)->FindCharacteristic(BLEUtils::Uuid(1, 2)) == nullptr);
+
+	printf("%d devices, %d characteristics per service\n", DeviceCount, CharacteristicCount);
+	printf("Lookup with a snapshot per lookup: %.1f ns\n", withSnapshot * 1e9 / iterations);
+	printf("Lookup on a kept snapshot:         %.1f ns\n", lookupOnly * 1e9 / iterations);
+	return CheckResult();
+}
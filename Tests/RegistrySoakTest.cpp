@@ -0,0 +1,149 @@
+#include <windows.h>
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "DeviceRegistry.h"
+#include "FakeBluetooth.h"
+#include "SimulatedRegistry.h"
+
+// --------------------------------------------------------------------------
+// Repeated connect / disconnect cycles while readers look devices up, after
+// which the registry must use the same memory as before the cycles started.
+//
+// Each writer connects and then removes its own set of devices in a loop,
+// the readers look up random characteristics of all of them meanwhile.
+// Memory is compared once every writer is done and a write published a
+// fresh copy of the snapshot, whose containers then have their settled size.
+// --------------------------------------------------------------------------
+
+static const int WriterCount = 2;
+static const int ReaderCount = 4;
+static const int DevicesPerWriter = 25;
+static const int CharacteristicCount = 6;
+
+static std::vector<FakeBluetooth::Device> devices;
+
+static void AddDevices(BLEDeviceRegistry& registry, int writer)
+{
+	auto w = registry.Write();
+	for (int i = 0; i < DevicesPerWriter; ++i)
+	{
+		AddSimulatedDevice(w, registry, devices[writer * DevicesPerWriter + i], true);
+	}
+}
+
+static void RemoveDevices(BLEDeviceRegistry& registry, int writer)
+{
+	auto w = registry.Write();
+	for (int i = 0; i < DevicesPerWriter; ++i)
+	{
+		RemoveSimulatedDevice(w, devices[writer * DevicesPerWriter + i].containerId);
+	}
+}
+
+// Publishes a copy of the current snapshot and frees what readers are done with
+static void Settle(BLEDeviceRegistry& registry)
+{
+	registry.Write().Edit();
+	registry.Write();
+}
+
+int main(int argc, char** argv)
+{
+	int cycles = argc > 1 ? atoi(argv[1]) : 1000;
+
+	for (int i = 0; i < WriterCount * DevicesPerWriter; ++i)
+	{
+		devices.push_back(FakeBluetooth::MakeDevice(i, 2, CharacteristicCount));
+	}
+
+	// One cycle with every device connected at once, as many as the readers can ever see
+	BLEDeviceRegistry registry;
+	for (int writer = 0; writer < WriterCount; ++writer)
+	{
+		AddDevices(registry, writer);
+	}
+	for (int writer = 0; writer < WriterCount; ++writer)
+	{
+		RemoveDevices(registry, writer);
+	}
+	Settle(registry);
+	size_t baseline = registry.BytesInUse();
+
+	std::atomic<bool> writersDone{ false };
+	std::atomic<size_t> lookups{ 0 };
+	std::atomic<size_t> incomplete{ 0 };
+	std::vector<std::thread> threads;
+	for (int reader = 0; reader < ReaderCount; ++reader)
+	{
+		threads.emplace_back([&, reader]()
+		{
+			std::mt19937 random(reader);
+			size_t count = 0;
+			while (!writersDone.load())
+			{
+				const auto& device = devices[random() % devices.size()];
+				const auto& service = device.services[random() % device.services.size()];
+				auto snapshot = registry.Read();
+				auto cservice = snapshot->FindConnectedService(device.containerId, service.id);
+				if (cservice != nullptr)
+				{
+					// A published connection is always complete
+					auto characteristic = cservice->FindCharacteristic(service.characteristics[random() % CharacteristicCount]);
+					if (characteristic == nullptr || cservice->characteristics.size() != CharacteristicCount || cservice->service->containerId != device.containerId)
+					{
+						incomplete.fetch_add(1);
+					}
+				}
+				++count;
+			}
+			lookups.fetch_add(count);
+		});
+	}
+
+	std::vector<std::thread> writers;
+	for (int writer = 0; writer < WriterCount; ++writer)
+	{
+		writers.emplace_back([&, writer]()
+		{
+			for (int cycle = 0; cycle < cycles; ++cycle)
+			{
+				AddDevices(registry, writer);
+				RemoveDevices(registry, writer);
+			}
+		});
+	}
+
+	// Memory in use while cycling, only bounded by what is connected and not yet freed
+	size_t peak = 0;
+	for (int i = 0; i < 20; ++i)
+	{
+		peak = std::max(peak, registry.BytesInUse());
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	for (auto& writer : writers)
+	{
+		writer.join();
+	}
+	writersDone.store(true);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	Settle(registry);
+	size_t final = registry.BytesInUse();
+	CHECK(incomplete.load() == 0);
+	CHECK(final == baseline);
+	CHECK(registry.Read()->devices.empty());
+
+	printf("%d cycles of %d writers, %zu lookups by %d readers\n", cycles, WriterCount, lookups.load(), ReaderCount);
+	printf("Bytes in use: %zu before, %zu after, %zu peak while cycling, %zu reserved\n", baseline, final, peak, registry.BytesReserved());
+	return CheckResult();
+}
@@ -0,0 +1,140 @@
+#include <windows.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "DiceBLEWin.h"
+#include "FakeDeviceSource.h"
+
+// --------------------------------------------------------------------------
+// Time until a scan reports its first device compared to the time it takes
+// to report them all, with 100 simulated devices that each take a while to
+// enumerate. The devices are reported as the enumeration finds them, so the
+// first one must not wait for the others.
+//
+// Goes through the exports as the mono side does: scanning, then calling
+// _winBluetoothLEUpdate() until every DiscoveredPeripheral message came back.
+// The very first round finds devices unknown to the library, the others
+// devices it already knows of.
+// --------------------------------------------------------------------------
+
+extern std::unique_ptr<BLEDeviceSource> deviceSource;
+
+using namespace std::chrono;
+
+static const int DeviceCount = 100;
+static const microseconds EntryLatency(200);
+
+static std::atomic<int> discovered{ 0 };
+static steady_clock::time_point firstDiscovered;
+
+static void OnMessage(const char* message)
+{
+	if (strncmp(message, "DiscoveredPeripheral~", strlen("DiscoveredPeripheral~")) == 0)
+	{
+		if (discovered.fetch_add(1) == 0)
+		{
+			firstDiscovered = steady_clock::now();
+		}
+	}
+}
+
+static void OnLog(timestamp_us_t, thread_id_t, const char*)
+{
+}
+
+struct Round
+{
+	double first;
+	double all;
+};
+
+// Scans until all the devices are reported or a few seconds passed
+static Round RunScan(FakeDeviceSource& source, const char* serviceUUIDs, int enumerations)
+{
+	discovered.store(0);
+	auto start = steady_clock::now();
+	_winBluetoothLEScanForPeripheralsWithServices(serviceUUIDs);
+	while (discovered.load() < DeviceCount && SecondsSince(start) < 5.0)
+	{
+		_winBluetoothLEUpdate();
+		std::this_thread::sleep_for(microseconds(50));
+	}
+	auto all = steady_clock::now();
+	CHECK(discovered.load() == DeviceCount);
+
+	// The enumeration publishes what it found before the next round starts
+	CHECK(source.WaitForEnumerations(enumerations, seconds(5)));
+	_winBluetoothLEStopScan();
+	_winBluetoothLEUpdate();
+
+	return { duration<double>(firstDiscovered - start).count(), duration<double>(all - start).count() };
+}
+
+static void PrintRounds(const char* name, const std::vector<Round>& rounds, size_t from)
+{
+	double first = 0, all = 0;
+	for (size_t i = from; i < rounds.size(); ++i)
+	{
+		first += rounds[i].first;
+		all += rounds[i].all;
+	}
+	size_t count = rounds.size() > from ? rounds.size() - from : 1;
+	printf("%s: first after %.2f ms, all after %.2f ms\n", name, first * 1e3 / count, all * 1e3 / count);
+}
+
+int main(int argc, char** argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 10;
+
+	std::vector<FakeBluetooth::Device> devices;
+	for (int i = 0; i < DeviceCount; ++i)
+	{
+		devices.push_back(FakeBluetooth::MakeDevice(i));
+	}
+	auto source = new FakeDeviceSource();
+	source->SetDevices(devices);
+	source->SetEntryLatency(EntryLatency);
+	deviceSource.reset(source);
+
+	_winBluetoothLEConnectCallbacks(OnMessage, OnLog, OnLog, OnLog);
+	_winBluetoothLEInitialize(true, false);
+	_winBluetoothLESetScanInterval(10000);
+
+	// Every device, then only those with the dice service, which shows up after the device
+	int enumerations = 0;
+	std::vector<Round> allDevices, withService;
+	for (int i = 0; i < rounds; ++i)
+	{
+		allDevices.push_back(RunScan(*source, nullptr, ++enumerations));
+	}
+	std::string serviceUUIDs = BLEUtils::UuidToString(FakeBluetooth::MakeServiceId(0));
+	for (int i = 0; i < rounds; ++i)
+	{
+		withService.push_back(RunScan(*source, serviceUUIDs.c_str(), ++enumerations));
+	}
+
+	// Well before the end of the enumeration, which takes 2 entries per device
+	for (const auto& round : allDevices)
+	{
+		CHECK(round.first * 4 < round.all);
+	}
+	for (const auto& round : withService)
+	{
+		CHECK(round.first * 4 < round.all);
+	}
+
+	_winBluetoothLEDeInitialize();
+
+	printf("%d devices, %lld us per enumerated entry\n", DeviceCount, (long long)EntryLatency.count());
+	printf("Unknown devices:             first after %.2f ms, all after %.2f ms\n", allDevices[0].first * 1e3, allDevices[0].all * 1e3);
+	PrintRounds("Known devices              ", allDevices, 1);
+	PrintRounds("Known devices, with service", withService, 0);
+	return CheckResult();
+}
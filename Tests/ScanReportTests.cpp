@@ -0,0 +1,49 @@
+#include <windows.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "Check.h"
+#include "DiceBLEWin.h"
+#include "FakeBluetooth.h"
+#include "SimulatedLibrary.h"
+
+// --------------------------------------------------------------------------
+// What a scan filtered on a service reports while devices get connected to:
+// a connected device isn't reported again, nor lost, until it goes away.
+// --------------------------------------------------------------------------
+
+using namespace std::chrono;
+
+int main()
+{
+	SimulatedLibrary::HookMessages();
+	auto device = FakeBluetooth::MakeDevice(0);
+	auto other = FakeBluetooth::MakeDevice(1);
+	std::string address = SimulatedLibrary::AddressOf(device);
+	std::string otherAddress = SimulatedLibrary::AddressOf(other);
+	CHECK(SimulatedLibrary::AddAndScan({ device, other }));
+
+	std::string serviceUUIDs = BLEUtils::UuidToString(FakeBluetooth::MakeServiceId(0));
+	_winBluetoothLESetScanInterval(10);
+	_winBluetoothLEScanForPeripheralsWithServices(serviceUUIDs.c_str());
+	CHECK(SimulatedLibrary::WaitForMessages("DiscoveredPeripheral~", 2, seconds(5)).size() == 2);
+
+	// Connecting while scanning, the next scans see its service connected
+	_winBluetoothLEConnectToPeripheral(address.c_str());
+	std::this_thread::sleep_for(milliseconds(100));
+	for (const auto& message : SimulatedLibrary::TakeMessages())
+	{
+		CHECK(!SimulatedLibrary::StartsWith(message, "LostPeripheral~"));
+		CHECK(!SimulatedLibrary::StartsWith(message, "DiscoveredPeripheral~"));
+	}
+
+	// Devices that go away are still lost
+	FakeBluetooth::RemoveDevice(other.containerId);
+	auto lost = SimulatedLibrary::WaitForMessages("LostPeripheral~", 1, seconds(5));
+	CHECK(lost.size() == 1 && lost[0] == "LostPeripheral~" + otherAddress);
+
+	_winBluetoothLEDeInitialize();
+	return CheckResult();
+}
@@ -0,0 +1,205 @@
+#include <windows.h>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "DeviceRegistry.h"
+#include "FakeDeviceSource.h"
+#include "ScanScheduler.h"
+
+// --------------------------------------------------------------------------
+// BLEScanScheduler running scans of a fake device source. Each scan reports
+// what it found only if its generation is still current, as the library's
+// scan does, and the tests look at what was reported.
+// --------------------------------------------------------------------------
+
+using namespace std::chrono;
+
+class ScanRecorder
+{
+public:
+	ScanRecorder(BLEScanScheduler& scheduler, FakeDeviceSource& source, BLEDeviceRegistry& registry)
+		: _scheduler(scheduler), _source(source), _registry(registry) {}
+
+	BLEScanScheduler::Scan Scan()
+	{
+		return [this](std::uint64_t generation)
+		{
+			{
+				const std::lock_guard<std::mutex> lock{ _mutex };
+				_started.push_back(generation);
+			}
+			BLEScanResult result;
+			_source.Enumerate(*_registry.Read(), result, nullptr);
+			if (_scheduler.IsCurrent(generation))
+			{
+				const std::lock_guard<std::mutex> lock{ _mutex };
+				_reported.push_back(generation);
+			}
+		};
+	}
+
+	std::vector<std::uint64_t> Started()
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		return _started;
+	}
+
+	std::vector<std::uint64_t> Reported()
+	{
+		const std::lock_guard<std::mutex> lock{ _mutex };
+		return _reported;
+	}
+
+private:
+	BLEScanScheduler& _scheduler;
+	FakeDeviceSource& _source;
+	BLEDeviceRegistry& _registry;
+	std::mutex _mutex;
+	std::vector<std::uint64_t> _started;
+	std::vector<std::uint64_t> _reported;
+};
+
+// Each start begins a new generation, an older one is never current again
+static void TestGenerations()
+{
+	BLEDeviceRegistry registry;
+	FakeDeviceSource source;
+	source.SetDevices({ FakeBluetooth::MakeDevice(0) });
+	BLEScanScheduler scheduler;
+	scheduler.SetInterval(seconds(10));
+	ScanRecorder recorder(scheduler, source, registry);
+
+	scheduler.Start(recorder.Scan());
+	CHECK(source.WaitForEnumerations(1, seconds(5)));
+	CHECK(scheduler.IsRunning());
+	std::this_thread::sleep_for(milliseconds(20));
+	auto first = recorder.Reported();
+	CHECK(first.size() == 1);
+	CHECK(!first.empty() && scheduler.IsCurrent(first[0]));
+
+	// Restarting scans again right away, without waiting for the interval
+	scheduler.Start(recorder.Scan());
+	CHECK(source.WaitForEnumerations(2, seconds(5)));
+	std::this_thread::sleep_for(milliseconds(20));
+	auto second = recorder.Reported();
+	CHECK(second.size() == 2);
+	if (first.size() == 1 && second.size() == 2)
+	{
+		CHECK(second[1] > first[0]);
+		CHECK(!scheduler.IsCurrent(first[0]));
+		CHECK(scheduler.IsCurrent(second[1]));
+	}
+
+	scheduler.Stop();
+	CHECK(!scheduler.IsRunning());
+	CHECK(second.size() != 2 || !scheduler.IsCurrent(second[1]));
+	scheduler.Shutdown();
+	CHECK(source.Enumerations() == 2);
+}
+
+// A new interval applies to the wait in progress
+static void TestIntervalChanges()
+{
+	BLEDeviceRegistry registry;
+	FakeDeviceSource source;
+	BLEScanScheduler scheduler;
+	scheduler.SetInterval(seconds(10));
+	CHECK(scheduler.Interval() == seconds(10));
+	ScanRecorder recorder(scheduler, source, registry);
+
+	scheduler.Start(recorder.Scan());
+	CHECK(source.WaitForEnumerations(1, seconds(5)));
+	std::this_thread::sleep_for(milliseconds(50));
+	CHECK(source.Enumerations() == 1);
+
+	// Shorter, the next scan runs without waiting for the rest of the old interval
+	auto start = steady_clock::now();
+	scheduler.SetInterval(milliseconds(10));
+	CHECK(source.WaitForEnumerations(3, seconds(5)));
+	CHECK(SecondsSince(start) < 1.0);
+
+	// Longer, the scans stop coming
+	scheduler.SetInterval(seconds(10));
+	std::this_thread::sleep_for(milliseconds(50));
+	int count = source.Enumerations();
+	std::this_thread::sleep_for(milliseconds(100));
+	CHECK(source.Enumerations() == count);
+
+	// All the scans were reported, they were current
+	auto started = recorder.Started();
+	CHECK(recorder.Reported() == started);
+	for (auto generation : started)
+	{
+		CHECK(generation == started[0]);
+	}
+	scheduler.Shutdown();
+}
+
+// Stopping doesn't wait for the scan in progress, whose results are dropped
+static void TestStopDuringScan()
+{
+	BLEDeviceRegistry registry;
+	FakeDeviceSource source;
+	source.SetDevices({ FakeBluetooth::MakeDevice(0), FakeBluetooth::MakeDevice(1) });
+	BLEScanScheduler scheduler;
+	scheduler.SetInterval(milliseconds(10));
+	ScanRecorder recorder(scheduler, source, registry);
+
+	source.Hold();
+	scheduler.Start(recorder.Scan());
+	CHECK(source.WaitUntilHeld(seconds(5)));
+
+	auto start = steady_clock::now();
+	scheduler.Stop();
+	CHECK(SecondsSince(start) < 0.1);
+	CHECK(!scheduler.IsRunning());
+
+	source.Release();
+	CHECK(source.WaitForEnumerations(1, seconds(5)));
+	std::this_thread::sleep_for(milliseconds(50));
+	CHECK(recorder.Started().size() == 1);
+	CHECK(recorder.Reported().empty());
+	CHECK(source.Enumerations() == 1);
+
+	// Restarting while the stopped scan is still running: that one is dropped, the new one reported
+	source.Hold();
+	scheduler.Start(recorder.Scan());
+	CHECK(source.WaitUntilHeld(seconds(5)));
+	auto stale = recorder.Started().back();
+	scheduler.Stop();
+	scheduler.Start(recorder.Scan());
+	source.Release();
+	CHECK(source.WaitForEnumerations(3, seconds(5)));
+	std::this_thread::sleep_for(milliseconds(20));
+	auto reported = recorder.Reported();
+	CHECK(!reported.empty());
+	for (auto generation : reported)
+	{
+		CHECK(generation > stale);
+	}
+
+	// Shutting down while a scan is held waits for it
+	source.Hold();
+	CHECK(source.WaitUntilHeld(seconds(5)));
+	std::thread release([&source]()
+	{
+		std::this_thread::sleep_for(milliseconds(20));
+		source.Release();
+	});
+	scheduler.Shutdown();
+	CHECK(!scheduler.IsRunning());
+	release.join();
+}
+
+int main()
+{
+	TestGenerations();
+	TestIntervalChanges();
+	TestStopDuringScan();
+	return CheckResult();
+}
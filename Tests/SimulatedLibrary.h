@@ -0,0 +1,128 @@
+#pragma once
+
+#include <windows.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DeviceRegistry.h"
+#include "DiceBLEWin.h"
+#include "FakeBluetooth.h"
+
+// --------------------------------------------------------------------------
+// Drives the library through its exports as the mono side does, against the
+// simulated devices: the messages are received through the callbacks, which
+// _winBluetoothLEUpdate() calls, and the devices are scanned and connected
+// to with the SetupDi and GATT fakes.
+// --------------------------------------------------------------------------
+
+extern BLEDeviceRegistry registry;
+
+namespace SimulatedLibrary
+{
+	inline std::mutex& MessageMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	inline std::vector<std::string>& Messages()
+	{
+		static std::vector<std::string> messages;
+		return messages;
+	}
+
+	inline void OnMessage(const char* message)
+	{
+		const std::lock_guard<std::mutex> lock{ MessageMutex() };
+		Messages().push_back(message);
+	}
+
+	inline void OnLog(timestamp_us_t, thread_id_t, const char*)
+	{
+	}
+
+	inline void HookMessages()
+	{
+		_winBluetoothLEConnectCallbacks(OnMessage, OnLog, OnLog, OnLog);
+	}
+
+	// Delivers the queued messages and returns those received so far, which are forgotten
+	inline std::vector<std::string> TakeMessages()
+	{
+		_winBluetoothLEUpdate();
+		const std::lock_guard<std::mutex> lock{ MessageMutex() };
+		std::vector<std::string> messages;
+		messages.swap(Messages());
+		return messages;
+	}
+
+	inline bool StartsWith(const std::string& message, const std::string& prefix)
+	{
+		return message.compare(0, prefix.size(), prefix) == 0;
+	}
+
+	// Waits for count messages starting with prefix, the others are dropped.
+	// Returns the matching messages, fewer than count on timeout.
+	inline std::vector<std::string> WaitForMessages(const std::string& prefix, size_t count, std::chrono::milliseconds timeout)
+	{
+		std::vector<std::string> matching;
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		while (matching.size() < count)
+		{
+			for (auto& message : TakeMessages())
+			{
+				if (StartsWith(message, prefix))
+				{
+					matching.push_back(std::move(message));
+				}
+			}
+			if (matching.size() >= count || std::chrono::steady_clock::now() > deadline)
+			{
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		return matching;
+	}
+
+	inline std::string AddressOf(const FakeBluetooth::Device& device)
+	{
+		return BLEUtils::UuidToString(device.containerId);
+	}
+
+	// Adds the devices and scans until the registry knows all their services, returns false on timeout
+	inline bool AddAndScan(const std::vector<FakeBluetooth::Device>& devices, std::chrono::milliseconds timeout = std::chrono::seconds(5))
+	{
+		size_t expected = 0;
+		for (const auto& device : devices)
+		{
+			FakeBluetooth::AddDevice(device);
+			expected += device.services.size();
+		}
+
+		_winBluetoothLEScanForPeripheralsWithServices(nullptr);
+		bool found = false;
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		while (!found && std::chrono::steady_clock::now() < deadline)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			size_t known = 0;
+			auto snapshot = registry.Read();
+			for (const auto& device : devices)
+			{
+				for (const auto& service : device.services)
+				{
+					known += snapshot->FindService(device.containerId, service.id) != nullptr;
+				}
+			}
+			found = known == expected;
+		}
+		_winBluetoothLEStopScan();
+		TakeMessages();
+		return found;
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <windows.h>
+#include <bluetoothleapis.h>
+
+#include <vector>
+
+#include "DeviceRegistry.h"
+#include "FakeBluetooth.h"
+
+// --------------------------------------------------------------------------
+// Fills a registry with simulated devices directly, as scanning and then
+// connecting to them would, for the tests that only exercise the registry
+// --------------------------------------------------------------------------
+inline std::vector<BTH_LE_GATT_CHARACTERISTIC> SimulatedCharacteristics(const FakeBluetooth::Service& service)
+{
+	std::vector<BTH_LE_GATT_CHARACTERISTIC> characteristics;
+	for (size_t i = 0; i < service.characteristics.size(); ++i)
+	{
+		BTH_LE_GATT_CHARACTERISTIC characteristic = {};
+		characteristic.ServiceHandle = 1;
+		characteristic.CharacteristicUuid = BLEUtils::UuidToBTHLEUUID(service.characteristics[i]);
+		characteristic.AttributeHandle = (USHORT)(2 + 3 * i);
+		characteristic.CharacteristicValueHandle = (USHORT)(3 + 3 * i);
+		characteristic.IsReadable = TRUE;
+		characteristic.IsWritable = TRUE;
+		characteristics.push_back(characteristic);
+	}
+	return characteristics;
+}
+
+// Adds the device and its services, and connects them if asked to
+inline void AddSimulatedDevice(BLEDeviceRegistry::Writer& writer, BLEDeviceRegistry& registry, const FakeBluetooth::Device& device, bool connect)
+{
+	auto info = registry.NewDevice();
+	info->containerId = device.containerId;
+	info->deviceName = device.name;
+	writer.Edit().AddDevice(info);
+
+	for (const auto& service : device.services)
+	{
+		auto serviceInfo = registry.NewService();
+		serviceInfo->containerId = device.containerId;
+		serviceInfo->id = service.id;
+		serviceInfo->name = "Service";
+		serviceInfo->path = "\\\\?\\BTHLEDEVICE#SIMULATED#" + BLEUtils::UuidToString(service.id);
+		writer.Edit().AddService(serviceInfo);
+
+		if (connect)
+		{
+			auto cservice = registry.NewConnectedService();
+			cservice->service = serviceInfo;
+			cservice->deviceHandle = INVALID_HANDLE_VALUE;
+			cservice->gattService.ServiceUuid = BLEUtils::UuidToBTHLEUUID(service.id);
+			cservice->gattService.AttributeHandle = 1;
+			cservice->SetCharacteristics(SimulatedCharacteristics(service));
+			writer.Edit().AddConnectedService(cservice);
+		}
+	}
+}
+
+// Disconnects and removes the device, its entries are freed once no reader uses them
+inline void RemoveSimulatedDevice(BLEDeviceRegistry::Writer& writer, const BLEUtils::Uuid& containerId)
+{
+	auto& snapshot = writer.Edit();
+	auto connected = snapshot.connectedServicesByDevice.find(containerId);
+	if (connected != snapshot.connectedServicesByDevice.end())
+	{
+		auto cservices = connected->second;
+		for (auto cservice : cservices)
+		{
+			snapshot.RemoveConnectedService(cservice);
+			writer.Retire(cservice);
+		}
+	}
+
+	std::vector<const BLEServiceInfo*> services;
+	for (auto service : snapshot.services)
+	{
+		if (service != nullptr && service->containerId == containerId)
+		{
+			services.push_back(service);
+		}
+	}
+	for (auto service : services)
+	{
+		snapshot.RemoveService(service);
+		writer.Retire(service);
+	}
+
+	auto device = snapshot.FindDevice(containerId);
+	if (device != nullptr)
+	{
+		snapshot.RemoveDevice(device);
+		writer.Retire(device);
+	}
+}
@@ -0,0 +1,160 @@
+#include <windows.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "DiceBLEWin.h"
+#include "FakeBluetooth.h"
+#include "SimulatedLibrary.h"
+
+// --------------------------------------------------------------------------
+// Allocations made by the write paths once warmed up, counted by replacing
+// the global operator new. Writes are synchronous here, so everything they
+// allocate is allocated on the test thread, the only one counted.
+//
+// Batched writes with statuses allocate nothing. A single write allocates
+// its reply message, and the message queue grows until the next update.
+// --------------------------------------------------------------------------
+
+static thread_local bool counting = false;
+static thread_local size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	if (counting)
+	{
+		++allocations;
+	}
+	void* p = malloc(size != 0 ? size : 1);
+	if (p == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+class AllocationCounter
+{
+public:
+	AllocationCounter() { allocations = 0; counting = true; }
+	~AllocationCounter() { counting = false; }
+	size_t Count() const { return allocations; }
+};
+
+static const int Iterations = 1000;
+
+static void TestBatchedWrites(const FakeBluetooth::Device& device)
+{
+	std::string address = SimulatedLibrary::AddressOf(device);
+	std::string service = BLEUtils::UuidToString(device.services[0].id);
+	std::string led = BLEUtils::UuidToString(device.services[0].characteristics[0]);
+	std::string other = BLEUtils::UuidToString(device.services[0].characteristics[1]);
+	unsigned char frame[20] = {};
+
+	// A burst of LED frames, with an occasional write to another characteristic
+	std::vector<BLEWriteRequest> requests;
+	for (int i = 0; i < 8; ++i)
+	{
+		requests.push_back({ address.c_str(), service.c_str(), i % 4 == 3 ? other.c_str() : led.c_str(), frame, (int)sizeof(frame), 0 });
+	}
+	std::vector<int> statuses(requests.size(), -1);
+
+	_winBluetoothLEWriteCharacteristics(requests.data(), (int)requests.size(), statuses.data());
+	size_t writes = FakeBluetooth::GetCounters().writes;
+	size_t count;
+	{
+		AllocationCounter counter;
+		for (int i = 0; i < Iterations; ++i)
+		{
+			frame[0] = (unsigned char)i;
+			_winBluetoothLEWriteCharacteristics(requests.data(), (int)requests.size(), statuses.data());
+		}
+		count = counter.Count();
+	}
+
+	CHECK(FakeBluetooth::GetCounters().writes - writes == Iterations * requests.size());
+	for (int status : statuses)
+	{
+		CHECK(status == S_OK);
+	}
+	CHECK(count == 0);
+	printf("Batched writes: %zu allocations for %zu writes\n", count, Iterations * requests.size());
+}
+
+static void TestSingleWrites(const FakeBluetooth::Device& device)
+{
+	std::string address = SimulatedLibrary::AddressOf(device);
+	std::string service = BLEUtils::UuidToString(device.services[0].id);
+	std::string led = BLEUtils::UuidToString(device.services[0].characteristics[0]);
+	unsigned char frame[20] = {};
+
+	_winBluetoothLEWriteCharacteristic(address.c_str(), service.c_str(), led.c_str(), frame, (int)sizeof(frame), false);
+	SimulatedLibrary::TakeMessages();
+
+	size_t count;
+	{
+		AllocationCounter counter;
+		for (int i = 0; i < Iterations; ++i)
+		{
+			frame[0] = (unsigned char)i;
+			_winBluetoothLEWriteCharacteristic(address.c_str(), service.c_str(), led.c_str(), frame, (int)sizeof(frame), false);
+		}
+		count = counter.Count();
+	}
+
+	auto messages = SimulatedLibrary::TakeMessages();
+	size_t replies = 0;
+	for (const auto& message : messages)
+	{
+		replies += SimulatedLibrary::StartsWith(message, "DidWriteCharacteristic~" + led);
+	}
+	CHECK(replies == (size_t)Iterations);
+
+	// One message per write, plus the growth of the queue, by doubling
+	CHECK(count <= (size_t)Iterations + 16);
+	printf("Single writes:  %zu allocations for %d writes\n", count, Iterations);
+}
+
+int main()
+{
+	SimulatedLibrary::HookMessages();
+	auto device = FakeBluetooth::MakeDevice(0, 1, 4);
+	CHECK(SimulatedLibrary::AddAndScan({ device }));
+	_winBluetoothLEConnectToPeripheral(SimulatedLibrary::AddressOf(device).c_str());
+	CHECK(registry.Read()->FindConnectedService(device.containerId, device.services[0].id) != nullptr);
+
+	TestBatchedWrites(device);
+	TestSingleWrites(device);
+
+	_winBluetoothLEDeInitialize();
+	return CheckResult();
+}
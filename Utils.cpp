@@ -8,30 +8,234 @@
 #include <bthdef.h>
 #include <bluetoothleapis.h>
 
-#include <sstream>
+#include <algorithm>	// std::equal, std::find
 #include <array>
+#include <cstring>		// strlen, memcpy
+#include <cwchar>		// wcslen
 
 // --------------------------------------------------------------------------
 // Helper utilities
 
-std::string BLEUtils::ToNarrow(const wchar_t *s, char def, const std::locale& loc)
+// --------------------------------------------------------------------------
+// UTF-16 <-> UTF-8 transcoding
+// Runs of ASCII are converted 8 (resp. 16) code units at a time with SSE2,
+// everything else goes through the scalar path below.
+// --------------------------------------------------------------------------
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define BLEUTILS_SSE2
+#include <emmintrin.h>
+#endif
+
+static_assert(sizeof(wchar_t) == 2, "wchar_t is expected to hold UTF-16 code units");
+
+static const unsigned int ReplacementCharacter = 0xFFFD;
+
+size_t BLEUtils::WideToUtf8(const wchar_t* src, size_t srcLength, char* dst, size_t dstCapacity)
 {
-	std::ostringstream stm;
-	while (*s != L'\0')
+	size_t i = 0;
+	size_t o = 0;
+	bool full = false; // Once a code point didn't fit we stop writing but keep counting
+
+#if defined(BLEUTILS_SSE2)
+	const __m128i nonAsciiMask = _mm_set1_epi16((short)0xFF80);
+	const __m128i zero = _mm_setzero_si128();
+#endif
+
+	while (i < srcLength)
 	{
-		stm << std::use_facet< std::ctype<wchar_t> >(loc).narrow(*s++, def);
+#if defined(BLEUTILS_SSE2)
+		if (i + 8 <= srcLength)
+		{
+			__m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, nonAsciiMask), zero)) == 0xFFFF)
+			{
+				if (!full && o + 8 <= dstCapacity)
+				{
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + o), _mm_packus_epi16(units, units));
+				}
+				else
+				{
+					full = true;
+				}
+				i += 8;
+				o += 8;
+				continue;
+			}
+		}
+#endif
+
+		unsigned int c = static_cast<unsigned short>(src[i++]);
+		if (c >= 0xD800 && c <= 0xDFFF)
+		{
+			// Surrogate pair, or a lone surrogate which we replace
+			unsigned int low = i < srcLength ? static_cast<unsigned short>(src[i]) : 0;
+			if (c <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF)
+			{
+				c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+				++i;
+			}
+			else
+			{
+				c = ReplacementCharacter;
+			}
+		}
+
+		char bytes[4];
+		size_t count;
+		if (c < 0x80)
+		{
+			bytes[0] = static_cast<char>(c);
+			count = 1;
+		}
+		else if (c < 0x800)
+		{
+			bytes[0] = static_cast<char>(0xC0 | (c >> 6));
+			bytes[1] = static_cast<char>(0x80 | (c & 0x3F));
+			count = 2;
+		}
+		else if (c < 0x10000)
+		{
+			bytes[0] = static_cast<char>(0xE0 | (c >> 12));
+			bytes[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			bytes[2] = static_cast<char>(0x80 | (c & 0x3F));
+			count = 3;
+		}
+		else
+		{
+			bytes[0] = static_cast<char>(0xF0 | (c >> 18));
+			bytes[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+			bytes[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			bytes[3] = static_cast<char>(0x80 | (c & 0x3F));
+			count = 4;
+		}
+
+		if (!full && o + count <= dstCapacity)
+		{
+			memcpy(dst + o, bytes, count);
+		}
+		else
+		{
+			full = true;
+		}
+		o += count;
 	}
-	return stm.str();
+	return o;
 }
 
-std::wstring BLEUtils::ToWide(const char *s, const std::locale& loc)
+size_t BLEUtils::Utf8ToWide(const char* src, size_t srcLength, wchar_t* dst, size_t dstCapacity)
 {
-	std::wostringstream stm;
-	while (*s != L'\0')
+	const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+	size_t i = 0;
+	size_t o = 0;
+	bool full = false;
+
+#if defined(BLEUTILS_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+#endif
+
+	while (i < srcLength)
 	{
-		stm << std::use_facet< std::ctype<char> >(loc).widen(*s++);
+#if defined(BLEUTILS_SSE2)
+		if (i + 16 <= srcLength)
+		{
+			__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+			if (_mm_movemask_epi8(bytes) == 0)
+			{
+				if (!full && o + 16 <= dstCapacity)
+				{
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o), _mm_unpacklo_epi8(bytes, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o + 8), _mm_unpackhi_epi8(bytes, zero));
+				}
+				else
+				{
+					full = true;
+				}
+				i += 16;
+				o += 16;
+				continue;
+			}
+		}
+#endif
+
+		unsigned int c = s[i++];
+		if (c >= 0x80)
+		{
+			// Decode a multi-byte sequence, an ill-formed one is replaced by U+FFFD
+			// after skipping its maximal valid prefix
+			size_t extra;
+			unsigned char lo = 0x80, hi = 0xBF;
+			if (c >= 0xC2 && c <= 0xDF) { extra = 1; c &= 0x1F; }
+			else if (c >= 0xE0 && c <= 0xEF) { extra = 2; c &= 0x0F; if (c == 0x0) lo = 0xA0; else if (c == 0xD) hi = 0x9F; }
+			else if (c >= 0xF0 && c <= 0xF4) { extra = 3; c &= 0x07; if (c == 0x0) lo = 0x90; else if (c == 0x4) hi = 0x8F; }
+			else { extra = 0; c = ReplacementCharacter; }
+
+			for (size_t k = 0; k < extra; ++k)
+			{
+				unsigned char b = i < srcLength ? s[i] : 0;
+				if (b < lo || b > hi)
+				{
+					c = ReplacementCharacter;
+					break;
+				}
+				c = (c << 6) | (b & 0x3F);
+				lo = 0x80;
+				hi = 0xBF;
+				++i;
+			}
+		}
+
+		wchar_t units[2];
+		size_t count;
+		if (c < 0x10000)
+		{
+			units[0] = static_cast<wchar_t>(c);
+			count = 1;
+		}
+		else
+		{
+			c -= 0x10000;
+			units[0] = static_cast<wchar_t>(0xD800 + (c >> 10));
+			units[1] = static_cast<wchar_t>(0xDC00 + (c & 0x3FF));
+			count = 2;
+		}
+
+		if (!full && o + count <= dstCapacity)
+		{
+			memcpy(dst + o, units, count * sizeof(wchar_t));
+		}
+		else
+		{
+			full = true;
+		}
+		o += count;
 	}
-	return stm.str();
+	return o;
+}
+
+std::string BLEUtils::ToNarrow(const wchar_t* s)
+{
+	return s != nullptr ? ToNarrow(s, wcslen(s)) : std::string();
+}
+
+std::string BLEUtils::ToNarrow(const wchar_t* s, size_t length)
+{
+	// A UTF-16 code unit never needs more than 3 bytes, so a single conversion pass is enough
+	std::string ret(length * 3, '\0');
+	ret.resize(WideToUtf8(s, length, &ret[0], ret.size()));
+	return ret;
+}
+
+std::wstring BLEUtils::ToWide(const char* s)
+{
+	return s != nullptr ? ToWide(s, strlen(s)) : std::wstring();
+}
+
+std::wstring BLEUtils::ToWide(const char* s, size_t length)
+{
+	// Each UTF-8 byte produces at most one UTF-16 code unit
+	std::wstring ret(length, L'\0');
+	ret.resize(Utf8ToWide(s, length, &ret[0], ret.size()));
+	return ret;
 }
 
 std::string BLEUtils::GUIDToString(GUID guid)
@@ -122,22 +326,111 @@ BTH_LE_UUID BLEUtils::StringToBTHLEUUID(const std::string& guid)
 	return ret;
 }
 
+BLEUtils::Uuid BLEUtils::ToUuid(const GUID& guid)
+{
+	std::uint64_t data4 = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		data4 = (data4 << 8) | guid.Data4[i];
+	}
+	return Uuid((std::uint32_t)guid.Data1, guid.Data2, guid.Data3, data4);
+}
+
+BLEUtils::Uuid BLEUtils::ToUuid(const BTH_LE_UUID& bth_le_uuid)
+{
+	return bth_le_uuid.IsShortUuid ? Uuid::FromShortId(bth_le_uuid.Value.ShortUuid) : ToUuid(bth_le_uuid.Value.LongUuid);
+}
+
+GUID BLEUtils::UuidToGUID(const Uuid& uuid)
+{
+	GUID guid;
+	guid.Data1 = (unsigned long)(uuid.hi >> 32);
+	guid.Data2 = (unsigned short)(uuid.hi >> 16);
+	guid.Data3 = (unsigned short)uuid.hi;
+	for (int i = 0; i < 8; ++i)
+	{
+		guid.Data4[i] = (unsigned char)(uuid.lo >> (56 - 8 * i));
+	}
+	return guid;
+}
+
+BTH_LE_UUID BLEUtils::UuidToBTHLEUUID(const Uuid& uuid)
+{
+	BTH_LE_UUID ret;
+	if (uuid.IsShortId())
+	{
+		ret.IsShortUuid = true;
+		ret.Value.ShortUuid = uuid.ShortId();
+	}
+	else
+	{
+		ret.IsShortUuid = false;
+		ret.Value.LongUuid = UuidToGUID(uuid);
+	}
+	return ret;
+}
+
+BLEUtils::Uuid BLEUtils::StringToUuid(const std::string& uuid)
+{
+	return Uuid::Parse(uuid.c_str());
+}
+
+std::string BLEUtils::UuidToString(const Uuid& uuid)
+{
+	return GUIDToString(UuidToGUID(uuid));
+}
+
+std::string BLEUtils::UuidToBTHLEString(const Uuid& uuid)
+{
+	if (uuid.IsShortId())
+	{
+		std::array<char, 8> output;
+		snprintf(output.data(), output.size(), "%04X", uuid.ShortId());
+		return std::string(output.data());
+	}
+	else
+	{
+		return UuidToString(uuid);
+	}
+}
+
 // --------------------------------------------------------------------------
-// Parses a string of guid strings and generates a vector of GUID
+// Finds the kind of a hardware id and, for services, the UUID in braces,
+// i.e. from the first '{' to the last '}'.
 // --------------------------------------------------------------------------
-std::vector<BTH_LE_UUID> BLEUtils::GenerateGUIDList(const char* uuidString)
+BLEUtils::HardwareId BLEUtils::ParseHardwareId(const wchar_t* hardwareId, size_t length)
 {
-	// Parse serviceUUIDs into an array
-	std::stringstream ss(uuidString);
-	std::vector<BTH_LE_UUID> uuids;
-	while (ss.good())
+	static const wchar_t devicePrefix[] = L"BTHLE\\";
+	static const wchar_t servicePrefix[] = L"BTHLEDevice\\";
+	const size_t devicePrefixLength = sizeof(devicePrefix) / sizeof(wchar_t) - 1;
+	const size_t servicePrefixLength = sizeof(servicePrefix) / sizeof(wchar_t) - 1;
+
+	HardwareId ret = { HardwareIdKind::Other, nullptr, 0 };
+	if (hardwareId == nullptr)
 	{
-		std::string substr;
-		getline(ss, substr, '|');
-		uuids.push_back(BLEUtils::StringToBTHLEUUID(substr));
+		return ret;
 	}
 
-	return uuids;
+	const wchar_t* end = hardwareId + length;
+	if (length >= devicePrefixLength && std::equal(devicePrefix, devicePrefix + devicePrefixLength, hardwareId))
+	{
+		ret.kind = HardwareIdKind::Device;
+	}
+	else if (length >= servicePrefixLength && std::equal(servicePrefix, servicePrefix + servicePrefixLength, hardwareId))
+	{
+		ret.kind = HardwareIdKind::Service;
+		const wchar_t* open = std::find(hardwareId + servicePrefixLength, end, L'{');
+		for (const wchar_t* close = end; close > open; )
+		{
+			if (*--close == L'}')
+			{
+				ret.guid = open;
+				ret.guidLength = close - open + 1;
+				break;
+			}
+		}
+	}
+	return ret;
 }
 
 
@@ -237,7 +530,7 @@ std::string BLEUtils::Base64Decode(std::string const& encoded_string) {
 	return ret;
 }
 
-BTH_LE_UUID BLEUtils::MakeBTHLEUUID(USHORT shortId)
+BTH_LE_UUID BLEUtils::MakeBTHLEUUID(std::uint16_t shortId)
 {
 	BTH_LE_UUID ret;
 	ret.IsShortUuid = true;
@@ -248,30 +541,7 @@ BTH_LE_UUID BLEUtils::MakeBTHLEUUID(USHORT shortId)
 
 bool operator==(const BTH_LE_UUID& a, const BTH_LE_UUID& b)
 {
-	if (a.IsShortUuid != b.IsShortUuid)
-	{
-		if (a.IsShortUuid)
-		{
-			GUID longB = b.Value.LongUuid;
-			USHORT shortB = (USHORT)longB.Data1;
-			longB.Data1 = 0;
-			return (longB == BTH_LE_ATT_BLUETOOTH_BASE_GUID && shortB == a.Value.ShortUuid);
-		}
-		else
-		{
-			GUID longA = a.Value.LongUuid;
-			USHORT shortA = (USHORT)longA.Data1;
-			longA.Data1 = 0;
-			return (longA == BTH_LE_ATT_BLUETOOTH_BASE_GUID && shortA == b.Value.ShortUuid);
-		}
-	}
-	else
-	{
-		if (a.IsShortUuid)
-			return a.Value.ShortUuid == b.Value.ShortUuid;
-		else
-			return a.Value.LongUuid == b.Value.LongUuid;
-	}
+	return BLEUtils::ToUuid(a) == BLEUtils::ToUuid(b);
 }
 
 bool operator!=(const BTH_LE_UUID& a, const BTH_LE_UUID& b)
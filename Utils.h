@@ -2,7 +2,9 @@
 
 #include <string>
 #include <vector>
-#include <locale>
+#include <cstddef>
+#include <cstdint>
+#include <functional>	// std::hash
 
 // Forwards
 struct _GUID;
@@ -12,18 +14,128 @@ typedef _BTH_LE_UUID BTH_LE_UUID;
 
 namespace BLEUtils
 {
-	std::string ToNarrow(const wchar_t *s, char def = '?', const std::locale& loc = std::locale());
-	std::wstring ToWide(const char *s, const std::locale& loc = std::locale());
+	// --------------------------------------------------------------------------
+	// Canonical 128-bit UUID, stored as two 64-bit words in textual byte order.
+	// Bluetooth short ids are expanded with the Bluetooth base UUID, so each UUID
+	// has a single representation and can be compared and hashed as plain words.
+	// Convert from/to GUID and BTH_LE_UUID only when talking to the OS.
+	// --------------------------------------------------------------------------
+	struct Uuid
+	{
+		std::uint64_t hi; // Data1, Data2, Data3
+		std::uint64_t lo; // Data4
+
+		constexpr Uuid() : hi(0), lo(0) {}
+		constexpr Uuid(std::uint64_t high, std::uint64_t low) : hi(high), lo(low) {}
+		constexpr Uuid(std::uint32_t data1, std::uint16_t data2, std::uint16_t data3, std::uint64_t data4)
+			: hi(((std::uint64_t)data1 << 32) | ((std::uint64_t)data2 << 16) | data3), lo(data4) {}
+
+		static constexpr std::uint64_t BaseHi = 0x0000000000001000ull;
+		static constexpr std::uint64_t BaseLo = 0x800000805F9B34FBull;
+
+		// Expands a Bluetooth SIG assigned id, i.e. 0000xxxx-0000-1000-8000-00805F9B34FB
+		static constexpr Uuid FromShortId(std::uint32_t shortId) { return Uuid(BaseHi | ((std::uint64_t)shortId << 32), BaseLo); }
+
+		// Parses "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" (with or without braces) or a short id
+		// made of up to 8 hex digits, returns a null UUID if the string is invalid.
+		// Stops at end if given, or at the null terminator.
+		template <typename Char>
+		static constexpr Uuid Parse(const Char* s, const Char* end = nullptr)
+		{
+			std::uint64_t words[2] = { 0, 0 };
+			int digits = 0;
+			for (; s != end && *s != 0; ++s)
+			{
+				Char c = *s;
+				int value =
+					(c >= '0' && c <= '9') ? c - '0' :
+					(c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+					(c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+				if (value >= 0 && digits < 32)
+				{
+					words[digits / 16] = (words[digits / 16] << 4) | (std::uint64_t)value;
+					++digits;
+				}
+				else if (c != '-' && c != '{' && c != '}')
+				{
+					return Uuid();
+				}
+			}
+			return digits == 32 ? Uuid(words[0], words[1])
+				: (digits > 0 && digits <= 8) ? FromShortId((std::uint32_t)words[0])
+				: Uuid();
+		}
+
+		constexpr bool IsNull() const { return (hi | lo) == 0; }
+		constexpr bool IsShortId() const { return (hi & 0xFFFF0000FFFFFFFFull) == BaseHi && lo == BaseLo; }
+		constexpr std::uint16_t ShortId() const { return (std::uint16_t)(hi >> 32); }
+
+		size_t Hash() const
+		{
+			// 64-bit finalizer (from splitmix64) over both words
+			std::uint64_t x = hi ^ (lo * 0x9E3779B97F4A7C15ull);
+			x ^= x >> 30;
+			x *= 0xBF58476D1CE4E5B9ull;
+			x ^= x >> 27;
+			x *= 0x94D049BB133111EBull;
+			x ^= x >> 31;
+			return (size_t)x;
+		}
+	};
+
+	constexpr bool operator==(const Uuid& a, const Uuid& b) { return ((a.hi ^ b.hi) | (a.lo ^ b.lo)) == 0; }
+	constexpr bool operator!=(const Uuid& a, const Uuid& b) { return !(a == b); }
+	constexpr bool operator<(const Uuid& a, const Uuid& b) { return (a.hi < b.hi) | ((a.hi == b.hi) & (a.lo < b.lo)); }
+
+	Uuid ToUuid(const GUID& guid);
+	Uuid ToUuid(const BTH_LE_UUID& bth_le_uuid);
+	GUID UuidToGUID(const Uuid& uuid);
+	BTH_LE_UUID UuidToBTHLEUUID(const Uuid& uuid);
+	Uuid StringToUuid(const std::string& uuid);
+	std::string UuidToString(const Uuid& uuid);		// Always the full form, for container ids
+	std::string UuidToBTHLEString(const Uuid& uuid);	// Short form for Bluetooth SIG ids, like BTHLEGUIDToString()
+
+	// UTF-16 <-> UTF-8 transcoding, ill-formed input is replaced by U+FFFD.
+	// The buffer versions return the number of code units the whole conversion requires,
+	// and only write complete code points that fit in dstCapacity (pass 0 to measure).
+	size_t WideToUtf8(const wchar_t* src, size_t srcLength, char* dst, size_t dstCapacity);
+	size_t Utf8ToWide(const char* src, size_t srcLength, wchar_t* dst, size_t dstCapacity);
+	std::string ToNarrow(const wchar_t* s);
+	std::string ToNarrow(const wchar_t* s, size_t length);
+	std::wstring ToWide(const char* s);
+	std::wstring ToWide(const char* s, size_t length);
 	std::string GUIDToString(GUID guid);
 	std::string BTHLEGUIDToString(const BTH_LE_UUID& bth_le_uuid);
 	BTH_LE_UUID StringToBTHLEUUID(const std::string& guid);
 	GUID StringToGUID(const std::string& guid);
 	GUID BTHLEGUIDToGUID(const BTH_LE_UUID& bth_le_uuid);
 	BTH_LE_UUID GUIDToBTHLEGUID(const GUID& guid);
-	std::vector<BTH_LE_UUID> GenerateGUIDList(const char* uuidString);
+
+	// Bluetooth LE entries of the device list, "BTHLE\..." for devices and
+	// "BTHLEDevice\{service uuid}_..." for their GATT services
+	enum class HardwareIdKind { Other, Device, Service };
+
+	struct HardwareId
+	{
+		HardwareIdKind kind;
+		const wchar_t* guid; // Service UUID with its braces, points into the parsed string, null if missing
+		size_t guidLength;
+	};
+
+	// Identifies a hardware id in a single pass without allocating
+	HardwareId ParseHardwareId(const wchar_t* hardwareId, size_t length);
 	std::string Base64Encode(unsigned char const* bytes_to_encode, unsigned int in_len);
 	std::string Base64Decode(std::string const& encoded_string);
-	BTH_LE_UUID MakeBTHLEUUID(USHORT shortId);
+	BTH_LE_UUID MakeBTHLEUUID(std::uint16_t shortId);
+}
+
+namespace std
+{
+	template<>
+	struct hash<BLEUtils::Uuid>
+	{
+		size_t operator()(const BLEUtils::Uuid& uuid) const { return uuid.Hash(); }
+	};
 }
 
 bool operator==(const BTH_LE_UUID& a, const BTH_LE_UUID& b);